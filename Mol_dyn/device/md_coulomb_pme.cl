@@ -0,0 +1,72 @@
+/**
+ * @file md_coulomb_pme.cl
+ * @brief OpenCL kernel which calculate real space part of particle-mesh Ewald energy and force
+ */
+
+#include "parameters.h"
+/**
+ * @brief OpenCL kernel for real space part of coulomb potential, reciprocal part is calculated on host
+ * @param particles Position array
+ * @param charge Charge array
+ * @param out_energy Energy which describe how one particles iteract which all others inside rc
+ * @param out_force Force acting on the particle from all others inside rc
+ * @param beta Ewald splitting parameter
+ * @return void
+ */
+__attribute__((reqd_work_group_size(particles_count, 1, 1)))
+__kernel void md(__global const float3 *restrict particles,
+                 __global const int *restrict charge,
+                 __global float *restrict out_energy,
+                 __global float3 *restrict out_force,
+                 const float beta) {
+
+    int index = get_global_id(0);
+    float energy = 0;
+    float3 force = (float3)(0, 0, 0);
+    #pragma unroll 2
+    for (int i = 0; i < particles_count; i++) {
+        float x = particles[i].x - particles[index].x;
+        float y = particles[i].y - particles[index].y;
+        float z = particles[i].z - particles[index].z;
+        /* second part of implementation periodic boundary conditions */
+        if (x > half_box)
+            x -= box_size;
+        else {
+            if (x < -half_box)
+                x += box_size;
+        }
+        if (y > half_box)
+            y -= box_size;
+        else {
+            if (y < -half_box)
+                y += box_size;
+        }
+        if (z > half_box)
+            z -= box_size;
+        else {
+            if (z < -half_box)
+                z += box_size;
+        }
+        float3 r = (float3)(x, y, z);
+        float sq_dist = x * x + y * y + z * z;
+        if ((sq_dist < (rc * rc)) && (i != index)) {
+            float dist = sqrt(sq_dist);
+            float inv_dist = native_divide(1, dist);
+            float inv_dist_square = inv_dist * inv_dist;
+            /* erf(beta * r) / r part of potential is calculated on grid */
+            float ewald = erf(beta * dist);
+            float ewald_derivative = beta * M_2_SQRTPI_F * exp(-beta * beta * sq_dist);
+            float potential = 1;
+            float derivative = 0;
+            if ((charge[index] == -1) || (charge[i] == -1)){
+                float erf_arg = native_divide(dist, SIGMA);
+                potential = erf(erf_arg);
+                derivative = DERIVATIVE_ERF * native_exp(-erf_arg * erf_arg);
+            }
+            energy += charge[i] * charge[index] * (potential - ewald) * inv_dist;
+            force += r * charge[i] * charge[index] * (-(derivative - ewald_derivative) * inv_dist_square + (potential - ewald) * inv_dist_square * inv_dist);
+        }
+    }
+    out_force[index] = force;
+    out_energy[index] = energy;
+}
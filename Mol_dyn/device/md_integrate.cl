@@ -0,0 +1,43 @@
+/**
+ * @file md_integrate.cl
+ * @brief OpenCL kernel which integrates motion equations and wraps positions on device
+ */
+
+#include "parameters.h"
+/**
+ * @brief OpenCL kernel for velocity Verlet kick, drift and first part of periodic boundary conditions
+ * @param position Position array, stays on device for whole run
+ * @param velocity Velocity array, stays on device for whole run
+ * @param force Force array from previous step
+ * @param nearest Nearest image array, input of force kernel
+ * @param kick v += f * kick
+ * @param drift r += v * drift
+ * @return void
+ */
+__kernel void integrate(__global float3 *restrict position,
+                        __global float3 *restrict velocity,
+                        __global const float3 *restrict force,
+                        __global float3 *restrict nearest,
+                        const float kick,
+                        const float drift) {
+
+    int index = get_global_id(0);
+    float3 v = velocity[index] + force[index] * kick;
+    float3 r = position[index] + v * drift;
+    velocity[index] = v;
+    position[index] = r;
+    float3 image;
+    if (r.x > 0)
+        image.x = fmod(r.x + half_box, box_size) - half_box;
+    else
+        image.x = fmod(r.x - half_box, box_size) + half_box;
+    if (r.y > 0)
+        image.y = fmod(r.y + half_box, box_size) - half_box;
+    else
+        image.y = fmod(r.y - half_box, box_size) + half_box;
+    if (r.z > 0)
+        image.z = fmod(r.z + half_box, box_size) - half_box;
+    else
+        image.z = fmod(r.z - half_box, box_size) + half_box;
+    nearest[index] = image;
+}
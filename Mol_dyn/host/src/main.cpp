@@ -12,6 +12,13 @@
  * Includes
  */
 #include "headers.h"
+#include "pme.h"
+#include "program_cache.h"
+#include "reduce.h"
+#include "trace.h"
+#include "autotune.h"
+#include <mutex>
+#include <condition_variable>
  /** add MD algorithm implementation */
 #include "md.cpp"
 
@@ -43,60 +50,327 @@ cl_context context = NULL;
 cl_command_queue queue;
 cl_program program = NULL;
 cl_kernel kernel;
+/** LJ kernel for RESPA, main kernel is coulomb one in this case */
+cl_program lj_program = NULL;
+cl_kernel lj_kernel = NULL;
 cl_mem nearest_buf;
 cl_mem output_energy_buf;
 cl_mem output_force_buf;
 cl_mem charge_buf;
 
+/*
+ * Device-resident MD loop, positions and velocities stay on device and results are read every output_interval steps,
+ * 0 means that host integrates motion equations
+ */
+int output_interval = 0;
+cl_program integrate_program = NULL;
+cl_kernel integrate_kernel = NULL;
+cl_mem position_buf = NULL;
+cl_mem velocity_buf = NULL;
+cl_event *force_events = NULL;
+int force_events_count = 0;
+/** integrate kernel events are kept until results are read to record them in trace */
+cl_event *integrate_events = NULL;
+int integrate_events_count = 0;
+
+/*
+ * Energy is summed on device and one value is read instead of energy array, float or compensated sum
+ */
+bool device_reduce = false;
+bool compensated_reduce = false;
+cl_program reduce_program = NULL;
+energy_reduction reduction = {};
+double reduced_energy = 0.;
+
+/*
+ * Particle decomposition over devices, each device has a copy of nearest and calculates energy and forces
+ * of its range of particles, ranges are balanced with measured kernel times every balance_interval steps
+ */
+struct device_part {
+    cl_device_id device;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem nearest_buf;
+    cl_mem charge_buf;
+    cl_mem energy_buf;
+    cl_mem force_buf;
+    /** range in work-groups */
+    int first_group;
+    int groups;
+    /** kernel time since last balancing in ns */
+    double kernel_time;
+};
+int devices_count = 1;
+bool sub_devices = false;
+bool multi_coulomb = false;
+device_part parts[MAX_DEVICES_COUNT] = {};
+int balance_interval = 10;
+int balance_steps = 0;
+
+/*
+ * Timeline of OpenCL commands and host phases is written to trace_file, NULL means no trace
+ */
+const char *trace_file = NULL;
+char device_track_names[MAX_DEVICES_COUNT][32];
+
+/*
+ * Zero-copy mode for devices which share memory with host, shared arrays are storage of buffers created with
+ * CL_MEM_USE_HOST_PTR, buffers are mapped while host works with arrays and unmapped while kernel runs
+ */
+bool zero_copy = false;
+
+/*
+ * Pipelined host loop, step n uses one of two ping-pong nearest, force and energy buffers. Nearest is uploaded
+ * on upload_queue and force and energy are read on transfer_queue by PIPELINE_CHUNKS chunks, so chunk c of
+ * step n + 1 is integrated and uploaded while next chunks of force of step n are read. Energy is summed
+ * in event callback while step n + 1 is computed.
+ */
+struct pipeline_slot {
+    int step;
+    cl_event kernel_event;
+    cl_float energy[particles_count];
+    bool busy;
+};
+bool pipelined = false;
+cl_command_queue transfer_queue = NULL;
+cl_command_queue upload_queue = NULL;
+cl_mem energy_slot_buf[2] = {};
+cl_mem nearest_slot_buf[2] = {};
+cl_mem force_slot_buf[2] = {};
+cl_event energy_read_event[2] = {};
+/** force reads of the previous step, chunk of the next step is integrated when its read is complete */
+cl_event force_read_event[PIPELINE_CHUNKS] = {};
+pipeline_slot slots[2];
+int pending_callbacks = 0;
+/** slots and pending_callbacks are changed under pipeline_mutex, pipeline_done is notified by callbacks */
+std::mutex pipeline_mutex;
+std::condition_variable pipeline_done;
+
 /*
  * Host buffers
  */
 cl_float3 position_arr[particles_count] = {};
-cl_float3 nearest[particles_count] = {};
+cl_float3 nearest_storage[particles_count] = {};
 cl_float3 velocity[particles_count] = {};
-cl_int charge[particles_count] = {};
+cl_int charge_storage[particles_count] = {};
 
-cl_float output_energy[particles_count] = {};
-cl_float3 output_force[particles_count] = {};
+cl_float output_energy_storage[particles_count] = {};
+cl_float3 output_force_storage[particles_count] = {};
+/** arrays which are shared with device, they point to page-aligned memory in zero-copy mode */
+cl_float3 *nearest = nearest_storage;
+cl_int *charge = charge_storage;
+cl_float *output_energy = output_energy_storage;
+cl_float3 *output_force = output_force_storage;
 double kernel_total_time = 0.;
 cl_float final_energy = 0.;
+cl_float final_kinetic_energy = 0.;
 bool (*init_opencl)() = init_opencl_lj;
 void (*run)() = run_lj;
+const char *lj_kernel_name = "md_lj";
+const char *coulomb_kernel_name = "md_coulomb";
+
+/*
+ * Tuned LJ kernel is used if tuning result for device and particles_count is in tuning cache,
+ * autotune forces new tuning
+ */
+bool autotune = false;
+char lj_function_name[64] = "md";
+
+/*
+ * Tiled kernels run with many work-groups of work_group_size, buffers are padded to padded_count,
+ * original kernels run with one work-group of particles_count
+ */
+bool tiled = false;
+int work_group_size = particles_count;
+int padded_count = particles_count;
+char build_options[64] = "";
+
+/*
+ * Particle-mesh Ewald, real space part is calculated by md_coulomb_pme or md_coulomb_pme_tiled kernel
+ */
+bool use_pme = false;
+pme_grid pme = {};
+cl_float pme_energy = 0.;
+
+/*
+ * RESPA, LJ force is calculated every step and coulomb force every respa_steps steps, 0 means no RESPA
+ */
+int respa_steps = 0;
 
 /** @brief main.cpp entrypoint
- * @param argv[1] --coulomb or --help or None
+ * @param argv --coulomb, --pme, --respa k, --device_loop interval, --tiled work_group_size, --pipeline,
+ * --reduce float|compensated, --devices n, --trace file, --zero_copy, --autotune, --help or None
  */
 int main(int argc, char *argv[]) {
     struct timeb start_total_time;
     ftime(&start_total_time);
-    if (argc > 1){
-        if (!strcmp(argv[1], "--coulomb")){
+    for (int arg = 1; arg < argc; arg++){
+        if (!strcmp(argv[arg], "--coulomb")){
+            init_opencl = init_opencl_coulomb;
+            run = run_coulomb;
+        }
+        else if (!strcmp(argv[arg], "--pme")){
             init_opencl = init_opencl_coulomb;
             run = run_coulomb;
+            coulomb_kernel_name = "md_coulomb_pme";
+            use_pme = true;
+        }
+        else if (!strcmp(argv[arg], "--respa") && (arg + 1 < argc) && (atoi(argv[arg + 1]) > 0)){
+            init_opencl = init_opencl_coulomb;
+            respa_steps = atoi(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--device_loop") && (arg + 1 < argc) && (atoi(argv[arg + 1]) > 0)){
+            output_interval = atoi(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--tiled") && (arg + 1 < argc) && (atoi(argv[arg + 1]) > 0)){
+            tiled = true;
+            work_group_size = atoi(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--pipeline")){
+            pipelined = true;
+        }
+        else if (!strcmp(argv[arg], "--reduce") && (arg + 1 < argc) &&
+                (!strcmp(argv[arg + 1], "float") || !strcmp(argv[arg + 1], "compensated"))){
+            device_reduce = true;
+            compensated_reduce = !strcmp(argv[++arg], "compensated");
+        }
+        else if (!strcmp(argv[arg], "--autotune")){
+            autotune = true;
+        }
+        else if (!strcmp(argv[arg], "--zero_copy")){
+            zero_copy = true;
+        }
+        else if (!strcmp(argv[arg], "--trace") && (arg + 1 < argc)){
+            trace_file = argv[++arg];
+        }
+        else if (!strcmp(argv[arg], "--devices") && (arg + 1 < argc) && (atoi(argv[arg + 1]) > 0)){
+            devices_count = atoi(argv[++arg]);
+            if (devices_count > MAX_DEVICES_COUNT){
+                devices_count = MAX_DEVICES_COUNT;
+            }
         }
         else{
-        	if (!strcmp(argv[1], "--help")){
-        		printf("Usage: %s [--help][--coulomb]", argv[0]);
+        	if (!strcmp(argv[arg], "--help")){
+        		printf("Usage: %s [--help][--coulomb][--pme][--respa k][--device_loop interval][--tiled work_group_size][--pipeline][--reduce float|compensated][--devices n][--trace file][--zero_copy][--autotune]", argv[0]);
         	}
         	else{
         		printf("invalid argument\n");
-        		printf("Usage: %s [--help][--coulomb]", argv[0]);
+        		printf("Usage: %s [--help][--coulomb][--pme][--respa k][--device_loop interval][--tiled work_group_size][--pipeline][--reduce float|compensated][--devices n][--trace file][--zero_copy][--autotune]", argv[0]);
                 return -1;
         	}
         }
     }
-    if(!init_opencl()) {
+    /** with RESPA coulomb kernel is slow force and LJ kernel is fast force */
+    if (respa_steps){
+        run = run_lj;
+    }
+    /** ranges of devices are multiples of work-group, so tiled kernels are used */
+    if ((devices_count > 1) && (use_pme || respa_steps || output_interval || pipelined || device_reduce)){
+        printf("several devices are not supported with PME, RESPA, device loop, pipeline and device reduction, one device is used\n");
+        devices_count = 1;
+    }
+    if ((devices_count > 1) && !tiled){
+        tiled = true;
+        work_group_size = particles_count < 64 ? particles_count : 64;
+    }
+    if (tiled){
+        lj_kernel_name = "md_lj_tiled";
+        coulomb_kernel_name = use_pme ? "md_coulomb_pme_tiled" : "md_coulomb_tiled";
+        padded_count = (particles_count + work_group_size - 1) / work_group_size * work_group_size;
+        snprintf(build_options, sizeof(build_options), "-D WORK_GROUP_SIZE=%d", work_group_size);
+        printf("%d work-groups of %d work-items\n", padded_count / work_group_size, work_group_size);
+    }
+    /** PME and RESPA need forces on host every step */
+    if (output_interval && (use_pme || respa_steps)){
+        printf("device loop is not supported with PME and RESPA, host loop is used\n");
+        output_interval = 0;
+    }
+    /** PME and RESPA add energy and forces on host, device loop does not read forces at all */
+    if (pipelined && (use_pme || respa_steps || output_interval)){
+        printf("pipeline is not supported with PME, RESPA and device loop, blocking host loop is used\n");
+        pipelined = false;
+    }
+    /** pipeline sums energy array in callback, out of critical path */
+    if (device_reduce && pipelined){
+        printf("device reduction is not used with pipeline\n");
+        device_reduce = false;
+    }
+    /** device loop does not copy arrays every step, other modes have own buffers */
+    if (zero_copy && (output_interval || pipelined || (devices_count > 1) || device_reduce)){
+        printf("zero-copy is not supported with device loop, pipeline, several devices and device reduction, buffers are copied\n");
+        zero_copy = false;
+    }
+    if (trace_file){
+        trace.enabled = true;
+        trace_name_track(TRACE_HOST, "host");
+        trace_name_track(TRACE_QUEUE, "queue");
+        trace_name_track(TRACE_TRANSFER_QUEUE, "transfer queue");
+    }
+    if(!((devices_count > 1) ? init_multi_device() : init_opencl())) {
       return -1;
     }
+    /** host owns shared arrays between kernels */
+    if (zero_copy){
+        cl_event map_event[4];
+        int map_count = map_zero_copy(0, NULL, map_event);
+        clWaitForEvents(map_count, map_event);
+        for (int i = 0; i < map_count; i++){
+            clReleaseEvent(map_event[i]);
+        }
+        printf("zero-copy buffers\n");
+    }
+    if (device_reduce){
+        reduce_program = create_program(REDUCTION_PROGRAM, "");
+        if (!reduction_init(&reduction, context, device, reduce_program, compensated_reduce)){
+            return -1;
+        }
+        printf("energy is summed on device, %s sum\n", compensated_reduce ? "compensated" : "float");
+    }
+    /** real space part of PME is cut at rc, reciprocal part is calculated on grid */
+    if (use_pme){
+        if (rc > half_box){
+            printf("rc must not be greater than half of box for PME\n");
+            return -1;
+        }
+        double beta = PME_BETA_RC / rc;
+        if (!pme_init(&pme, pme_default_size(box_size, beta), box_size, beta)){
+            return -1;
+        }
+        printf("PME grid %d, beta %f\n", pme.size, beta);
+    }
     init_problem(position_arr, velocity, charge);
-    md(position_arr, nearest, output_force, output_energy, velocity, charge);
+    if (devices_count > 1){
+        run = run_multi_device;
+    }
+    if (output_interval){
+        if (!init_device_loop()){
+            return -1;
+        }
+        md_device(position_arr, output_energy, velocity);
+    }
+    else if (pipelined){
+        init_pipeline();
+        md_pipelined(position_arr, nearest, output_force, velocity);
+    }
+    else{
+        md(position_arr, nearest, output_force, output_energy, velocity, charge);
+    }
+    for (int i = 0; (devices_count > 1) && (i < devices_count); i++){
+        printf("device %d: %d work-groups\n", i, parts[i].groups);
+    }
     cleanup();
+    if (trace_file){
+        trace_write(trace_file);
+        trace_free();
+    }
     struct timeb end_total_time;
     ftime(&end_total_time);
     printf("Total execution time in ms =  %d\n", (int)((end_total_time.time - start_total_time.time) * 1000 + end_total_time.millitm - start_total_time.millitm));
     printf("Kernel execution time in milliseconds = %0.3f ms\n", (kernel_total_time / 1000000.0) );
     printf("Kernel execution time in milliseconds per iters = %0.3f ms\n", (kernel_total_time / ( total_it * 1000000.0)) );
     printf("energy is %f \n",final_energy);
+    printf("kinetic energy is %f \n",final_kinetic_energy);
     return 0;
 }
 
@@ -105,14 +379,10 @@ int main(int argc, char *argv[]) {
  */
 
 /**
- * LJ and Coulomb potentials requires different kernels and buffers
- * @brief initialize OpenCL variables for LJ potentional
- * @return True if initialized successfully, False if error occured
+ * @brief find Altera platform or platform of VENDOR
+ * @return True if platform is found, False otherwise
  */
-bool init_opencl_lj() {
-    cl_int status;
-
-    printf("Initializing OpenCL\n");
+bool find_platform() {
     #ifdef ALTERA
         if(!setCwdToExeDir()) {
           return false;
@@ -136,6 +406,21 @@ bool init_opencl_lj() {
       printf("ERROR: Unable to find OpenCL platform.\n");
       return false;
     }
+    return true;
+}
+
+/**
+ * LJ and Coulomb potentials requires different kernels and buffers
+ * @brief initialize OpenCL variables for LJ potentional
+ * @return True if initialized successfully, False if error occured
+ */
+bool init_opencl_lj() {
+    cl_int status;
+
+    printf("Initializing OpenCL\n");
+    if(!find_platform()) {
+      return false;
+    }
 
     #ifdef ALTERA
         scoped_array<cl_device_id> devices;
@@ -153,90 +438,76 @@ bool init_opencl_lj() {
     queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create command queue");
 
-    #ifdef ALTERA
-        std::string binary_file = getBoardBinaryFile("md_lj", device);
-        printf("Using AOCX: %s\n", binary_file.c_str());
-        program = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
-    #else
-        int MAX_SOURCE_SIZE  = 65536;
-        FILE *fp;
-        FILE *fp2;
-        const char fileName[] = "./device/md_lj.cl";
-        const char header[] = "./include/parameters.h";
-        size_t source_size;
-        char *source_str;
-        int count = 0;
-        try {
-            fp = fopen(fileName, "r");
-            if (!fp) {
-                fprintf(stderr, "Failed to load kernel.\n");
-                exit(1);
-            }
-            fp2 = fopen(header, "r");
-            if (!fp2) {
-                fprintf(stderr, "Failed to load kernel header.\n");
-                exit(1);
-            }
-            source_str = (char *)malloc(MAX_SOURCE_SIZE);
-            char ch = getc(fp2);
-            while (ch != EOF){
-                source_str[count] = ch;
-                count++;
-                ch = getc(fp2);
-            }
-            ch = getc(fp);
-            source_str[count++] = '\n';
-            int skip_flag = 0;
-            while(ch != EOF){
-                if (ch == '#'){ /** due to bug with NVIDIA OpenCL I cannot use "#include" inside kernel code with NVIDIA OpenCL */
-                    skip_flag = 1;
-                }
-                if (ch == '\n'){
-                    skip_flag = 0;
-                }
-                if (!skip_flag){
-                    source_str[count] = ch;
-                    count++;
-                }
-                ch = getc(fp);
-            }
-            fclose(fp);
-            fclose(fp2);
-        }
-        catch (int a) {
-            printf("%f", a);
-        }
-        program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &status);
-    #endif
-
-    status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
-    checkError(status, "Failed to build program");
+    /** tuning changes kernel and padding, so it is done before program and buffers are created */
+    apply_tuning();
+    program = create_program(lj_kernel_name, build_options);
 
-    const char *kernel_name = "md";
-    kernel = clCreateKernel(program, kernel_name, &status);
+    kernel = clCreateKernel(program, lj_function_name, &status);
     checkError(status, "Failed to create kernel");
 
+    if (zero_copy){
+        init_zero_copy_arrays();
+    }
+
     /**
      * Input buffer
      */
-    nearest_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        particles_count * sizeof(cl_float3), NULL, &status);
+    nearest_buf = clCreateBuffer(context, CL_MEM_READ_WRITE | (zero_copy ? CL_MEM_USE_HOST_PTR : 0),
+        padded_count * sizeof(cl_float3), zero_copy ? nearest : NULL, &status);
     checkError(status, "Failed to create buffer for nearest");
 
     /**
      * Output buffers
      */
-    output_energy_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        particles_count * sizeof(float), NULL, &status);
+    output_energy_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY | (zero_copy ? CL_MEM_USE_HOST_PTR : 0),
+        padded_count * sizeof(float), zero_copy ? output_energy : NULL, &status);
     checkError(status, "Failed to create buffer for output_en");
 
-     output_force_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        particles_count * sizeof(cl_float3), NULL, &status);
+     output_force_buf = clCreateBuffer(context, CL_MEM_READ_WRITE | (zero_copy ? CL_MEM_USE_HOST_PTR : 0),
+        padded_count * sizeof(cl_float3), zero_copy ? output_force : NULL, &status);
     checkError(status, "Failed to create buffer for output_force");
 
     return true;
 }
 
+/**
+ * @brief create program from AOCX binary for Altera or from kernel source for other platforms,
+ * parameters.h is passed as build options and binaries are cached on disk
+ * @param name kernel file name without extension
+ * @param options build options, for Altera they must be given to offline compiler
+ * @return built program
+ */
+cl_program create_program(const char *name, const char *options) {
+    return create_device_program(device, name, options);
+}
+
+/**
+ * @brief create program for one device of context, see create_program
+ * @param program_device device of context
+ * @param name kernel file name without extension
+ * @param options build options
+ * @return built program
+ */
+cl_program create_device_program(cl_device_id program_device, const char *name, const char *options) {
+    cl_program result;
+    #ifdef ALTERA
+        cl_int status;
+        std::string binary_file = getBoardBinaryFile(name, program_device);
+        printf("Using AOCX: %s\n", binary_file.c_str());
+        result = createProgramFromBinary(context, binary_file.c_str(), &program_device, 1);
+        status = clBuildProgram(result, 0, NULL, options, NULL, NULL);
+        checkError(status, "Failed to build program");
+    #else
+        char fileName[256];
+        snprintf(fileName, sizeof(fileName), "./device/%s.cl", name);
+        result = program_build_cached(context, program_device, fileName, "./include/parameters.h", options);
+        if (!result) {
+            exit(1);
+        }
+    #endif
+    return result;
+}
+
 /**
  * @brief initialize OpenCL variables for coulomb potentional
  * @return True if initialized successfully, False if error occured
@@ -244,27 +515,7 @@ bool init_opencl_lj() {
 bool init_opencl_coulomb() {
     cl_int status;
     printf("Initializing OpenCL\n");
-    #ifdef ALTERA
-        if(!setCwdToExeDir()) {
-          return false;
-        }
-        platform = findPlatform("Altera");
-    #else
-        cl_uint num_platforms;
-        cl_platform_id pls[MAX_PLATFORMS_COUNT];
-        clGetPlatformIDs(MAX_PLATFORMS_COUNT, pls, &num_platforms);
-        char vendor[128];
-        for (int i = 0; i < MAX_PLATFORMS_COUNT; i++){
-            clGetPlatformInfo (pls[i], CL_PLATFORM_VENDOR, sizeof(vendor), vendor, NULL);
-            if (!strcmp(VENDOR, vendor))
-            {
-                platform = pls[i];
-                break;
-            }
-        }
-    #endif
-    if(platform == NULL) {
-      printf("ERROR: Unable to find OpenCL platform.\n");
+    if(!find_platform()) {
       return false;
     }
 
@@ -284,86 +535,40 @@ bool init_opencl_coulomb() {
     queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create command queue");
 
-    #ifdef ALTERA
-        std::string binary_file = getBoardBinaryFile("md_coulomb", device);
-        printf("Using AOCX: %s\n", binary_file.c_str());
-        program = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
-    #else
-        int MAX_SOURCE_SIZE  = 65536;
-        FILE *fp;
-        FILE *fp2;
-        const char fileName[] = "./device/md_coulomb.cl";
-        const char header[] = "./include/parameters.h";
-        size_t source_size;
-        char *source_str;
-        int count = 0;
-        try {
-            fp = fopen(fileName, "r");
-            if (!fp) {
-                fprintf(stderr, "Failed to load kernel.\n");
-                exit(1);
-            }
-            fp2 = fopen(header, "r");
-            if (!fp2) {
-                fprintf(stderr, "Failed to load kernel header.\n");
-                exit(1);
-            }
-            source_str = (char *)malloc(MAX_SOURCE_SIZE);
-            char ch = getc(fp2);
-            while (ch != EOF){
-                source_str[count] = ch;
-                count++;
-                ch = getc(fp2);
-            }
-            ch = getc(fp);
-            source_str[count++] = '\n';
-            int skip_flag = 0;
-            while(ch != EOF){
-                if (ch == '#'){ /** due to bug with NVIDIA OpenCL I cannot use "#include" inside kernel code with NVIDIA OpenCL */
-                    skip_flag = 1;
-                }
-                if (ch == '\n'){
-                    skip_flag = 0;
-                }
-                if (!skip_flag){
-                    source_str[count] = ch;
-                    count++;
-                }
-                ch = getc(fp);
-            }
-            fclose(fp);
-            fclose(fp2);
-        }
-        catch (int a) {
-            printf("%f", a);
-        }
-        program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &status);
-    #endif
-
-    status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
-    checkError(status, "Failed to build program");
+    program = create_program(coulomb_kernel_name, build_options);
 
     const char *kernel_name = "md";
     kernel = clCreateKernel(program, kernel_name, &status);
     checkError(status, "Failed to create kernel");
 
+    /** LJ kernel for inner steps of RESPA */
+    if (respa_steps){
+        lj_program = create_program(lj_kernel_name, build_options);
+        lj_kernel = clCreateKernel(lj_program, kernel_name, &status);
+        checkError(status, "Failed to create LJ kernel");
+    }
+
+    if (zero_copy){
+        init_zero_copy_arrays();
+    }
+
     /** Input buffer */
-    nearest_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        particles_count * sizeof(cl_float3), NULL, &status);
+    nearest_buf = clCreateBuffer(context, CL_MEM_READ_WRITE | (zero_copy ? CL_MEM_USE_HOST_PTR : 0),
+        padded_count * sizeof(cl_float3), zero_copy ? nearest : NULL, &status);
     checkError(status, "Failed to create buffer for nearest");
 
     /** Charge buffer */
-    charge_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        particles_count * sizeof(cl_int), NULL, &status);
+    charge_buf = clCreateBuffer(context, CL_MEM_READ_ONLY | (zero_copy ? CL_MEM_USE_HOST_PTR : 0),
+        padded_count * sizeof(cl_int), zero_copy ? charge : NULL, &status);
     checkError(status, "Failed to create buffer for charge");
 
     /** Output buffers */
-    output_energy_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        particles_count * sizeof(float), NULL, &status);
+    output_energy_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY | (zero_copy ? CL_MEM_USE_HOST_PTR : 0),
+        padded_count * sizeof(float), zero_copy ? output_energy : NULL, &status);
     checkError(status, "Failed to create buffer for output_en");
 
-     output_force_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        particles_count * sizeof(cl_float3), NULL, &status);
+     output_force_buf = clCreateBuffer(context, CL_MEM_READ_WRITE | (zero_copy ? CL_MEM_USE_HOST_PTR : 0),
+        padded_count * sizeof(cl_float3), zero_copy ? output_force : NULL, &status);
     checkError(status, "Failed to create buffer for output_force");
 
     return true;
@@ -374,6 +579,10 @@ bool init_opencl_coulomb() {
  * @return void
  */
 void run_lj() {
+    if (zero_copy){
+        run_zero_copy(lj_kernel ? lj_kernel : kernel, false, "lj kernel");
+        return;
+    }
     cl_int status;
 
     cl_event kernel_event;
@@ -388,30 +597,44 @@ void run_lj() {
 
     unsigned argi = 0;
 
-    size_t global_work_size[1] = {particles_count};
-    size_t local_work_size[1] = {particles_count};
-    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &nearest_buf);
+    size_t global_work_size[1] = {(size_t)padded_count};
+    size_t local_work_size[1] = {(size_t)work_group_size};
+    cl_kernel lj = lj_kernel ? lj_kernel : kernel;
+    status = clSetKernelArg(lj, argi++, sizeof(cl_mem), &nearest_buf);
     checkError(status, "Failed to set argument nearest");
 
-    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_energy_buf);
+    status = clSetKernelArg(lj, argi++, sizeof(cl_mem), &output_energy_buf);
     checkError(status, "Failed to set argument output_energy");
 
-    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_force_buf);
+    status = clSetKernelArg(lj, argi++, sizeof(cl_mem), &output_force_buf);
     checkError(status, "Failed to set argument output_force");
 
-    status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+    status = clEnqueueNDRangeKernel(queue, lj, 1, NULL,
         global_work_size, local_work_size, 1, &write_event, &kernel_event);
     checkError(status, "Failed to launch kernel");
 
-    status = clEnqueueReadBuffer(queue, output_energy_buf, CL_FALSE,
-        0, particles_count * sizeof(float), output_energy, 1, &kernel_event, &finish_event[0]);
-
     status = clEnqueueReadBuffer(queue, output_force_buf, CL_FALSE,
-        0, particles_count * sizeof(cl_float3), output_force, 1, &kernel_event, &finish_event[1]);
+        0, particles_count * sizeof(cl_float3), output_force, 1, &kernel_event, &finish_event[0]);
 
-    clReleaseEvent(write_event);
+    /** sum is read instead of energy array */
+    if (device_reduce){
+        status = reduction_sum(&reduction, queue, output_energy_buf, particles_count, 1, &kernel_event, TRACE_QUEUE, &reduced_energy);
+        checkError(status, "Failed to reduce output_energy");
+    }
+    else{
+        status = clEnqueueReadBuffer(queue, output_energy_buf, CL_FALSE,
+            0, particles_count * sizeof(float), output_energy, 1, &kernel_event, &finish_event[1]);
+    }
 
-    clWaitForEvents(2, finish_event);
+    clWaitForEvents(device_reduce ? 1 : 2, finish_event);
+
+    trace_cl_event(write_event, "write nearest", TRACE_QUEUE);
+    trace_cl_event(kernel_event, "lj kernel", TRACE_QUEUE);
+    trace_cl_event(finish_event[0], "read force", TRACE_QUEUE);
+    if (!device_reduce){
+        trace_cl_event(finish_event[1], "read energy", TRACE_QUEUE);
+    }
+    clReleaseEvent(write_event);
 
     /** measure kernel time */
     clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
@@ -421,7 +644,9 @@ void run_lj() {
 
     clReleaseEvent(kernel_event);
     clReleaseEvent(finish_event[0]);
-    clReleaseEvent(finish_event[1]);
+    if (!device_reduce){
+        clReleaseEvent(finish_event[1]);
+    }
 }
 
 /**
@@ -429,6 +654,10 @@ void run_lj() {
  * @return void
  */
 void run_coulomb() {
+    if (zero_copy){
+        run_zero_copy(kernel, true, "coulomb kernel");
+        return;
+    }
     cl_int status;
 
     cl_event kernel_event;
@@ -447,8 +676,8 @@ void run_coulomb() {
 
     unsigned argi = 0;
 
-    size_t global_work_size[1] = {particles_count};
-    size_t local_work_size[1] = {particles_count};
+    size_t global_work_size[1] = {(size_t)padded_count};
+    size_t local_work_size[1] = {(size_t)work_group_size};
     status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &nearest_buf);
     checkError(status, "Failed to set argument nearest");
 
@@ -461,21 +690,41 @@ void run_coulomb() {
     status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_force_buf);
     checkError(status, "Failed to set argument output_force");
 
+    if (use_pme){
+        cl_float beta = pme.beta;
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_float), &beta);
+        checkError(status, "Failed to set argument beta");
+    }
+
     status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
         global_work_size, local_work_size, 1, write_event, &kernel_event);
     checkError(status, "Failed to launch kernel");
 
-    status = clEnqueueReadBuffer(queue, output_energy_buf, CL_FALSE,
-        0, particles_count * sizeof(float), output_energy, 1, &kernel_event, &finish_event[0]);
-
     status = clEnqueueReadBuffer(queue, output_force_buf, CL_FALSE,
-        0, particles_count * sizeof(cl_float3), output_force, 1, &kernel_event, &finish_event[1]);
+        0, particles_count * sizeof(cl_float3), output_force, 1, &kernel_event, &finish_event[0]);
+
+    /** sum is read instead of energy array */
+    if (device_reduce){
+        status = reduction_sum(&reduction, queue, output_energy_buf, particles_count, 1, &kernel_event, TRACE_QUEUE, &reduced_energy);
+        checkError(status, "Failed to reduce output_energy");
+    }
+    else{
+        status = clEnqueueReadBuffer(queue, output_energy_buf, CL_FALSE,
+            0, particles_count * sizeof(float), output_energy, 1, &kernel_event, &finish_event[1]);
+    }
 
+    clWaitForEvents(device_reduce ? 1 : 2, finish_event);
+
+    trace_cl_event(write_event[0], "write nearest", TRACE_QUEUE);
+    trace_cl_event(write_event[1], "write charge", TRACE_QUEUE);
+    trace_cl_event(kernel_event, "coulomb kernel", TRACE_QUEUE);
+    trace_cl_event(finish_event[0], "read force", TRACE_QUEUE);
+    if (!device_reduce){
+        trace_cl_event(finish_event[1], "read energy", TRACE_QUEUE);
+    }
     clReleaseEvent(write_event[0]);
     clReleaseEvent(write_event[1]);
 
-    clWaitForEvents(2, finish_event);
-
     /* measure kernel time */
     clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
     clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
@@ -484,19 +733,901 @@ void run_coulomb() {
 
     clReleaseEvent(kernel_event);
     clReleaseEvent(finish_event[0]);
-    clReleaseEvent(finish_event[1]);
+    if (!device_reduce){
+        clReleaseEvent(finish_event[1]);
+    }
 }
 
 /**
- * @brief Free the resources allocated during initialization
+ * @brief create integrate kernel and buffers for device-resident loop, upload initial state
+ * and set force kernel arguments, which do not change during run
+ * @return True if initialized successfully, False if error occured
+ */
+bool init_device_loop() {
+    cl_int status;
+
+    integrate_program = create_program("md_integrate", "");
+    integrate_kernel = clCreateKernel(integrate_program, "integrate", &status);
+    checkError(status, "Failed to create integrate kernel");
+
+    position_buf = clCreateBuffer(context, CL_MEM_READ_WRITE,
+        particles_count * sizeof(cl_float3), NULL, &status);
+    checkError(status, "Failed to create buffer for position");
+
+    velocity_buf = clCreateBuffer(context, CL_MEM_READ_WRITE,
+        particles_count * sizeof(cl_float3), NULL, &status);
+    checkError(status, "Failed to create buffer for velocity");
+
+    status = clEnqueueWriteBuffer(queue, position_buf, CL_TRUE,
+        0, particles_count * sizeof(cl_float3), position_arr, 0, NULL, NULL);
+    checkError(status, "Failed to transfer position");
+
+    status = clEnqueueWriteBuffer(queue, velocity_buf, CL_TRUE,
+        0, particles_count * sizeof(cl_float3), velocity, 0, NULL, NULL);
+    checkError(status, "Failed to transfer velocity");
+
+    /** force before the first step is zero */
+    status = clEnqueueWriteBuffer(queue, output_force_buf, CL_TRUE,
+        0, particles_count * sizeof(cl_float3), output_force, 0, NULL, NULL);
+    checkError(status, "Failed to transfer output_force");
+
+    unsigned argi = 0;
+    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &nearest_buf);
+    checkError(status, "Failed to set argument nearest");
+
+    if (run == run_coulomb){
+        status = clEnqueueWriteBuffer(queue, charge_buf, CL_TRUE,
+            0, particles_count * sizeof(cl_int), charge, 0, NULL, NULL);
+        checkError(status, "Failed to transfer charge");
+
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &charge_buf);
+        checkError(status, "Failed to set argument charge");
+    }
+
+    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_energy_buf);
+    checkError(status, "Failed to set argument output_energy");
+
+    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_force_buf);
+    checkError(status, "Failed to set argument output_force");
+
+    argi = 0;
+    status = clSetKernelArg(integrate_kernel, argi++, sizeof(cl_mem), &position_buf);
+    checkError(status, "Failed to set argument position");
+
+    status = clSetKernelArg(integrate_kernel, argi++, sizeof(cl_mem), &velocity_buf);
+    checkError(status, "Failed to set argument velocity");
+
+    status = clSetKernelArg(integrate_kernel, argi++, sizeof(cl_mem), &output_force_buf);
+    checkError(status, "Failed to set argument force");
+
+    status = clSetKernelArg(integrate_kernel, argi++, sizeof(cl_mem), &nearest_buf);
+    checkError(status, "Failed to set argument nearest");
+
+    /** kernel events are kept until results are read to measure kernel time */
+    force_events = (cl_event*)malloc(sizeof(cl_event) * output_interval);
+    force_events_count = 0;
+    /** the closing half-kick is after the last read of energy */
+    integrate_events = (cl_event*)malloc(sizeof(cl_event) * (output_interval + 1));
+    integrate_events_count = 0;
+    return true;
+}
+
+/**
+ * @brief enqueue integrate kernel, v += f * kick, r += v * drift, nearest image is updated
+ * @param kick kick step
+ * @param drift drift step
  * @return void
  */
-void cleanup() {
-    if(kernel) {
-      clReleaseKernel(kernel);
+void enqueue_integrate(cl_float kick, cl_float drift) {
+    cl_int status;
+    size_t global_work_size[1] = {particles_count};
+
+    status = clSetKernelArg(integrate_kernel, 4, sizeof(cl_float), &kick);
+    checkError(status, "Failed to set argument kick");
+
+    status = clSetKernelArg(integrate_kernel, 5, sizeof(cl_float), &drift);
+    checkError(status, "Failed to set argument drift");
+
+    status = clEnqueueNDRangeKernel(queue, integrate_kernel, 1, NULL,
+        global_work_size, NULL, 0, NULL, &integrate_events[integrate_events_count++]);
+    checkError(status, "Failed to launch integrate kernel");
+}
+
+/**
+ * @brief record complete integrate kernels in trace and release their events
+ * @return void
+ */
+void release_integrate_events() {
+    for (int i = 0; i < integrate_events_count; i++){
+        trace_cl_event(integrate_events[i], "integrate kernel", TRACE_QUEUE);
+        clReleaseEvent(integrate_events[i]);
     }
-    if(queue) {
-      clReleaseCommandQueue(queue);
+    integrate_events_count = 0;
+}
+
+/**
+ * @brief enqueue force kernel, it reads nearest written by integrate kernel
+ * @return void
+ */
+void enqueue_force() {
+    cl_int status;
+    size_t global_work_size[1] = {(size_t)padded_count};
+    size_t local_work_size[1] = {(size_t)work_group_size};
+
+    status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+        global_work_size, local_work_size, 0, NULL, &force_events[force_events_count++]);
+    checkError(status, "Failed to launch kernel");
+}
+
+/**
+ * @brief read energy of the last step, kernel time of steps since previous read is measured
+ * @param output_energy energy array, it is not filled if energy is summed on device
+ * @return sum of energy array
+ */
+float read_energy(cl_float *output_energy) {
+    cl_int status;
+    cl_ulong time_start, time_end;
+    double total_energy = 0;
+
+    if (device_reduce){
+        status = reduction_sum(&reduction, queue, output_energy_buf, particles_count, 0, NULL, TRACE_QUEUE, &total_energy);
+        checkError(status, "Failed to reduce output_energy");
+    }
+    else{
+        cl_event read_event;
+        status = clEnqueueReadBuffer(queue, output_energy_buf, CL_TRUE,
+            0, particles_count * sizeof(float), output_energy, 0, NULL, &read_event);
+        checkError(status, "Failed to read output_energy");
+        trace_cl_event(read_event, "read energy", TRACE_QUEUE);
+        clReleaseEvent(read_event);
+        uint64_t sum_start = trace_now();
+        for (int i = 0; i < particles_count; i++)
+            total_energy+=output_energy[i];
+        trace_host("energy sum", sum_start);
+    }
+
+    /** measure kernel time */
+    for (int i = 0; i < force_events_count; i++){
+        clGetEventProfilingInfo(force_events[i], CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+        clGetEventProfilingInfo(force_events[i], CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+        kernel_total_time += time_end - time_start;
+        trace_cl_event(force_events[i], "force kernel", TRACE_QUEUE);
+        clReleaseEvent(force_events[i]);
+    }
+    force_events_count = 0;
+    release_integrate_events();
+    return total_energy;
+}
+
+/**
+ * @brief read positions and velocities at the end of run
+ * @param position_arr Position array
+ * @param velocity Velocity array
+ * @return void
+ */
+void read_state(cl_float3 *position_arr, cl_float3 *velocity) {
+    cl_int status;
+    cl_event read_event[2];
+
+    status = clEnqueueReadBuffer(queue, position_buf, CL_TRUE,
+        0, particles_count * sizeof(cl_float3), position_arr, 0, NULL, &read_event[0]);
+    checkError(status, "Failed to read position");
+
+    status = clEnqueueReadBuffer(queue, velocity_buf, CL_TRUE,
+        0, particles_count * sizeof(cl_float3), velocity, 0, NULL, &read_event[1]);
+    checkError(status, "Failed to read velocity");
+
+    release_integrate_events();
+    trace_cl_event(read_event[0], "read position", TRACE_QUEUE);
+    trace_cl_event(read_event[1], "read velocity", TRACE_QUEUE);
+    clReleaseEvent(read_event[0]);
+    clReleaseEvent(read_event[1]);
+}
+
+/**
+ * @brief create upload and transfer queues and ping-pong buffers for pipelined loop, upload charges
+ * and set force kernel argument, which does not change during run
+ * @return void
+ */
+void init_pipeline() {
+    cl_int status;
+
+    transfer_queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+    checkError(status, "Failed to create transfer queue");
+
+    /** uploads and readbacks are on different queues, so they can use different copy engines */
+    upload_queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+    checkError(status, "Failed to create upload queue");
+
+    for (int i = 0; i < 2; i++){
+        energy_slot_buf[i] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+            padded_count * sizeof(float), NULL, &status);
+        checkError(status, "Failed to create buffer for energy slot");
+
+        nearest_slot_buf[i] = clCreateBuffer(context, CL_MEM_READ_ONLY,
+            padded_count * sizeof(cl_float3), NULL, &status);
+        checkError(status, "Failed to create buffer for nearest slot");
+
+        force_slot_buf[i] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+            padded_count * sizeof(cl_float3), NULL, &status);
+        checkError(status, "Failed to create buffer for force slot");
+        slots[i].busy = false;
+    }
+
+    /** charges do not change during run, nearest, energy and force arguments are set every step */
+    if (run == run_coulomb){
+        status = clEnqueueWriteBuffer(queue, charge_buf, CL_TRUE,
+            0, particles_count * sizeof(cl_int), charge, 0, NULL, NULL);
+        checkError(status, "Failed to transfer charge");
+
+        status = clSetKernelArg(kernel, 1, sizeof(cl_mem), &charge_buf);
+        checkError(status, "Failed to set argument charge");
+    }
+}
+
+/**
+ * @brief sum energy of finished step, it is called by OpenCL runtime when energy is read
+ * @param event energy read event
+ * @param event_status execution status of event
+ * @param data pipeline slot
+ * @return void
+ */
+void CL_CALLBACK energy_ready(cl_event event, cl_int event_status, void *data) {
+    pipeline_slot *slot = (pipeline_slot*)data;
+    cl_ulong time_start, time_end;
+
+    trace_cl_event(event, "read energy", TRACE_TRANSFER_QUEUE);
+    trace_cl_event(slot->kernel_event, "force kernel", TRACE_QUEUE);
+    uint64_t sum_start = trace_now();
+    float total_energy = 0;
+    for (int i = 0; i < particles_count; i++)
+        total_energy+=slot->energy[i];
+    total_energy/=(2 * particles_count);
+    trace_host("energy sum in callback", sum_start);
+
+    /** measure kernel time */
+    clGetEventProfilingInfo(slot->kernel_event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+    clGetEventProfilingInfo(slot->kernel_event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+    clReleaseEvent(slot->kernel_event);
+    {
+        /** callbacks of two slots may run on different threads */
+        std::lock_guard<std::mutex> lock(pipeline_mutex);
+        kernel_total_time += time_end - time_start;
+        if (event_status != CL_COMPLETE){
+            fprintf(stderr, "Energy read of step %d failed: %d\n", slot->step, event_status);
+        }
+        else if (slot->step == (total_it - 1)){
+            final_energy = total_energy;
+        }
+        slot->busy = false;
+        pending_callbacks--;
+    }
+    pipeline_done.notify_all();
+}
+
+/**
+ * @brief integrate step by chunks and calculate its force on device, energy is read and summed asynchronously
+ * @details chunk c is integrated as soon as force of chunk c of the previous step is read and it is uploaded
+ * at once, so integration and upload of step n overlap with force readback of step n - 1. Step n uses
+ * nearest, force and energy buffers of slot n % 2, so its commands do not wait for commands of step n - 1
+ * which use buffers of other slot, kernel waits only for uploads of step n and energy read of step n - 2.
+ * @param step MD step
+ * @param position_arr Position array
+ * @return void
+ */
+void run_pipelined(int step, cl_float3 *position_arr) {
+    cl_int status;
+    int slot_index = step & 1;
+    pipeline_slot *slot = &slots[slot_index];
+
+    /** host array of slot is free when callback of step - 2 is finished, it is finished long before usually */
+    {
+        std::unique_lock<std::mutex> lock(pipeline_mutex);
+        pipeline_done.wait(lock, [slot]{ return !slot->busy; });
+    }
+
+    cl_event write_event[PIPELINE_CHUNKS + 1];
+    for (int c = 0; c < PIPELINE_CHUNKS; c++){
+        int first = particles_count * c / PIPELINE_CHUNKS;
+        int last = particles_count * (c + 1) / PIPELINE_CHUNKS;
+        if (force_read_event[c]){
+            clWaitForEvents(1, &force_read_event[c]);
+            trace_cl_event(force_read_event[c], "read force", TRACE_TRANSFER_QUEUE);
+            clReleaseEvent(force_read_event[c]);
+            force_read_event[c] = NULL;
+        }
+        uint64_t motion_start = trace_now();
+        nearest_image_range(position_arr, nearest, output_force, first, last);
+        trace_host(step ? "motion and nearest_image" : "nearest_image", motion_start);
+        status = clEnqueueWriteBuffer(upload_queue, nearest_slot_buf[slot_index], CL_FALSE,
+            first * sizeof(cl_float3), (last - first) * sizeof(cl_float3), nearest + first, 0, NULL, &write_event[c]);
+        checkError(status, "Failed to transfer nearest");
+        clFlush(upload_queue);
+    }
+    end_nearest_image();
+
+    unsigned argi = 0;
+    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &nearest_slot_buf[slot_index]);
+    checkError(status, "Failed to set argument nearest");
+    argi += (run == run_coulomb);
+    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &energy_slot_buf[slot_index]);
+    checkError(status, "Failed to set argument output_energy");
+    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &force_slot_buf[slot_index]);
+    checkError(status, "Failed to set argument output_force");
+
+    /** previous read from this energy buffer is on transfer queue */
+    cl_uint wait_count = PIPELINE_CHUNKS;
+    if (energy_read_event[slot_index]){
+        write_event[wait_count++] = energy_read_event[slot_index];
+    }
+    cl_event kernel_event;
+    size_t global_work_size[1] = {(size_t)padded_count};
+    size_t local_work_size[1] = {(size_t)work_group_size};
+    status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+        global_work_size, local_work_size, wait_count, write_event, &kernel_event);
+    checkError(status, "Failed to launch kernel");
+    clFlush(queue);
+
+    for (int c = 0; c < PIPELINE_CHUNKS; c++){
+        int first = particles_count * c / PIPELINE_CHUNKS;
+        int last = particles_count * (c + 1) / PIPELINE_CHUNKS;
+        status = clEnqueueReadBuffer(transfer_queue, force_slot_buf[slot_index], CL_FALSE,
+            first * sizeof(cl_float3), (last - first) * sizeof(cl_float3), output_force + first,
+            1, &kernel_event, &force_read_event[c]);
+        checkError(status, "Failed to read output_force");
+    }
+
+    if (energy_read_event[slot_index]){
+        clReleaseEvent(energy_read_event[slot_index]);
+    }
+    {
+        std::lock_guard<std::mutex> lock(pipeline_mutex);
+        slot->step = step;
+        slot->kernel_event = kernel_event;
+        slot->busy = true;
+        pending_callbacks++;
+    }
+    status = clEnqueueReadBuffer(transfer_queue, energy_slot_buf[slot_index], CL_FALSE,
+        0, particles_count * sizeof(float), slot->energy, 1, &kernel_event, &energy_read_event[slot_index]);
+    checkError(status, "Failed to read output_energy");
+
+    status = clSetEventCallback(energy_read_event[slot_index], CL_COMPLETE, energy_ready, slot);
+    checkError(status, "Failed to set energy callback");
+    clFlush(transfer_queue);
+
+    /** uploads are complete when kernel starts, they are recorded when the next step waits for force */
+    for (int c = 0; c < PIPELINE_CHUNKS; c++){
+        trace_cl_event(write_event[c], "write nearest", TRACE_UPLOAD_QUEUE);
+        clReleaseEvent(write_event[c]);
+    }
+}
+
+/**
+ * @brief wait for force and energy of all steps
+ * @return void
+ */
+void finish_pipeline() {
+    clFinish(transfer_queue);
+    for (int c = 0; c < PIPELINE_CHUNKS; c++){
+        if (force_read_event[c]){
+            trace_cl_event(force_read_event[c], "read force", TRACE_TRANSFER_QUEUE);
+            clReleaseEvent(force_read_event[c]);
+            force_read_event[c] = NULL;
+        }
+    }
+    /** callbacks may be called after clFinish returns */
+    {
+        std::unique_lock<std::mutex> lock(pipeline_mutex);
+        pipeline_done.wait(lock, []{ return pending_callbacks == 0; });
+    }
+    for (int i = 0; i < 2; i++){
+        if (energy_read_event[i]){
+            clReleaseEvent(energy_read_event[i]);
+            energy_read_event[i] = NULL;
+        }
+    }
+}
+
+/**
+ * @brief initialize context with several devices of platform, or with sub-devices of the first device
+ * if platform has only one, and kernels and buffers for each of them
+ * @return True if initialized successfully, False if error occured
+ */
+bool init_multi_device() {
+    cl_int status;
+    cl_device_id ids[MAX_DEVICES_COUNT];
+    cl_uint num_devices = 0;
+
+    printf("Initializing OpenCL\n");
+    if(!find_platform()) {
+      return false;
+    }
+    status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, MAX_DEVICES_COUNT, ids, &num_devices);
+    checkError(status, "Failed to get devices");
+
+    /** e.g. CPU runtime has one device which is split to equal sub-devices */
+    if (num_devices == 1){
+        cl_uint max_sub_devices = 0;
+        cl_uint compute_units = 0;
+        clGetDeviceInfo(ids[0], CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(max_sub_devices), &max_sub_devices, NULL);
+        clGetDeviceInfo(ids[0], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+        if ((max_sub_devices > 1) && (compute_units > 1)){
+            cl_uint sub_count = devices_count < (int)max_sub_devices ? devices_count : max_sub_devices;
+            cl_device_partition_property properties[3] = {CL_DEVICE_PARTITION_EQUALLY,
+                (cl_device_partition_property)(compute_units / sub_count), 0};
+            cl_device_id parent = ids[0];
+            cl_uint sub_total = 0;
+            status = clCreateSubDevices(parent, properties, 0, NULL, &sub_total);
+            checkError(status, "Failed to query sub-devices");
+            cl_device_id *all = (cl_device_id*)malloc(sizeof(cl_device_id) * sub_total);
+            status = clCreateSubDevices(parent, properties, sub_total, all, NULL);
+            checkError(status, "Failed to create sub-devices");
+            /** remainder of compute units may give extra sub-devices, they are not used */
+            num_devices = sub_total < MAX_DEVICES_COUNT ? sub_total : MAX_DEVICES_COUNT;
+            for (cl_uint i = 0; i < sub_total; i++){
+                if (i < num_devices){
+                    ids[i] = all[i];
+                }
+                else{
+                    clReleaseDevice(all[i]);
+                }
+            }
+            free(all);
+            sub_devices = true;
+        }
+    }
+    /** devices which are not used */
+    for (int i = devices_count; sub_devices && (i < (int)num_devices); i++){
+        clReleaseDevice(ids[i]);
+    }
+    if ((int)num_devices < devices_count){
+        devices_count = num_devices;
+    }
+    device = ids[0];
+
+    context = clCreateContext(NULL, devices_count, ids, NULL, NULL, &status);
+    checkError(status, "Failed to create context");
+
+    multi_coulomb = (init_opencl == init_opencl_coulomb);
+    int total_groups = padded_count / work_group_size;
+    for (int i = 0; i < devices_count; i++){
+        device_part *part = &parts[i];
+        char name[128] = "";
+        clGetDeviceInfo(ids[i], CL_DEVICE_NAME, sizeof(name), name, NULL);
+        printf("device %d: %s\n", i, name);
+        snprintf(device_track_names[i], sizeof(device_track_names[i]), "device %d", i);
+        trace_name_track(TRACE_QUEUE + i, device_track_names[i]);
+        part->device = ids[i];
+
+        part->queue = clCreateCommandQueue(context, part->device, CL_QUEUE_PROFILING_ENABLE, &status);
+        checkError(status, "Failed to create command queue");
+
+        part->program = create_device_program(part->device, multi_coulomb ? coulomb_kernel_name : lj_kernel_name, build_options);
+        part->kernel = clCreateKernel(part->program, "md", &status);
+        checkError(status, "Failed to create kernel");
+
+        /** every device has a copy of all positions */
+        part->nearest_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+            padded_count * sizeof(cl_float3), NULL, &status);
+        checkError(status, "Failed to create buffer for nearest");
+
+        if (multi_coulomb){
+            part->charge_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                padded_count * sizeof(cl_int), NULL, &status);
+            checkError(status, "Failed to create buffer for charge");
+        }
+
+        /** outputs are indexed by particle, only range of device is written */
+        part->energy_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+            padded_count * sizeof(float), NULL, &status);
+        checkError(status, "Failed to create buffer for output_en");
+
+        part->force_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+            padded_count * sizeof(cl_float3), NULL, &status);
+        checkError(status, "Failed to create buffer for output_force");
+
+        /** equal ranges before the first measurement */
+        part->first_group = total_groups * i / devices_count;
+        part->groups = total_groups * (i + 1) / devices_count - part->first_group;
+        part->kernel_time = 0;
+    }
+    return true;
+}
+
+/**
+ * @brief split work-groups between devices proportionally to their speed since last balancing,
+ * device with non-empty range keeps at least one work-group
+ * @return void
+ */
+void balance_devices() {
+    int total_groups = padded_count / work_group_size;
+    double speed[MAX_DEVICES_COUNT];
+    double total_speed = 0;
+    int measured = 0;
+    for (int i = 0; i < devices_count; i++){
+        speed[i] = (parts[i].groups && (parts[i].kernel_time > 0)) ? parts[i].groups / parts[i].kernel_time : 0;
+        total_speed += speed[i];
+        measured += speed[i] > 0;
+    }
+    if (!measured){
+        return;
+    }
+    /** device without work gets average speed, so it is measured again */
+    double average_speed = total_speed / measured;
+    for (int i = 0; i < devices_count; i++){
+        if (speed[i] <= 0){
+            speed[i] = average_speed;
+            total_speed += average_speed;
+        }
+    }
+    int first_group = 0;
+    double share = 0;
+    for (int i = 0; i < devices_count; i++){
+        share += speed[i] / total_speed;
+        int last_group = (i == devices_count - 1) ? total_groups : (int)(share * total_groups + 0.5);
+        if ((last_group <= first_group) && (first_group < total_groups)){
+            last_group = first_group + 1;
+        }
+        parts[i].first_group = first_group;
+        parts[i].groups = last_group > first_group ? last_group - first_group : 0;
+        parts[i].kernel_time = 0;
+        first_group += parts[i].groups;
+    }
+    balance_steps = 0;
+}
+
+/**
+ * @brief run OpenCL kernel on all devices, each device calculates its range and forces are gathered to host arrays
+ * @return void
+ */
+void run_multi_device() {
+    cl_int status;
+    cl_event finish_event[2 * MAX_DEVICES_COUNT];
+    cl_event kernel_event[MAX_DEVICES_COUNT];
+    cl_event trace_write_event[MAX_DEVICES_COUNT][2];
+    int first_read[MAX_DEVICES_COUNT];
+    int finish_count = 0;
+
+    for (int i = 0; i < devices_count; i++){
+        device_part *part = &parts[i];
+        if (!part->groups){
+            continue;
+        }
+        cl_event write_event[2];
+        status = clEnqueueWriteBuffer(part->queue, part->nearest_buf, CL_FALSE,
+            0, particles_count * sizeof(cl_float3), nearest, 0, NULL, &write_event[0]);
+        checkError(status, "Failed to transfer nearest");
+
+        unsigned argi = 0;
+        status = clSetKernelArg(part->kernel, argi++, sizeof(cl_mem), &part->nearest_buf);
+        checkError(status, "Failed to set argument nearest");
+
+        if (multi_coulomb){
+            status = clEnqueueWriteBuffer(part->queue, part->charge_buf, CL_FALSE,
+                0, particles_count * sizeof(cl_int), charge, 0, NULL, &write_event[1]);
+            checkError(status, "Failed to transfer charge");
+
+            status = clSetKernelArg(part->kernel, argi++, sizeof(cl_mem), &part->charge_buf);
+            checkError(status, "Failed to set argument charge");
+        }
+
+        status = clSetKernelArg(part->kernel, argi++, sizeof(cl_mem), &part->energy_buf);
+        checkError(status, "Failed to set argument output_energy");
+
+        status = clSetKernelArg(part->kernel, argi++, sizeof(cl_mem), &part->force_buf);
+        checkError(status, "Failed to set argument output_force");
+
+        /** global id of work-item is index of its particle */
+        size_t global_work_offset[1] = {(size_t)part->first_group * work_group_size};
+        size_t global_work_size[1] = {(size_t)part->groups * work_group_size};
+        size_t local_work_size[1] = {(size_t)work_group_size};
+        status = clEnqueueNDRangeKernel(part->queue, part->kernel, 1, global_work_offset,
+            global_work_size, local_work_size, multi_coulomb ? 2 : 1, write_event, &kernel_event[i]);
+        checkError(status, "Failed to launch kernel");
+
+        /** padding is not read */
+        first_read[i] = finish_count;
+        size_t first = global_work_offset[0];
+        size_t count = first + global_work_size[0] > particles_count ? particles_count - first : global_work_size[0];
+        status = clEnqueueReadBuffer(part->queue, part->energy_buf, CL_FALSE,
+            first * sizeof(float), count * sizeof(float), output_energy + first, 1, &kernel_event[i], &finish_event[finish_count++]);
+        checkError(status, "Failed to read output_energy");
+
+        status = clEnqueueReadBuffer(part->queue, part->force_buf, CL_FALSE,
+            first * sizeof(cl_float3), count * sizeof(cl_float3), output_force + first, 1, &kernel_event[i], &finish_event[finish_count++]);
+        checkError(status, "Failed to read output_force");
+
+        trace_write_event[i][0] = write_event[0];
+        trace_write_event[i][1] = multi_coulomb ? write_event[1] : NULL;
+        /** devices start while next ones are enqueued */
+        clFlush(part->queue);
+    }
+
+    clWaitForEvents(finish_count, finish_event);
+
+    /** devices run in parallel, so step takes time of the slowest one */
+    double step_time = 0;
+    for (int i = 0; i < devices_count; i++){
+        if (!parts[i].groups){
+            continue;
+        }
+        cl_ulong time_start, time_end;
+        clGetEventProfilingInfo(kernel_event[i], CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+        clGetEventProfilingInfo(kernel_event[i], CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+        parts[i].kernel_time += time_end - time_start;
+        if (time_end - time_start > step_time){
+            step_time = time_end - time_start;
+        }
+        trace_cl_event(trace_write_event[i][0], "write nearest", TRACE_QUEUE + i);
+        trace_cl_event(trace_write_event[i][1], "write charge", TRACE_QUEUE + i);
+        trace_cl_event(kernel_event[i], multi_coulomb ? "coulomb kernel" : "lj kernel", TRACE_QUEUE + i);
+        trace_cl_event(finish_event[first_read[i]], "read energy", TRACE_QUEUE + i);
+        trace_cl_event(finish_event[first_read[i] + 1], "read force", TRACE_QUEUE + i);
+        clReleaseEvent(trace_write_event[i][0]);
+        if (trace_write_event[i][1]){
+            clReleaseEvent(trace_write_event[i][1]);
+        }
+        clReleaseEvent(kernel_event[i]);
+    }
+    kernel_total_time += step_time;
+    for (int i = 0; i < finish_count; i++){
+        clReleaseEvent(finish_event[i]);
+    }
+
+    if (++balance_steps == balance_interval){
+        balance_devices();
+    }
+}
+
+/**
+ * @brief allocate shared arrays aligned for CL_MEM_USE_HOST_PTR, size is padded to ZERO_COPY_ALIGNMENT
+ * @return void
+ */
+void init_zero_copy_arrays() {
+    nearest = (cl_float3*)zero_copy_alloc(padded_count * sizeof(cl_float3));
+    charge = (cl_int*)zero_copy_alloc(padded_count * sizeof(cl_int));
+    output_energy = (cl_float*)zero_copy_alloc(padded_count * sizeof(cl_float));
+    output_force = (cl_float3*)zero_copy_alloc(padded_count * sizeof(cl_float3));
+}
+
+/**
+ * @brief allocate zeroed memory which can be storage of zero-copy buffer,
+ * alignedMalloc is used for Altera and page alignment for other platforms
+ * @param size size in bytes
+ * @return pointer, it must be released with zero_copy_free
+ */
+void *zero_copy_alloc(size_t size) {
+    size = (size + ZERO_COPY_ALIGNMENT - 1) / ZERO_COPY_ALIGNMENT * ZERO_COPY_ALIGNMENT;
+    void *result = NULL;
+    #ifdef ALTERA
+        result = alignedMalloc(size);
+    #else
+        if (posix_memalign(&result, ZERO_COPY_ALIGNMENT, size)){
+            result = NULL;
+        }
+    #endif
+    if (!result){
+        fprintf(stderr, "Failed to allocate zero-copy array\n");
+        exit(1);
+    }
+    memset(result, 0, size);
+    return result;
+}
+
+/**
+ * @brief release memory from zero_copy_alloc
+ * @param pointer pointer
+ * @return void
+ */
+void zero_copy_free(void *pointer) {
+    #ifdef ALTERA
+        alignedFree(pointer);
+    #else
+        free(pointer);
+    #endif
+}
+
+/**
+ * @brief map shared buffers, pointers are the same as host arrays because buffers use them as storage
+ * @param wait_count length of wait_list
+ * @param wait_list events to wait for, e.g. kernel
+ * @param map_event events of maps, up to 4
+ * @return number of map events
+ */
+int map_zero_copy(cl_uint wait_count, const cl_event *wait_list, cl_event *map_event) {
+    cl_int status;
+    int count = 0;
+    cl_mem buffers[4] = {nearest_buf, output_energy_buf, output_force_buf, charge_buf};
+    size_t sizes[4] = {sizeof(cl_float3), sizeof(cl_float), sizeof(cl_float3), sizeof(cl_int)};
+    for (int i = 0; i < 4; i++){
+        if (!buffers[i]){
+            continue;
+        }
+        clEnqueueMapBuffer(queue, buffers[i], CL_FALSE, CL_MAP_READ | CL_MAP_WRITE,
+            0, padded_count * sizes[i], wait_count, wait_list, &map_event[count++], &status);
+        checkError(status, "Failed to map buffer");
+    }
+    return count;
+}
+
+/**
+ * @brief unmap shared buffers before kernel uses them
+ * @param unmap_event events of unmaps, up to 4
+ * @return number of unmap events
+ */
+int unmap_zero_copy(cl_event *unmap_event) {
+    cl_int status;
+    int count = 0;
+    cl_mem buffers[4] = {nearest_buf, output_energy_buf, output_force_buf, charge_buf};
+    void *pointers[4] = {nearest, output_energy, output_force, charge};
+    for (int i = 0; i < 4; i++){
+        if (!buffers[i]){
+            continue;
+        }
+        status = clEnqueueUnmapMemObject(queue, buffers[i], pointers[i], 0, NULL, &unmap_event[count++]);
+        checkError(status, "Failed to unmap buffer");
+    }
+    return count;
+}
+
+/**
+ * @brief run force kernel on zero-copy buffers, arrays are unmapped for kernel and mapped back instead of copies
+ * @param force_kernel LJ or coulomb kernel
+ * @param with_charge kernel has charge argument
+ * @param trace_name name of kernel in trace
+ * @return void
+ */
+void run_zero_copy(cl_kernel force_kernel, bool with_charge, const char *trace_name) {
+    cl_int status;
+    cl_event unmap_event[4];
+    cl_event map_event[4];
+    cl_event kernel_event;
+    cl_ulong time_start, time_end;
+
+    int unmap_count = unmap_zero_copy(unmap_event);
+
+    unsigned argi = 0;
+    status = clSetKernelArg(force_kernel, argi++, sizeof(cl_mem), &nearest_buf);
+    checkError(status, "Failed to set argument nearest");
+
+    if (with_charge){
+        status = clSetKernelArg(force_kernel, argi++, sizeof(cl_mem), &charge_buf);
+        checkError(status, "Failed to set argument charge");
+    }
+
+    status = clSetKernelArg(force_kernel, argi++, sizeof(cl_mem), &output_energy_buf);
+    checkError(status, "Failed to set argument output_energy");
+
+    status = clSetKernelArg(force_kernel, argi++, sizeof(cl_mem), &output_force_buf);
+    checkError(status, "Failed to set argument output_force");
+
+    if (with_charge && use_pme){
+        cl_float beta = pme.beta;
+        status = clSetKernelArg(force_kernel, argi++, sizeof(cl_float), &beta);
+        checkError(status, "Failed to set argument beta");
+    }
+
+    size_t global_work_size[1] = {(size_t)padded_count};
+    size_t local_work_size[1] = {(size_t)work_group_size};
+    status = clEnqueueNDRangeKernel(queue, force_kernel, 1, NULL,
+        global_work_size, local_work_size, unmap_count, unmap_event, &kernel_event);
+    checkError(status, "Failed to launch kernel");
+
+    int map_count = map_zero_copy(1, &kernel_event, map_event);
+    clWaitForEvents(map_count, map_event);
+
+    /** measure kernel time */
+    clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+    clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+    kernel_total_time += time_end - time_start;
+
+    for (int i = 0; i < unmap_count; i++){
+        trace_cl_event(unmap_event[i], "unmap", TRACE_QUEUE);
+        clReleaseEvent(unmap_event[i]);
+    }
+    trace_cl_event(kernel_event, trace_name, TRACE_QUEUE);
+    clReleaseEvent(kernel_event);
+    for (int i = 0; i < map_count; i++){
+        trace_cl_event(map_event[i], "map", TRACE_QUEUE);
+        clReleaseEvent(map_event[i]);
+    }
+}
+
+/**
+ * @brief use tuned LJ kernel with configuration from tuning cache, or tune it if autotune is set,
+ * explicit --tiled, RESPA and several devices keep their kernels
+ * @return True if tuned kernel is used, False otherwise
+ */
+bool apply_tuning() {
+    #ifdef ALTERA
+        /** AOCX is built offline, so variants cannot be built at run time */
+        return false;
+    #else
+        if (tiled || respa_steps || (devices_count > 1) || (init_opencl != init_opencl_lj)){
+            if (autotune){
+                printf("autotune is supported for LJ kernel without --tiled, RESPA and several devices\n");
+            }
+            return false;
+        }
+        tuning_config config;
+        if (autotune || !tuning_load("md_lj_tuned", device, particles_count, &config)){
+            if (!autotune || !tune_lj(&config)){
+                return false;
+            }
+            tuning_store("md_lj_tuned", device, particles_count, &config);
+        }
+        tiled = true;
+        work_group_size = config.work_group_size;
+        padded_count = (particles_count + work_group_size - 1) / work_group_size * work_group_size;
+        snprintf(build_options, sizeof(build_options), "-D WORK_GROUP_SIZE=%d -D UNROLL=%d", work_group_size, config.unroll);
+        lj_kernel_name = "md_lj_tuned";
+        tuning_kernel_name("md", config.vector_width, lj_function_name, sizeof(lj_function_name));
+        printf("tuned kernel %s: work-group %d, vector %d, unroll %d\n", lj_function_name,
+            config.work_group_size, config.vector_width, config.unroll);
+        return true;
+    #endif
+}
+
+/**
+ * @brief time variants of tuned LJ kernel on initial positions
+ * @param config the fastest variant
+ * @return True if at least one variant runs, False otherwise
+ */
+bool tune_lj(tuning_config *config) {
+    cl_int status;
+    int count = (particles_count + TUNING_MAX_WORK_GROUP - 1) / TUNING_MAX_WORK_GROUP * TUNING_MAX_WORK_GROUP;
+    cl_mem args[3];
+    size_t sizes[3] = {sizeof(cl_float3), sizeof(cl_float), sizeof(cl_float3)};
+    for (int i = 0; i < 3; i++){
+        args[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, count * sizes[i], NULL, &status);
+        checkError(status, "Failed to create buffer for tuning");
+    }
+    /** initial lattice is already inside the box */
+    init_problem(position_arr, velocity, charge);
+    status = clEnqueueWriteBuffer(queue, args[0], CL_TRUE,
+        0, particles_count * sizeof(cl_float3), position_arr, 0, NULL, NULL);
+    checkError(status, "Failed to transfer positions for tuning");
+
+    printf("Tuning LJ kernel\n");
+    bool result = tuning_run(context, device, queue, "./device/md_lj_tuned.cl", "./include/parameters.h",
+        "md", particles_count, args, 3, config);
+    for (int i = 0; i < 3; i++){
+        clReleaseMemObject(args[i]);
+    }
+    return result;
+}
+
+/**
+ * @brief Free the resources allocated during initialization
+ * @return void
+ */
+void cleanup() {
+    /** buffers are unmapped before release, arrays are released after buffers */
+    if (zero_copy && queue){
+        cl_event unmap_event[4];
+        int unmap_count = unmap_zero_copy(unmap_event);
+        clWaitForEvents(unmap_count, unmap_event);
+        for (int i = 0; i < unmap_count; i++){
+            clReleaseEvent(unmap_event[i]);
+        }
+    }
+    if(kernel) {
+      clReleaseKernel(kernel);
+    }
+    if(lj_kernel) {
+      clReleaseKernel(lj_kernel);
+    }
+    if(integrate_kernel) {
+      clReleaseKernel(integrate_kernel);
+    }
+    if(queue) {
+      clReleaseCommandQueue(queue);
+    }
+    if(transfer_queue) {
+      clReleaseCommandQueue(transfer_queue);
+    }
+    if(upload_queue) {
+      clReleaseCommandQueue(upload_queue);
     }
     if(nearest_buf) {
       clReleaseMemObject(nearest_buf);
@@ -510,11 +1641,73 @@ void cleanup() {
     if(output_force_buf) {
       clReleaseMemObject(output_force_buf);
     }
+    if(position_buf) {
+      clReleaseMemObject(position_buf);
+    }
+    if(velocity_buf) {
+      clReleaseMemObject(velocity_buf);
+    }
+    for (int i = 0; i < 2; i++){
+        if(energy_slot_buf[i]) {
+          clReleaseMemObject(energy_slot_buf[i]);
+        }
+        if(nearest_slot_buf[i]) {
+          clReleaseMemObject(nearest_slot_buf[i]);
+        }
+        if(force_slot_buf[i]) {
+          clReleaseMemObject(force_slot_buf[i]);
+        }
+    }
+    free(force_events);
+    free(integrate_events);
+    for (int i = 0; i < devices_count; i++){
+        if(parts[i].kernel) {
+          clReleaseKernel(parts[i].kernel);
+        }
+        if(parts[i].queue) {
+          clReleaseCommandQueue(parts[i].queue);
+        }
+        if(parts[i].nearest_buf) {
+          clReleaseMemObject(parts[i].nearest_buf);
+        }
+        if(parts[i].charge_buf) {
+          clReleaseMemObject(parts[i].charge_buf);
+        }
+        if(parts[i].energy_buf) {
+          clReleaseMemObject(parts[i].energy_buf);
+        }
+        if(parts[i].force_buf) {
+          clReleaseMemObject(parts[i].force_buf);
+        }
+        if(parts[i].program) {
+        clReleaseProgram(parts[i].program);
+        }
+        if(sub_devices && parts[i].device) {
+          clReleaseDevice(parts[i].device);
+        }
+    }
+    reduction_free(&reduction);
+    if(reduce_program) {
+    clReleaseProgram(reduce_program);
+    }
     if(program) {
     clReleaseProgram(program);
     }
+    if(lj_program) {
+    clReleaseProgram(lj_program);
+    }
+    if(integrate_program) {
+    clReleaseProgram(integrate_program);
+    }
     if(context) {
     clReleaseContext(context);
     }
+    pme_free(&pme);
+    if (zero_copy){
+        zero_copy_free(nearest);
+        zero_copy_free(charge);
+        zero_copy_free(output_energy);
+        zero_copy_free(output_force);
+    }
 }
 
@@ -10,6 +10,27 @@
 
 extern void (*run)();
 extern cl_float final_energy;
+extern cl_float final_kinetic_energy;
+extern bool use_pme;
+extern pme_grid pme;
+extern cl_float pme_energy;
+extern int respa_steps;
+extern int output_interval;
+extern bool device_reduce;
+extern double reduced_energy;
+
+/*
+ * Velocity Verlet state, kicks and drift are done in nearest_image pass,
+ * NULL velocity means that positions are only wrapped
+ */
+cl_float3 *step_velocity = NULL;
+bool velocity_is_half_step = false;
+
+/*
+ * RESPA slow force, it is applied in nearest_image pass with slow_kick step
+ */
+cl_float3 slow_force[particles_count] = {};
+float slow_kick = 0;
 
 /**
  * @brief set initial coordinates,velocities and charges for all particles
@@ -28,7 +49,7 @@ void init_problem(cl_float3 *position_arr, cl_float3 *velocity, cl_int *charge)
                 }
                 position_arr[count] = (cl_float3){ i, j, l };
                 velocity[count] = (cl_float3){ 0, 0, 0 };
-                if (run == run_coulomb){
+                if ((run == run_coulomb) || respa_steps){
                     if (count & 1)
                         charge[count] = 1;
                     else
@@ -44,47 +65,45 @@ void init_problem(cl_float3 *position_arr, cl_float3 *velocity, cl_int *charge)
     }
 }
 
-/**
- * @brief solve motion equation's using Euler method
- * @param position_arr Position array
- * @param velocity Velocity array
- * @param output_force force array
- * @return void
- */
-void motion(cl_float3 *position_arr, cl_float3 *velocity, cl_float3 *output_force) {
-    for (int i = 0; i < particles_count; i++) {
-        /* v+= f * dt */
-        velocity[i] = (cl_float3) {velocity[i].x + output_force[i].x * dt,
-            velocity[i].y + output_force[i].y * dt,
-            velocity[i].z + output_force[i].z * dt};
-        /* r+= v * dt */
-        position_arr[i] = (cl_float3) {position_arr[i].x + velocity[i].x * dt,
-            position_arr[i].y + velocity[i].y * dt,
-            position_arr[i].z + velocity[i].z * dt};
-    }
-}
-
 /**
  * @brief calculate energy and force on device
- * @param position_arr Position array
  * @param nearest nearest array
  * @param output_force force array, calculated on device
  * @param output_energy energy array
  * @param charge array Charge array
- * @return void
+ * @param kernel_run run_lj or run_coulomb
+ * @return total energy
  */
-void calculate_energy_force(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force, cl_float *output_energy, cl_int *charge) {
-    nearest_image(position_arr, nearest);
+float calculate_energy_force(cl_float3 *nearest, cl_float3 *output_force, cl_float *output_energy, cl_int *charge, void (*kernel_run)()) {
     for (int i = 0; i < particles_count; i++){
         output_force[i] = (cl_float3){0, 0, 0};
         output_energy[i] = 0;
     }
     /** run kernel */
-    run();
+    kernel_run();
+    /** reciprocal part of PME is calculated on host */
+    pme_energy = 0;
+    if (use_pme && (kernel_run == run_coulomb)){
+        uint64_t pme_start = trace_now();
+        pme_energy = pme_reciprocal(&pme, nearest, charge, particles_count, output_force);
+        trace_host("pme reciprocal", pme_start);
+    }
+    float total_energy = 0;
+    if (device_reduce){
+        total_energy = reduced_energy;
+    }
+    else{
+        uint64_t sum_start = trace_now();
+        for (int i = 0; i < particles_count; i++)
+            total_energy+=output_energy[i];
+        trace_host("energy sum", sum_start);
+    }
+    return total_energy / 2 + pme_energy;
 }
 
 /**
- * @brief perform MD iterations
+ * @brief perform MD iterations with velocity Verlet integrator,
+ * with RESPA coulomb force is calculated every respa_steps steps and LJ force every step
  * @param position_arr Position array
  * @param nearest nearest array
  * @param output_force force array, calculated on device
@@ -93,27 +112,146 @@ void calculate_energy_force(cl_float3 *position_arr, cl_float3 *nearest, cl_floa
  * @return void
  */
 void md(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force, cl_float *output_energy, cl_float3 *velocity, cl_int *charge) {
+    float slow_energy = 0;
     for (int n = 0; n < total_it; n ++){
-        calculate_energy_force(position_arr, nearest, output_force, output_energy, charge);
-        motion(position_arr, velocity, output_force);
-        float total_energy = 0;
-        for (int i = 0; i < particles_count; i++)
-            total_energy+=output_energy[i];
-        total_energy/=(2 * particles_count);
+        /** first call only calculates forces at initial positions, next ones move particles before force calculation */
+        step_velocity = n ? velocity : NULL;
+        uint64_t motion_start = trace_now();
+        nearest_image(position_arr, nearest, output_force);
+        trace_host(n ? "motion and nearest_image" : "nearest_image", motion_start);
+        /** slow force is calculated at the end of outer step and at the last iteration for energy */
+        if (respa_steps && ((n % respa_steps == 0) || (n == total_it - 1))){
+            /** kernels read results to output_force, previous fast force is already applied at this point */
+            slow_energy = calculate_energy_force(nearest, output_force, output_energy, charge, run_coulomb);
+            /** if run does not end at outer step, force of the last iteration is discarded and
+             * slow_force of the last outer step is kept for the closing half-kick */
+            if (n % respa_steps == 0){
+                memcpy(slow_force, output_force, sizeof(cl_float3) * particles_count);
+                /** closing half-kick of previous outer step and opening half-kick of next one */
+                slow_kick = n ? respa_steps * dt : respa_steps * dt / 2;
+            }
+        }
+        float total_energy = (calculate_energy_force(nearest, output_force, output_energy, charge, run) + slow_energy) / particles_count;
         if (n == (total_it - 1)){
             final_energy = total_energy;
         }
     }
+    uint64_t synchronize_start = trace_now();
+    final_kinetic_energy = synchronize_velocity(velocity, output_force) / particles_count;
+    trace_host("synchronize_velocity", synchronize_start);
 }
 
 /**
- * @brief first part of implementation of periodic boundary conditions
+ * @brief perform MD iterations on device with velocity Verlet integrator,
+ * positions and velocities stay on device and energy is read every output_interval steps
+ * @param position_arr Position array, it is updated at the end of run
+ * @param output_energy energy array
+ * @param velocity Velocity array, it is updated at the end of run
+ * @return void
+ */
+void md_device(cl_float3 *position_arr, cl_float *output_energy, cl_float3 *velocity) {
+    for (int n = 0; n < total_it; n ++){
+        /** first step only wraps positions, second one starts with half-kick */
+        enqueue_integrate(n ? (n == 1 ? dt / 2 : dt) : 0, n ? dt : 0);
+        enqueue_force();
+        if (((n + 1) % output_interval == 0) || (n == (total_it - 1))){
+            float total_energy = read_energy(output_energy) / (2 * particles_count);
+            printf("step %d energy is %f \n", n, total_energy);
+            if (n == (total_it - 1)){
+                final_energy = total_energy;
+            }
+        }
+    }
+    /** closing half-kick brings velocities to the same step as positions */
+    enqueue_integrate(total_it > 1 ? dt / 2 : 0, 0);
+    read_state(position_arr, velocity);
+    float kinetic_energy = 0;
+    for (int i = 0; i < particles_count; i++)
+        kinetic_energy += (velocity[i].x * velocity[i].x + velocity[i].y * velocity[i].y + velocity[i].z * velocity[i].z) / 2;
+    final_kinetic_energy = kinetic_energy / particles_count;
+}
+
+/**
+ * @brief perform MD iterations with velocity Verlet integrator on host and pipelined force calculation,
+ * energy is summed asynchronously, so only the last one is known at the end
  * @param position_arr Position array
  * @param nearest nearest array
+ * @param output_force force array, calculated on device
+ * @param velocity Velocity array
  * @return void
  */
-void nearest_image(cl_float3 *position_arr, cl_float3 *nearest){
-    for (int i = 0; i < particles_count; i++){
+void md_pipelined(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force, cl_float3 *velocity) {
+    for (int n = 0; n < total_it; n ++){
+        step_velocity = n ? velocity : NULL;
+        /** motion and nearest_image are done by chunks as soon as force of chunk is read */
+        run_pipelined(n, position_arr);
+    }
+    finish_pipeline();
+    uint64_t synchronize_start = trace_now();
+    final_kinetic_energy = synchronize_velocity(velocity, output_force) / particles_count;
+    trace_host("synchronize_velocity", synchronize_start);
+}
+
+/**
+ * @brief closing half-kick of velocity Verlet, velocities are brought to the same step as positions
+ * @param velocity Velocity array
+ * @param output_force force array
+ * @return kinetic energy
+ */
+float synchronize_velocity(cl_float3 *velocity, cl_float3 *output_force) {
+    float kick = velocity_is_half_step ? dt / 2 : 0;
+    /** closing half-kick of the last outer step uses its own slow force */
+    float slow = (velocity_is_half_step && respa_steps) ? respa_steps * dt / 2 : 0;
+    float kinetic_energy = 0;
+    for (int i = 0; i < particles_count; i++) {
+        /* v += f * dt / 2 */
+        velocity[i] = (cl_float3) {velocity[i].x + output_force[i].x * kick + slow_force[i].x * slow,
+            velocity[i].y + output_force[i].y * kick + slow_force[i].y * slow,
+            velocity[i].z + output_force[i].z * kick + slow_force[i].z * slow};
+        kinetic_energy += (velocity[i].x * velocity[i].x + velocity[i].y * velocity[i].y + velocity[i].z * velocity[i].z) / 2;
+    }
+    velocity_is_half_step = false;
+    slow_kick = 0;
+    return kinetic_energy;
+}
+
+/**
+ * @brief first part of implementation of periodic boundary conditions,
+ * with step_velocity it is fused with velocity Verlet kicks and drift
+ * @details closing half-kick of previous step and opening half-kick of this step use the same force,
+ * so they are done as one kick by dt
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param output_force force array from previous step
+ * @return void
+ */
+void nearest_image(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force){
+    nearest_image_range(position_arr, nearest, output_force, 0, particles_count);
+    end_nearest_image();
+}
+
+/**
+ * @brief nearest_image pass for particles first .. last - 1, end_nearest_image must be called after all of them
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param output_force force array from previous step
+ * @param first the first particle
+ * @param last particle after the last one
+ * @return void
+ */
+void nearest_image_range(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force, int first, int last){
+    float kick = velocity_is_half_step ? dt : dt / 2;
+    for (int i = first; i < last; i++){
+        if (step_velocity){
+            /* v += f * kick, RESPA slow force is added once per outer step */
+            step_velocity[i] = (cl_float3) {step_velocity[i].x + output_force[i].x * kick + slow_force[i].x * slow_kick,
+                step_velocity[i].y + output_force[i].y * kick + slow_force[i].y * slow_kick,
+                step_velocity[i].z + output_force[i].z * kick + slow_force[i].z * slow_kick};
+            /* r += v * dt */
+            position_arr[i] = (cl_float3) {position_arr[i].x + step_velocity[i].x * dt,
+                position_arr[i].y + step_velocity[i].y * dt,
+                position_arr[i].z + step_velocity[i].z * dt};
+        }
         float x,y,z;
         if (position_arr[i].x  > 0){
             x = fmod(position_arr[i].x + half_box, box_size) - half_box;
@@ -136,3 +274,14 @@ void nearest_image(cl_float3 *position_arr, cl_float3 *nearest){
         nearest[i] = (cl_float3){ x, y, z};
     }
 }
+
+/**
+ * @brief velocities are at half step after the whole nearest_image pass
+ * @return void
+ */
+void end_nearest_image(){
+    if (step_velocity){
+        velocity_is_half_step = true;
+        slow_kick = 0;
+    }
+}
@@ -0,0 +1,11 @@
+#define rc 3
+#define box_size 8
+#define half_box 4
+#define particles_count 64
+#define total_it 5000
+#define dt 0.0002
+#define Temperature 1.3
+#define initial_dist_by_one_axis 1.8
+#define initial_dist_to_edge 2
+#define SIGMA 0.221f
+#define DERIVATIVE_ERF 2.556f
\ No newline at end of file
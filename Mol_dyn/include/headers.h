@@ -15,6 +15,15 @@
 #include "parameters.h"
 
 #define MAX_PLATFORMS_COUNT 2
+#define MAX_DEVICES_COUNT 8
+/** alignment and size granularity of zero-copy arrays, one page */
+#define ZERO_COPY_ALIGNMENT 4096
+/** trace tracks of queues, host is track 0, devices of particle decomposition are TRACE_QUEUE + i */
+#define TRACE_QUEUE 1
+#define TRACE_TRANSFER_QUEUE 2
+#define TRACE_UPLOAD_QUEUE 3
+/** pipelined loop integrates, uploads and reads back particles in this number of chunks */
+#define PIPELINE_CHUNKS 4
 
 /**
  * Prototypes
@@ -24,8 +33,36 @@ bool init_opencl_coulomb();
 void run_lj();
 void run_coulomb();
 void cleanup();
+bool find_platform();
+cl_program create_program(const char *name, const char *options);
+cl_program create_device_program(cl_device_id program_device, const char *name, const char *options);
+bool init_multi_device();
+void balance_devices();
+void run_multi_device();
+bool apply_tuning();
+struct tuning_config;
+bool tune_lj(tuning_config *config);
+void init_zero_copy_arrays();
+void *zero_copy_alloc(size_t size);
+void zero_copy_free(void *pointer);
+int map_zero_copy(cl_uint wait_count, const cl_event *wait_list, cl_event *map_event);
+int unmap_zero_copy(cl_event *unmap_event);
+void run_zero_copy(cl_kernel force_kernel, bool with_charge, const char *trace_name);
+bool init_device_loop();
+void enqueue_integrate(cl_float kick, cl_float drift);
+void release_integrate_events();
+void enqueue_force();
+float read_energy(cl_float *output_energy);
+void read_state(cl_float3 *position_arr, cl_float3 *velocity);
+void init_pipeline();
+void run_pipelined(int step, cl_float3 *position_arr);
+void finish_pipeline();
+void md_pipelined(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force, cl_float3 *velocity);
+void md_device(cl_float3 *position_arr, cl_float *output_energy, cl_float3 *velocity);
 void init_problem(cl_float3 *position_arr, cl_float3 *velocity, cl_int *charge);
 void md(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force, cl_float *output_energy, cl_float3 *velocity, cl_int *charge);
-void nearest_image(cl_float3 *position_arr, cl_float3 *nearest);
-void calculate_energy_force(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force, cl_float *output_energy, cl_int *charge);
-void motion(cl_float3 *position_arr, cl_float3 *velocity, cl_float3 *output_force);
\ No newline at end of file
+void nearest_image(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force);
+void nearest_image_range(cl_float3 *position_arr, cl_float3 *nearest, cl_float3 *output_force, int first, int last);
+void end_nearest_image();
+float calculate_energy_force(cl_float3 *nearest, cl_float3 *output_force, cl_float *output_energy, cl_int *charge, void (*kernel_run)());
+float synchronize_velocity(cl_float3 *velocity, cl_float3 *output_force);
\ No newline at end of file
@@ -13,9 +13,65 @@
 #include <sys/timeb.h>
 #include <omp.h>
 #include <string.h>
+/*
+ * Kernels specialised for N particles use box, cutoff and time step of include/<N>parameters.h as compile time constants
+ */
+template <int N> struct preset;
+#include "16parameters.h"
+#include "preset.h"
+#include "32parameters.h"
+#include "preset.h"
+#include "64parameters.h"
+#include "preset.h"
+#include "128parameters.h"
+#include "preset.h"
+#include "256parameters.h"
+#include "preset.h"
+#include "512parameters.h"
+#include "preset.h"
+#include "1024parameters.h"
+#include "preset.h"
 #include "parameters.h"
+#include "simd.h"
+#include "pme.h"
+
+/*
+ * Values from parameters.h are defaults, they can be changed from command line or config file
+ */
+const int default_particles_count = particles_count;
+const double default_box_size = box_size;
+const int default_total_it = total_it;
+const double default_dt = dt;
+const double default_rc = rc;
+const double default_initial_dist_by_one_axis = initial_dist_by_one_axis;
+#undef particles_count
+#undef box_size
+#undef half_box
+#undef total_it
+#undef dt
+#undef rc
+#undef initial_dist_by_one_axis
+int particles_count = default_particles_count;
+double box_size = default_box_size;
+double half_box = default_box_size / 2;
+int total_it = default_total_it;
+double dt = default_dt;
+double rc = default_rc;
+double initial_dist_by_one_axis = default_initial_dist_by_one_axis;
+/** generic kernels for N = 0 use runtime values */
+template <int N> struct preset {
+    static double box() { return ::box_size; }
+    static double half() { return ::half_box; }
+    static double cutoff() { return ::rc; }
+    static double step() { return ::dt; }
+};
+/** initial lattice is recalculated if size of system was changed without spacing */
+bool size_is_set = false;
+bool spacing_is_set = false;
 
 #define NUM_THREADS 8
+/** Verlet list is built with rc + SKIN radius */
+#define SKIN 0.3
 
 /**
  * Structs
@@ -27,42 +83,203 @@ struct dim {
 };
 typedef struct dim dim;
 
+/**
+ * Structure of arrays for SIMD kernels, arrays are aligned and padded to SIMD_WIDTH
+ */
+struct soa {
+    float *x;
+    float *y;
+    float *z;
+    float *charge;
+};
+typedef struct soa soa;
+
+/**
+ * Force kernels, each of them has compile time specialisations for preset sizes
+ */
+enum kernel_type {
+    KERNEL_LJ,
+    KERNEL_COULOMB,
+    KERNEL_LJ_CELLS,
+    KERNEL_LJ_VERLET,
+    KERNEL_LJ_HALF,
+    KERNEL_COULOMB_HALF,
+    KERNEL_LJ_SIMD,
+    KERNEL_COULOMB_SIMD,
+    KERNEL_COULOMB_PME
+};
+typedef double (*energy_force_kernel)(dim*, dim*, dim*, int*);
+
 /**
  * Prototypes
  */
-void nearest_image(dim *position_arr, dim *nearest);
+template <int N> void nearest_image(dim *position_arr, dim *nearest, dim *output_force);
 void init_problem(dim *position_arr, dim *velocity, dim *output_force, int *charge);
 void md(dim *position_arr, dim *velocity, dim *output_force, dim *nearest, int *charge);
-double calculate_energy_force_lj(dim *position_arr, dim *nearest, dim *output_force, int *charge);
-double calculate_energy_force_coulomb(dim *position_arr, dim *nearest, dim *output_force, int *charge);
-void motion(dim *position_arr, dim *velocity, dim *output_force);
+template <int N> double calculate_energy_force_lj(dim *position_arr, dim *nearest, dim *output_force, int *charge);
+template <int N> double calculate_energy_force_coulomb(dim *position_arr, dim *nearest, dim *output_force, int *charge);
+template <int N> double calculate_energy_force_lj_cells(dim *position_arr, dim *nearest, dim *output_force, int *charge);
+template <int N> double calculate_energy_force_lj_half(dim *position_arr, dim *nearest, dim *output_force, int *charge);
+template <int N> double calculate_energy_force_coulomb_half(dim *position_arr, dim *nearest, dim *output_force, int *charge);
+void reduce_thread_force(dim *output_force);
+template <int N> double calculate_energy_force_lj_simd(dim *position_arr, dim *nearest, dim *output_force, int *charge);
+template <int N> double calculate_energy_force_coulomb_simd(dim *position_arr, dim *nearest, dim *output_force, int *charge);
+template <int N> double calculate_energy_force_coulomb_pme(dim *position_arr, dim *nearest, dim *output_force, int *charge);
+void init_soa();
+void pack_soa(dim *nearest, int *charge);
+void free_soa();
+template <int N> double calculate_energy_force_lj_verlet(dim *position_arr, dim *nearest, dim *output_force, int *charge);
+bool init_cells(double cutoff);
+void build_cells(dim *nearest);
+void free_cells();
+void init_verlet();
+bool verlet_needs_rebuild(dim *position_arr);
+void build_verlet(dim *position_arr, dim *nearest);
+void free_verlet();
+double synchronize_velocity(dim *velocity, dim *output_force);
+template <int N> energy_force_kernel select_kernel(kernel_type kernel);
+template <int N> bool preset_matches();
+energy_force_kernel dispatch_kernel(kernel_type kernel);
+kernel_type prepare_kernel(bool coulomb_force, bool use_cells, bool use_verlet, bool use_half, bool use_simd, bool use_pme);
+bool set_parameter(const char *name, const char *value);
+bool read_config(const char *file_name);
 
-double (*calculate_energy_force)(dim*, dim*, dim*, int*);
+energy_force_kernel calculate_energy_force;
+bool coulomb = false;
+
+/*
+ * Thread private forces for half-pair calculation, NUM_THREADS arrays of particles_count
+ */
+dim *thread_force = NULL;
+
+/*
+ * Nearest images and charges in float SoA layout for SIMD kernels
+ */
+soa particles_soa = {};
+
+/*
+ * Particle-mesh Ewald grid, grid size 0 means default size
+ */
+pme_grid pme = {};
+int pme_size = 0;
+
+/*
+ * Velocity Verlet state, kicks and drift are done in nearest_image pass of force kernels,
+ * NULL velocity means that positions are only wrapped
+ */
+dim *step_velocity = NULL;
+bool velocity_is_half_step = false;
+
+/*
+ * RESPA, LJ force is calculated every step and coulomb force every respa_steps steps, 0 means no RESPA,
+ * slow force is applied in nearest_image pass with slow_kick step
+ */
+int respa_steps = 0;
+energy_force_kernel calculate_slow_force = NULL;
+dim *slow_force = NULL;
+/** slow force of the last iteration if it is not at outer step, it is calculated for energy only */
+dim *slow_scratch = NULL;
+double slow_kick = 0;
+
+/*
+ * Cell list for LJ, cells edge is not less than rc
+ */
+int cells_per_axis = 0;
+double cell_size = 0;
+int *cell_head = NULL;
+int *cell_next = NULL;
+
+/*
+ * Verlet list, neighbours of particle i are stored in neighbours[i * max_neighbours ...]
+ */
+int max_neighbours = 0;
+int *neighbours = NULL;
+int *neighbours_count = NULL;
+dim *verlet_position = NULL;
+bool verlet_valid = false;
+int verlet_rebuilds = 0;
 
 /** @brief md_cpu.cpp entrypoint
  *
  * @details This is entrypoint for molecular dynamics simulation
- * @param argv[1] --coulomb or --help or None
+ * @param argv --coulomb, --cells, --verlet, --half, --simd, --pme, --respa k, --help, parameters or None
  * @return return 0 or -1
  */
 int main(int argc, char *argv[])
 {
-    calculate_energy_force = calculate_energy_force_lj;
-    if (argc > 1){
-        if (!strcmp(argv[1], "--coulomb")){
-            calculate_energy_force = calculate_energy_force_coulomb;
+    const char usage[] = "Usage: %s [--help][--coulomb][--cells][--verlet][--half][--simd][--pme]"
+        "[--config file][--particles n][--box size][--iterations n][--dt step][--rc cutoff][--spacing dist][--pme_grid size][--respa k]";
+    bool use_cells = false;
+    bool use_verlet = false;
+    bool use_half = false;
+    bool use_simd = false;
+    bool use_pme = false;
+    for (int arg = 1; arg < argc; arg++){
+        if (!strcmp(argv[arg], "--coulomb")){
+            coulomb = true;
+        }
+        else if (!strcmp(argv[arg], "--cells")){
+            use_cells = true;
+        }
+        else if (!strcmp(argv[arg], "--verlet")){
+            use_verlet = true;
+        }
+        else if (!strcmp(argv[arg], "--half")){
+            use_half = true;
+        }
+        else if (!strcmp(argv[arg], "--simd")){
+            use_simd = true;
+        }
+        else if (!strcmp(argv[arg], "--pme")){
+            use_pme = true;
+            coulomb = true;
+        }
+        else if (!strcmp(argv[arg], "--config") && (arg + 1 < argc)){
+            if (!read_config(argv[++arg])){
+                return -1;
+            }
+        }
+        else if (!strncmp(argv[arg], "--", 2) && (arg + 1 < argc) && set_parameter(argv[arg] + 2, argv[arg + 1])){
+            arg++;
         }
         else{
-            if (!strcmp(argv[1], "--help")){
-                printf("Usage: %s [--help][--coulomb]", argv[0]);
+            if (!strcmp(argv[arg], "--help")){
+                printf(usage, argv[0]);
             }
             else{
                 printf("invalid argument\n");
-                printf("Usage: %s [--help][--coulomb]", argv[0]);
+                printf(usage, argv[0]);
                 return -1;
             }
         }
     }
+    if (size_is_set && !spacing_is_set){
+        /** initial lattice must hold all particles */
+        initial_dist_by_one_axis = (box_size - initial_dist_to_edge) / ceil(cbrt((double)particles_count));
+    }
+    /** with RESPA coulomb force is slow force and LJ force is fast force */
+    if (respa_steps){
+        coulomb = true;
+    }
+    /** real space part of PME is cut at rc, reciprocal part is calculated on grid */
+    if (use_pme){
+        if (rc > half_box){
+            printf("rc must not be greater than half of box for PME\n");
+            return -1;
+        }
+        double beta = PME_BETA_RC / rc;
+        if (!pme_init(&pme, pme_size ? pme_size : pme_default_size(box_size, beta), box_size, beta)){
+            return -1;
+        }
+        printf("PME grid %d, beta %f\n", pme.size, beta);
+    }
+    if (respa_steps){
+        calculate_slow_force = dispatch_kernel(prepare_kernel(true, use_cells, use_verlet, use_half, use_simd, use_pme));
+        slow_force = (dim*)malloc(sizeof(dim) * particles_count);
+        slow_scratch = (dim*)malloc(sizeof(dim) * particles_count);
+    }
+    kernel_type kernel = prepare_kernel(coulomb && !respa_steps, use_cells, use_verlet, use_half, use_simd, use_pme);
+    calculate_energy_force = dispatch_kernel(kernel);
     struct timeb start_total_time;
     ftime(&start_total_time);
     dim *position_arr = (dim*)malloc(sizeof(dim) * particles_count);
@@ -73,14 +290,30 @@ int main(int argc, char *argv[])
 
     init_problem(position_arr, velocity,output_force, charge);
     md(position_arr, velocity, output_force, nearest, charge);
+    if (kernel == KERNEL_LJ_VERLET){
+        printf("Verlet list rebuilds %d of %d iterations\n", verlet_rebuilds, total_it);
+    }
 
     free(position_arr);
     free(nearest);
     free(velocity);
     free(output_force);
     free(charge);
+    free(slow_force);
+    free(slow_scratch);
+    free_cells();
+    free_verlet();
+    free(thread_force);
+    free_soa();
+    pme_free(&pme);
     struct timeb end_total_time;
     ftime(&end_total_time);
+    int total_ms = (int)((end_total_time.time - start_total_time.time) * 1000 + end_total_time.millitm - start_total_time.millitm);
+    /** only all-pairs kernels evaluate N * N pairs per step, others are compared by time per particle */
+    if ((kernel == KERNEL_LJ) || (kernel == KERNEL_COULOMB) || (kernel == KERNEL_LJ_SIMD) || (kernel == KERNEL_COULOMB_SIMD)){
+        printf("Time per pair in ns = %0.3f\n", total_ms * 1000000.0 / ((double)total_it * particles_count * particles_count));
+    }
+    printf("Time per step per particle in ns = %0.3f\n", total_ms * 1000000.0 / ((double)total_it * particles_count));
     printf("Total execution time in ms =  %d", (int)((end_total_time.time - start_total_time.time) * 1000 + end_total_time.millitm - start_total_time.millitm));
     return 0;
 }
@@ -89,6 +322,179 @@ int main(int argc, char *argv[])
  * helper functions
  */
 
+/**
+ * @brief set simulation parameter
+ * @param name particles, box, iterations, dt, rc, spacing, pme_grid or respa, parameters.h names are accepted too
+ * @param value value of parameter
+ * @return True if parameter is known and value is valid, False otherwise
+ */
+bool set_parameter(const char *name, const char *value){
+    char *end;
+    double number = strtod(value, &end);
+    if ((end == value) || (*end != '\0') || (number <= 0)){
+        return false;
+    }
+    if (!strcmp(name, "particles") || !strcmp(name, "particles_count")){
+        particles_count = (int)number;
+        size_is_set = true;
+    }
+    else if (!strcmp(name, "box") || !strcmp(name, "box_size")){
+        box_size = number;
+        half_box = number / 2;
+        size_is_set = true;
+    }
+    else if (!strcmp(name, "iterations") || !strcmp(name, "total_it")){
+        total_it = (int)number;
+    }
+    else if (!strcmp(name, "dt")){
+        dt = number;
+    }
+    else if (!strcmp(name, "rc")){
+        rc = number;
+    }
+    else if (!strcmp(name, "respa") || !strcmp(name, "respa_steps")){
+        respa_steps = (int)number;
+    }
+    else if (!strcmp(name, "pme_grid")){
+        pme_size = (int)number;
+    }
+    else if (!strcmp(name, "spacing") || !strcmp(name, "initial_dist_by_one_axis")){
+        initial_dist_by_one_axis = number;
+        spacing_is_set = true;
+    }
+    else{
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief read simulation parameters from file, each line is "name value" or "#define name value",
+ * so presets from include directory can be used as config files
+ * @param file_name config file
+ * @return True if file is read, False if error occured
+ */
+bool read_config(const char *file_name){
+    FILE *fp = fopen(file_name, "r");
+    if (!fp){
+        fprintf(stderr, "Failed to open config %s\n", file_name);
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp)){
+        char name[128];
+        char value[128];
+        const char *start = strncmp(line, "#define", 7) ? line : line + 7;
+        if (sscanf(start, "%127s %127s", name, value) != 2){
+            continue;
+        }
+        /** half_box is derived from box_size, constants like Temperature stay compiled in */
+        set_parameter(name, value);
+    }
+    fclose(fp);
+    return true;
+}
+
+/**
+ * @brief choose force kernel from command line flags and allocate its data structures
+ * @param coulomb_force True for coulomb kernel, False for LJ kernel
+ * @param use_cells cell list for LJ
+ * @param use_verlet Verlet list for LJ
+ * @param use_half half-pair calculation
+ * @param use_simd SIMD kernels
+ * @param use_pme particle-mesh Ewald for coulomb, grid must be initialized
+ * @return kernel type
+ */
+kernel_type prepare_kernel(bool coulomb_force, bool use_cells, bool use_verlet, bool use_half, bool use_simd, bool use_pme){
+    kernel_type kernel = coulomb_force ? KERNEL_COULOMB : KERNEL_LJ;
+    if (use_pme && coulomb_force){
+        init_cells(rc);
+        kernel = KERNEL_COULOMB_PME;
+    }
+    /** cell and Verlet lists are used only for LJ, because coulomb potential has no cutoff */
+    if (use_verlet && !coulomb_force){
+        /** Verlet list is built from cell list if box is large enough, otherwise from all pairs */
+        init_cells(rc + SKIN);
+        init_verlet();
+        kernel = KERNEL_LJ_VERLET;
+    }
+    else if (use_cells && !coulomb_force){
+        if (init_cells(rc)){
+            kernel = KERNEL_LJ_CELLS;
+        }
+        else{
+            printf("box is too small for cell list, all pairs are used\n");
+        }
+    }
+    /** float SoA copy of particles is processed SIMD_WIDTH particles at once */
+    if (use_simd && ((kernel == KERNEL_LJ) || (kernel == KERNEL_COULOMB))){
+        printf("%s SIMD kernels are used\n", SIMD_NAME);
+        if (!particles_soa.x){
+            init_soa();
+        }
+        kernel = coulomb_force ? KERNEL_COULOMB_SIMD : KERNEL_LJ_SIMD;
+    }
+    /** each pair is calculated once, forces are accumulated in thread private arrays */
+    if (use_half && ((kernel == KERNEL_LJ) || (kernel == KERNEL_COULOMB))){
+        if (!thread_force){
+            thread_force = (dim*)malloc(sizeof(dim) * NUM_THREADS * particles_count);
+        }
+        kernel = coulomb_force ? KERNEL_COULOMB_HALF : KERNEL_LJ_HALF;
+    }
+    return kernel;
+}
+
+/**
+ * @brief choose force kernel for compile time particles count N, N = 0 is generic runtime size
+ * @param kernel kernel type
+ * @return force kernel
+ */
+template <int N>
+energy_force_kernel select_kernel(kernel_type kernel){
+    switch (kernel){
+        case KERNEL_COULOMB: return calculate_energy_force_coulomb<N>;
+        case KERNEL_LJ_CELLS: return calculate_energy_force_lj_cells<N>;
+        case KERNEL_LJ_VERLET: return calculate_energy_force_lj_verlet<N>;
+        case KERNEL_LJ_HALF: return calculate_energy_force_lj_half<N>;
+        case KERNEL_COULOMB_HALF: return calculate_energy_force_coulomb_half<N>;
+        case KERNEL_LJ_SIMD: return calculate_energy_force_lj_simd<N>;
+        case KERNEL_COULOMB_SIMD: return calculate_energy_force_coulomb_simd<N>;
+        case KERNEL_COULOMB_PME: return calculate_energy_force_coulomb_pme<N>;
+        default: return calculate_energy_force_lj<N>;
+    }
+}
+
+/**
+ * @brief specialisation for N particles can be used if box, cutoff and time step were not changed
+ * @return True if runtime values are values of the preset, False otherwise
+ */
+template <int N>
+bool preset_matches(){
+    return (box_size == preset<N>::box()) && (rc == preset<N>::cutoff()) && (dt == preset<N>::step());
+}
+
+/**
+ * @brief use specialisation for preset particles count if there is one and its constants match, generic kernel otherwise
+ * @param kernel kernel type
+ * @return force kernel
+ */
+energy_force_kernel dispatch_kernel(kernel_type kernel){
+    switch (particles_count){
+        case 16: if (preset_matches<16>()) return select_kernel<16>(kernel); break;
+        case 32: if (preset_matches<32>()) return select_kernel<32>(kernel); break;
+        case 64: if (preset_matches<64>()) return select_kernel<64>(kernel); break;
+        case 128: if (preset_matches<128>()) return select_kernel<128>(kernel); break;
+        case 256: if (preset_matches<256>()) return select_kernel<256>(kernel); break;
+        case 512: if (preset_matches<512>()) return select_kernel<512>(kernel); break;
+        case 1024: if (preset_matches<1024>()) return select_kernel<1024>(kernel); break;
+        default:
+            printf("there is no specialisation for %d particles, generic kernel is used\n", particles_count);
+            return select_kernel<0>(kernel);
+    }
+    printf("box, rc or dt differ from preset for %d particles, generic kernel is used\n", particles_count);
+    return select_kernel<0>(kernel);
+}
+
 /**
  * @brief set initial coordinates, velocities and charges for all particles
  * @param position_arr Position array
@@ -107,7 +513,7 @@ void init_problem(dim *position_arr, dim *velocity, dim *output_force, int *char
                 position_arr[count] = { i,j,l };
                 velocity[count] = { 0, 0, 0 };
                 output_force[count] = { 0, 0, 0 };
-                if (calculate_energy_force == calculate_energy_force_coulomb){
+                if (coulomb){
                     if (count & 1)
                         charge[count] = 1;
                     else
@@ -124,13 +530,39 @@ void init_problem(dim *position_arr, dim *velocity, dim *output_force, int *char
 }
 
 /**
- * @brief first part of implementation of periodic boundary conditions
+ * @brief first part of implementation of periodic boundary conditions,
+ * with step_velocity it is fused with velocity Verlet kicks and drift
+ * @details closing half-kick of previous step and opening half-kick of this step use the same force,
+ * so they are done as one kick by dt
  * @param position_arr Position array
  * @param nearest nearest array
+ * @param output_force force array from previous step
  * @return void
  */
-void nearest_image(dim *position_arr, dim *nearest){
+template <int N>
+void nearest_image(dim *position_arr, dim *nearest, dim *output_force){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    const double dt = preset<N>::step();
+    double kick = velocity_is_half_step ? dt : dt / 2;
+    #pragma omp parallel for num_threads(NUM_THREADS)
     for (int i = 0; i < particles_count; i++){
+        if (step_velocity){
+            /* v += f * kick, RESPA slow force is added once per outer step */
+            step_velocity[i] = {step_velocity[i].x + output_force[i].x * kick,
+                step_velocity[i].y + output_force[i].y * kick,
+                step_velocity[i].z + output_force[i].z * kick};
+            if (slow_kick){
+                step_velocity[i] = {step_velocity[i].x + slow_force[i].x * slow_kick,
+                    step_velocity[i].y + slow_force[i].y * slow_kick,
+                    step_velocity[i].z + slow_force[i].z * slow_kick};
+            }
+            /* r += v * dt */
+            position_arr[i] = {position_arr[i].x + step_velocity[i].x * dt,
+                position_arr[i].y + step_velocity[i].y * dt,
+                position_arr[i].z + step_velocity[i].z * dt};
+        }
         float x,y,z;
         if (position_arr[i].x  > 0){
             x = fmod(position_arr[i].x + half_box, box_size) - half_box;
@@ -152,6 +584,10 @@ void nearest_image(dim *position_arr, dim *nearest){
         }
         nearest[i] = (dim){ x, y, z};
     }
+    if (step_velocity){
+        velocity_is_half_step = true;
+        slow_kick = 0;
+    }
 }
 
 /**
@@ -162,11 +598,16 @@ void nearest_image(dim *position_arr, dim *nearest){
  * @param charge array Charge array
  * @return energy
  */
+template <int N>
 double calculate_energy_force_lj(dim *position_arr, dim *nearest, dim *output_force, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    const double rc = preset<N>::cutoff();
+    nearest_image<N>(position_arr, nearest, output_force);
     for (int i = 0; i < particles_count; i++){
         output_force[i] = { 0, 0, 0};
     }
-    nearest_image(position_arr, nearest);
     double energy = 0;
     #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
     for (int i = 0; i < particles_count; i++) {
@@ -217,6 +658,627 @@ double calculate_energy_force_lj(dim *position_arr, dim *nearest, dim *output_fo
     return energy / 2;
 }
 
+/**
+ * @brief allocate cell list, box is divided into cells with edge not less than cutoff
+ * @param cutoff minimal edge of cell
+ * @return True if there are at least 3 cells per axis, False otherwise
+ */
+bool init_cells(double cutoff){
+    /** RESPA kernels can share one list, the last one with larger cells is kept */
+    free_cells();
+    cells_per_axis = (int)(box_size / cutoff);
+    /** with less than 3 cells per axis neighbour cells overlap */
+    if (cells_per_axis < 3){
+        return false;
+    }
+    cell_size = (double)box_size / cells_per_axis;
+    cell_head = (int*)malloc(sizeof(int) * cells_per_axis * cells_per_axis * cells_per_axis);
+    cell_next = (int*)malloc(sizeof(int) * particles_count);
+    return true;
+}
+
+/**
+ * @brief free cell list
+ * @return void
+ */
+void free_cells(){
+    free(cell_head);
+    free(cell_next);
+    cell_head = NULL;
+    cell_next = NULL;
+}
+
+/**
+ * @brief put particles into cells, particles of one cell form linked list
+ * @param nearest nearest array
+ * @return void
+ */
+void build_cells(dim *nearest){
+    int cells_count = cells_per_axis * cells_per_axis * cells_per_axis;
+    for (int c = 0; c < cells_count; c++){
+        cell_head[c] = -1;
+    }
+    for (int i = 0; i < particles_count; i++){
+        int cx = (int)((nearest[i].x + half_box) / cell_size);
+        int cy = (int)((nearest[i].y + half_box) / cell_size);
+        int cz = (int)((nearest[i].z + half_box) / cell_size);
+        /** nearest image can be exactly on the box edge */
+        cx = cx < 0 ? 0 : (cx >= cells_per_axis ? cells_per_axis - 1 : cx);
+        cy = cy < 0 ? 0 : (cy >= cells_per_axis ? cells_per_axis - 1 : cy);
+        cz = cz < 0 ? 0 : (cz >= cells_per_axis ? cells_per_axis - 1 : cz);
+        int c = (cx * cells_per_axis + cy) * cells_per_axis + cz;
+        cell_next[i] = cell_head[c];
+        cell_head[c] = i;
+    }
+}
+
+/**
+ * @brief sum thread private forces, must be called inside parallel region
+ * @param output_force force array
+ * @return void
+ */
+void reduce_thread_force(dim *output_force){
+    int threads = omp_get_num_threads();
+    #pragma omp for
+    for (int i = 0; i < particles_count; i++) {
+        double force_x = 0;
+        double force_y = 0;
+        double force_z = 0;
+        for (int t = 0; t < threads; t++) {
+            force_x += thread_force[t * particles_count + i].x;
+            force_y += thread_force[t * particles_count + i].y;
+            force_z += thread_force[t * particles_count + i].z;
+        }
+        output_force[i].x = force_x;
+        output_force[i].y = force_y;
+        output_force[i].z = force_z;
+    }
+}
+
+/**
+ * @brief calculate energy and force for LJ, each pair is considered once
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param output_force force array
+ * @param charge array Charge array
+ * @return energy
+ */
+template <int N>
+double calculate_energy_force_lj_half(dim *position_arr, dim *nearest, dim *output_force, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    const double rc = preset<N>::cutoff();
+    nearest_image<N>(position_arr, nearest, output_force);
+    double energy = 0;
+    #pragma omp parallel reduction(+:energy) num_threads(NUM_THREADS)
+    {
+        dim *force = thread_force + omp_get_thread_num() * particles_count;
+        for (int i = 0; i < particles_count; i++){
+            force[i] = { 0, 0, 0};
+        }
+        /** rows are of different length, so dynamic schedule */
+        #pragma omp for schedule(dynamic, 16)
+        for (int i = 0; i < particles_count; i++) {
+            double force_x = 0;
+            double force_y = 0;
+            double force_z = 0;
+            for (int j = i + 1; j < particles_count; j++) {
+                float x = nearest[j].x - nearest[i].x;
+                float y = nearest[j].y - nearest[i].y;
+                float z = nearest[j].z - nearest[i].z;
+                /* second part of implementation of periodic boundary conditions */
+                if (x > half_box)
+                    x -= box_size;
+                else {
+                    if (x < -half_box)
+                        x += box_size;
+                }
+                if (y > half_box)
+                    y -= box_size;
+                else {
+                    if (y < -half_box)
+                        y += box_size;
+                }
+                if (z > half_box)
+                    z -= box_size;
+                else {
+                    if (z < -half_box)
+                        z += box_size;
+                }
+                float sq_dist = x * x + y * y + z * z;
+                if (sq_dist < rc * rc) {
+                    double r6 = sq_dist * sq_dist * sq_dist;
+                    double r12 = r6 * r6;
+                    double r8 = r6 * sq_dist;
+                    double r14 = r12 * sq_dist;
+                    double multiplier = (24 * (2 / r14 - 1 / r8));
+                    force_x += x * multiplier;
+                    force_y += y * multiplier;
+                    force_z += z * multiplier;
+                    /** Newton's third law */
+                    force[j].x -= x * multiplier;
+                    force[j].y -= y * multiplier;
+                    force[j].z -= z * multiplier;
+                    energy += 4 * (1 / r12 - 1 / r6);
+                }
+            }
+            force[i].x += force_x;
+            force[i].y += force_y;
+            force[i].z += force_z;
+        }
+        reduce_thread_force(output_force);
+    }
+    return energy;
+}
+
+/**
+ * @brief allocate SoA arrays
+ * @return void
+ */
+void init_soa(){
+    particles_soa.x = simd_alloc(particles_count);
+    particles_soa.y = simd_alloc(particles_count);
+    particles_soa.z = simd_alloc(particles_count);
+    particles_soa.charge = simd_alloc(particles_count);
+    /** padding is masked in kernels, but it should not contain NaN */
+    int padded = ((particles_count + SIMD_WIDTH - 1) / SIMD_WIDTH) * SIMD_WIDTH;
+    for (int i = particles_count; i < padded; i++){
+        particles_soa.x[i] = 0;
+        particles_soa.y[i] = 0;
+        particles_soa.z[i] = 0;
+        particles_soa.charge[i] = 0;
+    }
+}
+
+/**
+ * @brief free SoA arrays
+ * @return void
+ */
+void free_soa(){
+    free(particles_soa.x);
+    free(particles_soa.y);
+    free(particles_soa.z);
+    free(particles_soa.charge);
+    particles_soa = (soa){};
+}
+
+/**
+ * @brief copy nearest images and charges to SoA arrays
+ * @param nearest nearest array
+ * @param charge Charge array
+ * @return void
+ */
+void pack_soa(dim *nearest, int *charge){
+    for (int i = 0; i < particles_count; i++){
+        particles_soa.x[i] = nearest[i].x;
+        particles_soa.y[i] = nearest[i].y;
+        particles_soa.z[i] = nearest[i].z;
+        particles_soa.charge[i] = coulomb ? charge[i] : 0;
+    }
+}
+
+/**
+ * @brief calculate energy and force for LJ, SIMD_WIDTH particles j are processed at once
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param output_force force array
+ * @param charge array Charge array
+ * @return energy
+ */
+template <int N>
+double calculate_energy_force_lj_simd(dim *position_arr, dim *nearest, dim *output_force, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    const double rc = preset<N>::cutoff();
+    nearest_image<N>(position_arr, nearest, output_force);
+    pack_soa(nearest, charge);
+    const float *px = particles_soa.x;
+    const float *py = particles_soa.y;
+    const float *pz = particles_soa.z;
+    const vfloat half = v_set(half_box);
+    const vfloat box = v_set(box_size);
+    const vfloat sq_rc = v_set(rc * rc);
+    const vfloat zero = v_set(0);
+    const vfloat one = v_set(1);
+    double energy = 0;
+    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
+    for (int i = 0; i < particles_count; i++) {
+        vfloat xi = v_set(px[i]);
+        vfloat yi = v_set(py[i]);
+        vfloat zi = v_set(pz[i]);
+        vfloat force_x = zero;
+        vfloat force_y = zero;
+        vfloat force_z = zero;
+        vfloat energy_i = zero;
+        for (int j = 0; j < particles_count; j += SIMD_WIDTH) {
+            vfloat x = v_minimum_image(v_sub(v_load(px + j), xi), half, box);
+            vfloat y = v_minimum_image(v_sub(v_load(py + j), yi), half, box);
+            vfloat z = v_minimum_image(v_sub(v_load(pz + j), zi), half, box);
+            vfloat sq_dist = v_fmadd(x, x, v_fmadd(y, y, v_mul(z, z)));
+            vmask mask = v_and(v_valid(j, i, particles_count), v_lt(sq_dist, sq_rc));
+            if (!v_any(mask)) {
+                continue;
+            }
+            vfloat inv_r2 = v_div(one, v_select(mask, sq_dist, one));
+            vfloat inv_r6 = v_mul(v_mul(inv_r2, inv_r2), inv_r2);
+            /** 24 * (2 / r14 - 1 / r8) */
+            vfloat multiplier = v_mul(v_mul(v_set(24), v_mul(inv_r6, inv_r2)), v_fmadd(v_set(2), inv_r6, v_set(-1)));
+            multiplier = v_select(mask, multiplier, zero);
+            force_x = v_fmadd(x, multiplier, force_x);
+            force_y = v_fmadd(y, multiplier, force_y);
+            force_z = v_fmadd(z, multiplier, force_z);
+            /** 4 * (1 / r12 - 1 / r6) */
+            energy_i = v_add(energy_i, v_select(mask, v_mul(v_mul(v_set(4), inv_r6), v_sub(inv_r6, one)), zero));
+        }
+        output_force[i].x = v_reduce_add(force_x);
+        output_force[i].y = v_reduce_add(force_y);
+        output_force[i].z = v_reduce_add(force_z);
+        energy += v_reduce_add(energy_i);
+    }
+    /** we consider each interaction twice, so we need to divide by 2 */
+    return energy / 2;
+}
+
+/**
+ * @brief calculate energy and force for coulomb, SIMD_WIDTH particles j are processed at once
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param output_force force array
+ * @param charge array Charge array
+ * @return energy
+ */
+template <int N>
+double calculate_energy_force_coulomb_simd(dim *position_arr, dim *nearest, dim *output_force, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    nearest_image<N>(position_arr, nearest, output_force);
+    pack_soa(nearest, charge);
+    const float *px = particles_soa.x;
+    const float *py = particles_soa.y;
+    const float *pz = particles_soa.z;
+    const float *pq = particles_soa.charge;
+    const vfloat half = v_set(half_box);
+    const vfloat box = v_set(box_size);
+    const vfloat zero = v_set(0);
+    const vfloat one = v_set(1);
+    double energy = 0;
+    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
+    for (int i = 0; i < particles_count; i++) {
+        vfloat xi = v_set(px[i]);
+        vfloat yi = v_set(py[i]);
+        vfloat zi = v_set(pz[i]);
+        vfloat qi = v_set(pq[i]);
+        vfloat force_x = zero;
+        vfloat force_y = zero;
+        vfloat force_z = zero;
+        vfloat energy_i = zero;
+        for (int j = 0; j < particles_count; j += SIMD_WIDTH) {
+            vfloat x = v_minimum_image(v_sub(v_load(px + j), xi), half, box);
+            vfloat y = v_minimum_image(v_sub(v_load(py + j), yi), half, box);
+            vfloat z = v_minimum_image(v_sub(v_load(pz + j), zi), half, box);
+            vfloat qj = v_load(pq + j);
+            vmask mask = v_valid(j, i, particles_count);
+            vfloat sq_dist = v_select(mask, v_fmadd(x, x, v_fmadd(y, y, v_mul(z, z))), one);
+            vfloat dist = v_sqrt(sq_dist);
+            vfloat inv_dist = v_div(one, dist);
+            vfloat inv_dist_cub = v_div(inv_dist, sq_dist);
+            vfloat qq = v_select(mask, v_mul(qi, qj), zero);
+            /** erf screening is used if at least one of the charges is negative */
+            vmask screened = v_lt(v_min(qi, qj), zero);
+            vfloat erf_arg = v_mul(dist, v_set(1.0f / SIGMA));
+            vfloat exp_minus_sq = v_exp(v_sub(zero, v_mul(erf_arg, erf_arg)));
+            vfloat multiplier = v_erf(erf_arg, exp_minus_sq);
+            vfloat screened_force = v_fmadd(v_mul(v_set(-DERIVATIVE_ERF), exp_minus_sq), v_mul(inv_dist, inv_dist), v_mul(multiplier, inv_dist_cub));
+            vfloat f = v_mul(qq, v_select(screened, screened_force, inv_dist_cub));
+            force_x = v_fmadd(x, f, force_x);
+            force_y = v_fmadd(y, f, force_y);
+            force_z = v_fmadd(z, f, force_z);
+            energy_i = v_fmadd(v_mul(qq, inv_dist), v_select(screened, multiplier, one), energy_i);
+        }
+        output_force[i].x = v_reduce_add(force_x);
+        output_force[i].y = v_reduce_add(force_y);
+        output_force[i].z = v_reduce_add(force_z);
+        energy += v_reduce_add(energy_i);
+    }
+    /** we consider each interaction twice, so we need to divide by 2 */
+    return energy / 2;
+}
+
+/**
+ * @brief calculate energy and force for LJ using cell list, only 27 neighbour cells are checked
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param output_force force array
+ * @param charge array Charge array
+ * @return energy
+ */
+template <int N>
+double calculate_energy_force_lj_cells(dim *position_arr, dim *nearest, dim *output_force, int *charge){
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    const double rc = preset<N>::cutoff();
+    nearest_image<N>(position_arr, nearest, output_force);
+    build_cells(nearest);
+    int cells_count = cells_per_axis * cells_per_axis * cells_per_axis;
+    double energy = 0;
+    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS) schedule(dynamic)
+    for (int c = 0; c < cells_count; c++) {
+        int cx = c / (cells_per_axis * cells_per_axis);
+        int cy = (c / cells_per_axis) % cells_per_axis;
+        int cz = c % cells_per_axis;
+        for (int i = cell_head[c]; i != -1; i = cell_next[i]) {
+            double force_x = 0;
+            double force_y = 0;
+            double force_z = 0;
+            for (int dx = -1; dx <= 1; dx++) {
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dz = -1; dz <= 1; dz++) {
+                        /** periodic boundary conditions for cells */
+                        int nx = (cx + dx + cells_per_axis) % cells_per_axis;
+                        int ny = (cy + dy + cells_per_axis) % cells_per_axis;
+                        int nz = (cz + dz + cells_per_axis) % cells_per_axis;
+                        int neighbour = (nx * cells_per_axis + ny) * cells_per_axis + nz;
+                        for (int j = cell_head[neighbour]; j != -1; j = cell_next[j]) {
+                            float x = nearest[j].x - nearest[i].x;
+                            float y = nearest[j].y - nearest[i].y;
+                            float z = nearest[j].z - nearest[i].z;
+                            /* second part of implementation of periodic boundary conditions */
+                            if (x > half_box)
+                                x -= box_size;
+                            else {
+                                if (x < -half_box)
+                                    x += box_size;
+                            }
+                            if (y > half_box)
+                                y -= box_size;
+                            else {
+                                if (y < -half_box)
+                                    y += box_size;
+                            }
+                            if (z > half_box)
+                                z -= box_size;
+                            else {
+                                if (z < -half_box)
+                                    z += box_size;
+                            }
+                            float sq_dist = x * x + y * y + z * z;
+                            if ((sq_dist < rc * rc) && (i != j)) {
+                                double r6 = sq_dist * sq_dist * sq_dist;
+                                double r12 = r6 * r6;
+                                double r8 = r6 * sq_dist;
+                                double r14 = r12 * sq_dist;
+                                double multiplier = (24 * (2 / r14 - 1 / r8));
+                                force_x += x * multiplier;
+                                force_y += y * multiplier;
+                                force_z += z * multiplier;
+                                energy += 4 * (1 / r12 - 1 / r6);
+                            }
+                        }
+                    }
+                }
+            }
+            output_force[i].x = force_x;
+            output_force[i].y = force_y;
+            output_force[i].z = force_z;
+        }
+    }
+    /** we consider each interaction twice, so we need to divide by 2 */
+    return energy / 2;
+}
+
+/**
+ * @brief allocate Verlet list
+ * @return void
+ */
+void init_verlet(){
+    /** twice the mean number of particles inside rc + SKIN sphere */
+    double volume = 4. / 3. * M_PI * (rc + SKIN) * (rc + SKIN) * (rc + SKIN);
+    max_neighbours = (int)(2 * volume * particles_count / ((double)box_size * box_size * box_size)) + 16;
+    if (max_neighbours > particles_count){
+        max_neighbours = particles_count;
+    }
+    neighbours = (int*)malloc(sizeof(int) * particles_count * max_neighbours);
+    neighbours_count = (int*)malloc(sizeof(int) * particles_count);
+    verlet_position = (dim*)malloc(sizeof(dim) * particles_count);
+    verlet_valid = false;
+    verlet_rebuilds = 0;
+}
+
+/**
+ * @brief free Verlet list
+ * @return void
+ */
+void free_verlet(){
+    free(neighbours);
+    free(neighbours_count);
+    free(verlet_position);
+    neighbours = NULL;
+    neighbours_count = NULL;
+    verlet_position = NULL;
+    verlet_valid = false;
+}
+
+/**
+ * @brief Verlet list stays valid while no particle moved more than SKIN / 2 since last build
+ * @param position_arr Position array
+ * @return True if Verlet list must be rebuilt
+ */
+bool verlet_needs_rebuild(dim *position_arr){
+    if (!verlet_valid){
+        return true;
+    }
+    double max_sq_shift = 0;
+    #pragma omp parallel for reduction(max:max_sq_shift) num_threads(NUM_THREADS)
+    for (int i = 0; i < particles_count; i++){
+        double x = position_arr[i].x - verlet_position[i].x;
+        double y = position_arr[i].y - verlet_position[i].y;
+        double z = position_arr[i].z - verlet_position[i].z;
+        double sq_shift = x * x + y * y + z * z;
+        if (sq_shift > max_sq_shift){
+            max_sq_shift = sq_shift;
+        }
+    }
+    return max_sq_shift > (SKIN / 2) * (SKIN / 2);
+}
+
+/**
+ * @brief build Verlet list with rc + SKIN radius, cell list is used if it was initialized
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @return void
+ */
+void build_verlet(dim *position_arr, dim *nearest){
+    const float sq_list_dist = (rc + SKIN) * (rc + SKIN);
+    if (cell_head){
+        build_cells(nearest);
+    }
+    int overflow;
+    do {
+        overflow = 0;
+        #pragma omp parallel for reduction(|:overflow) num_threads(NUM_THREADS) schedule(dynamic)
+        for (int i = 0; i < particles_count; i++) {
+            int *list = neighbours + (size_t)i * max_neighbours;
+            int count = 0;
+            int cx = 0, cy = 0, cz = 0;
+            if (cell_head){
+                cx = (int)((nearest[i].x + half_box) / cell_size);
+                cy = (int)((nearest[i].y + half_box) / cell_size);
+                cz = (int)((nearest[i].z + half_box) / cell_size);
+                cx = cx < 0 ? 0 : (cx >= cells_per_axis ? cells_per_axis - 1 : cx);
+                cy = cy < 0 ? 0 : (cy >= cells_per_axis ? cells_per_axis - 1 : cy);
+                cz = cz < 0 ? 0 : (cz >= cells_per_axis ? cells_per_axis - 1 : cz);
+            }
+            /** without cell list all particles are checked as one neighbour "cell" */
+            int neighbour_cells = cell_head ? 27 : 1;
+            for (int n = 0; n < neighbour_cells; n++) {
+                int j_start = 0;
+                if (cell_head){
+                    int nx = (cx + n / 9 - 1 + cells_per_axis) % cells_per_axis;
+                    int ny = (cy + (n / 3) % 3 - 1 + cells_per_axis) % cells_per_axis;
+                    int nz = (cz + n % 3 - 1 + cells_per_axis) % cells_per_axis;
+                    j_start = cell_head[(nx * cells_per_axis + ny) * cells_per_axis + nz];
+                }
+                for (int j = j_start; j != -1 && j < particles_count; j = cell_head ? cell_next[j] : j + 1) {
+                    if (i == j){
+                        continue;
+                    }
+                    float x = nearest[j].x - nearest[i].x;
+                    float y = nearest[j].y - nearest[i].y;
+                    float z = nearest[j].z - nearest[i].z;
+                    /* second part of implementation of periodic boundary conditions */
+                    if (x > half_box)
+                        x -= box_size;
+                    else {
+                        if (x < -half_box)
+                            x += box_size;
+                    }
+                    if (y > half_box)
+                        y -= box_size;
+                    else {
+                        if (y < -half_box)
+                            y += box_size;
+                    }
+                    if (z > half_box)
+                        z -= box_size;
+                    else {
+                        if (z < -half_box)
+                            z += box_size;
+                    }
+                    if (x * x + y * y + z * z < sq_list_dist){
+                        if (count == max_neighbours){
+                            overflow = 1;
+                            break;
+                        }
+                        list[count++] = j;
+                    }
+                }
+            }
+            neighbours_count[i] = count;
+        }
+        if (overflow){
+            /** list is too short for current density, grow it and build again */
+            max_neighbours *= 2;
+            neighbours = (int*)realloc(neighbours, sizeof(int) * particles_count * max_neighbours);
+        }
+    } while (overflow);
+    memcpy(verlet_position, position_arr, sizeof(dim) * particles_count);
+    verlet_valid = true;
+    verlet_rebuilds++;
+}
+
+/**
+ * @brief calculate energy and force for LJ using Verlet list
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param output_force force array
+ * @param charge array Charge array
+ * @return energy
+ */
+template <int N>
+double calculate_energy_force_lj_verlet(dim *position_arr, dim *nearest, dim *output_force, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    const double rc = preset<N>::cutoff();
+    nearest_image<N>(position_arr, nearest, output_force);
+    if (verlet_needs_rebuild(position_arr)){
+        build_verlet(position_arr, nearest);
+    }
+    double energy = 0;
+    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
+    for (int i = 0; i < particles_count; i++) {
+        const int *list = neighbours + (size_t)i * max_neighbours;
+        double force_x = 0;
+        double force_y = 0;
+        double force_z = 0;
+        for (int n = 0; n < neighbours_count[i]; n++) {
+            int j = list[n];
+            float x = nearest[j].x - nearest[i].x;
+            float y = nearest[j].y - nearest[i].y;
+            float z = nearest[j].z - nearest[i].z;
+            /* second part of implementation of periodic boundary conditions */
+            if (x > half_box)
+                x -= box_size;
+            else {
+                if (x < -half_box)
+                    x += box_size;
+            }
+            if (y > half_box)
+                y -= box_size;
+            else {
+                if (y < -half_box)
+                    y += box_size;
+            }
+            if (z > half_box)
+                z -= box_size;
+            else {
+                if (z < -half_box)
+                    z += box_size;
+            }
+            float sq_dist = x * x + y * y + z * z;
+            if (sq_dist < rc * rc) {
+                double r6 = sq_dist * sq_dist * sq_dist;
+                double r12 = r6 * r6;
+                double r8 = r6 * sq_dist;
+                double r14 = r12 * sq_dist;
+                double multiplier = (24 * (2 / r14 - 1 / r8));
+                force_x += x * multiplier;
+                force_y += y * multiplier;
+                force_z += z * multiplier;
+                energy += 4 * (1 / r12 - 1 / r6);
+            }
+        }
+        output_force[i].x = force_x;
+        output_force[i].y = force_y;
+        output_force[i].z = force_z;
+    }
+    /** we consider each interaction twice, so we need to divide by 2 */
+    return energy / 2;
+}
+
 /**
  * @brief calculate energy and force for coulomb
  * @param position_arr Position array
@@ -225,11 +1287,15 @@ double calculate_energy_force_lj(dim *position_arr, dim *nearest, dim *output_fo
  * @param charge array Charge array
  * @return energy
  */
+template <int N>
 double calculate_energy_force_coulomb(dim *position_arr, dim *nearest, dim *output_force, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    nearest_image<N>(position_arr, nearest, output_force);
     for (int i = 0; i < particles_count; i++){
         output_force[i] = { 0, 0, 0};
     }
-    nearest_image(position_arr, nearest);
     double energy = 0;
     #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
     for (int i = 0; i < particles_count; i++) {
@@ -290,7 +1356,176 @@ double calculate_energy_force_coulomb(dim *position_arr, dim *nearest, dim *outp
 }
 
 /**
- * @brief perform MD iterations
+ * @brief calculate energy and force for coulomb, each pair is considered once
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param output_force force array
+ * @param charge array Charge array
+ * @return energy
+ */
+template <int N>
+double calculate_energy_force_coulomb_half(dim *position_arr, dim *nearest, dim *output_force, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    nearest_image<N>(position_arr, nearest, output_force);
+    double energy = 0;
+    #pragma omp parallel reduction(+:energy) num_threads(NUM_THREADS)
+    {
+        dim *force = thread_force + omp_get_thread_num() * particles_count;
+        for (int i = 0; i < particles_count; i++){
+            force[i] = { 0, 0, 0};
+        }
+        /** rows are of different length, so dynamic schedule */
+        #pragma omp for schedule(dynamic, 16)
+        for (int i = 0; i < particles_count; i++) {
+            double force_x = 0;
+            double force_y = 0;
+            double force_z = 0;
+            for (int j = i + 1; j < particles_count; j++) {
+                float x = nearest[j].x - nearest[i].x;
+                float y = nearest[j].y - nearest[i].y;
+                float z = nearest[j].z - nearest[i].z;
+                /* second part of implementation of periodic boundary conditions */
+                if (x > half_box)
+                    x -= box_size;
+                else {
+                    if (x < -half_box)
+                        x += box_size;
+                }
+                if (y > half_box)
+                    y -= box_size;
+                else {
+                    if (y < -half_box)
+                        y += box_size;
+                }
+                if (z > half_box)
+                    z -= box_size;
+                else {
+                    if (z < -half_box)
+                        z += box_size;
+                }
+                double sq_dist = x * x + y * y + z * z;
+                double dist = sqrt(sq_dist);
+                double dist_cub = dist * sq_dist;
+                double f;
+                if ((charge[i] == -1) || (charge[j] == -1)){
+                    double erf_arg = dist / SIGMA;
+                    double multiplier = erf(erf_arg);
+                    energy += charge[i] * charge[j] * multiplier / dist;
+                    f = charge[i] * charge[j] * (-DERIVATIVE_ERF * exp(-(erf_arg * erf_arg)) / sq_dist + multiplier / dist_cub);
+                }
+                else{
+                    f = charge[i] * charge[j] / dist_cub;
+                    energy += charge[i] * charge[j] / dist;
+                }
+                force_x += x * f;
+                force_y += y * f;
+                force_z += z * f;
+                /** Newton's third law */
+                force[j].x -= x * f;
+                force[j].y -= y * f;
+                force[j].z -= z * f;
+            }
+            force[i].x += force_x;
+            force[i].y += force_y;
+            force[i].z += force_z;
+        }
+        reduce_thread_force(output_force);
+    }
+    return energy;
+}
+
+/**
+ * @brief calculate energy and force for coulomb using particle-mesh Ewald,
+ * real space part is cut at rc and uses cell list if box is large enough
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param output_force force array
+ * @param charge array Charge array
+ * @return energy
+ */
+template <int N>
+double calculate_energy_force_coulomb_pme(dim *position_arr, dim *nearest, dim *output_force, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    const double rc = preset<N>::cutoff();
+    nearest_image<N>(position_arr, nearest, output_force);
+    if (cell_head){
+        build_cells(nearest);
+    }
+    double energy = 0;
+    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS) schedule(dynamic)
+    for (int i = 0; i < particles_count; i++) {
+        double force_x = 0;
+        double force_y = 0;
+        double force_z = 0;
+        int cx = 0, cy = 0, cz = 0;
+        if (cell_head){
+            cx = (int)((nearest[i].x + half_box) / cell_size);
+            cy = (int)((nearest[i].y + half_box) / cell_size);
+            cz = (int)((nearest[i].z + half_box) / cell_size);
+            cx = cx < 0 ? 0 : (cx >= cells_per_axis ? cells_per_axis - 1 : cx);
+            cy = cy < 0 ? 0 : (cy >= cells_per_axis ? cells_per_axis - 1 : cy);
+            cz = cz < 0 ? 0 : (cz >= cells_per_axis ? cells_per_axis - 1 : cz);
+        }
+        /** without cell list all particles are checked as one neighbour "cell" */
+        int neighbour_cells = cell_head ? 27 : 1;
+        for (int n = 0; n < neighbour_cells; n++) {
+            int j_start = 0;
+            if (cell_head){
+                int nx = (cx + n / 9 - 1 + cells_per_axis) % cells_per_axis;
+                int ny = (cy + (n / 3) % 3 - 1 + cells_per_axis) % cells_per_axis;
+                int nz = (cz + n % 3 - 1 + cells_per_axis) % cells_per_axis;
+                j_start = cell_head[(nx * cells_per_axis + ny) * cells_per_axis + nz];
+            }
+            for (int j = j_start; j != -1 && j < particles_count; j = cell_head ? cell_next[j] : j + 1) {
+                double x = nearest[j].x - nearest[i].x;
+                double y = nearest[j].y - nearest[i].y;
+                double z = nearest[j].z - nearest[i].z;
+                /* second part of implementation of periodic boundary conditions */
+                if (x > half_box)
+                    x -= box_size;
+                else {
+                    if (x < -half_box)
+                        x += box_size;
+                }
+                if (y > half_box)
+                    y -= box_size;
+                else {
+                    if (y < -half_box)
+                        y += box_size;
+                }
+                if (z > half_box)
+                    z -= box_size;
+                else {
+                    if (z < -half_box)
+                        z += box_size;
+                }
+                double sq_dist = x * x + y * y + z * z;
+                if ((sq_dist < rc * rc) && (i != j)) {
+                    double f;
+                    bool screened = (charge[i] == -1) || (charge[j] == -1);
+                    energy += charge[i] * charge[j] * pme_real_space(sqrt(sq_dist), screened, pme.beta, SIGMA, DERIVATIVE_ERF, &f);
+                    force_x += x * charge[i] * charge[j] * f;
+                    force_y += y * charge[i] * charge[j] * f;
+                    force_z += z * charge[i] * charge[j] * f;
+                }
+            }
+        }
+        output_force[i].x = force_x;
+        output_force[i].y = force_y;
+        output_force[i].z = force_z;
+    }
+    /** we consider each interaction twice, so we need to divide by 2 */
+    energy /= 2;
+    return energy + pme_reciprocal(&pme, nearest, charge, particles_count, output_force);
+}
+
+/**
+ * @brief perform MD iterations with velocity Verlet integrator,
+ * with RESPA coulomb force is calculated every respa_steps steps and LJ force every step
  * @param position_arr Position array
  * @param output_force force array
  * @param nearest nearest array
@@ -298,31 +1533,57 @@ double calculate_energy_force_coulomb(dim *position_arr, dim *nearest, dim *outp
  * @return void
  */
 void md(dim *position_arr, dim *velocity, dim *output_force, dim *nearest, int *charge) {
+    double slow_energy = 0;
     for (int n = 0; n < total_it; n ++){
+        /** first call only calculates forces at initial positions, next ones move particles before force calculation */
+        step_velocity = n ? velocity : NULL;
         double total_energy = calculate_energy_force(position_arr, nearest, output_force, charge);
-        motion(position_arr, velocity, output_force);
+        /** slow force is calculated at the end of outer step */
+        if (respa_steps && (n % respa_steps == 0)){
+            step_velocity = NULL;
+            slow_energy = calculate_slow_force(position_arr, nearest, slow_force, charge);
+            /** closing half-kick of previous outer step and opening half-kick of next one */
+            slow_kick = n ? respa_steps * dt : respa_steps * dt / 2;
+        }
+        /** if run does not end at outer step, slow term of the last iteration is needed for energy only */
+        else if (respa_steps && (n == total_it - 1)){
+            step_velocity = NULL;
+            slow_energy = calculate_slow_force(position_arr, nearest, slow_scratch, charge);
+        }
+        total_energy += slow_energy;
         if (n == (total_it - 1)) {
             printf("energy is %f \n", total_energy/particles_count);
         }
     }
+    double kinetic_energy = synchronize_velocity(velocity, output_force);
+    printf("kinetic energy is %f \n", kinetic_energy/particles_count);
 }
 
 /**
- * @brief solve motion equation's using Euler method
- * @param position_arr Position array
+ * @brief closing half-kick of velocity Verlet, velocities are brought to the same step as positions
  * @param velocity Velocity array
  * @param output_force force array
- * @return void
+ * @return kinetic energy
  */
-void motion(dim *position_arr, dim *velocity, dim *output_force){
+double synchronize_velocity(dim *velocity, dim *output_force){
+    double kick = velocity_is_half_step ? dt / 2 : 0;
+    /** closing half-kick of the last outer step uses its own slow force */
+    double slow = (velocity_is_half_step && slow_force) ? respa_steps * dt / 2 : 0;
+    double kinetic_energy = 0;
+    #pragma omp parallel for reduction(+:kinetic_energy) num_threads(NUM_THREADS)
     for (int i = 0; i < particles_count; i++) {
-        /* v += f * dt */
-        velocity[i] = {velocity[i].x + output_force[i].x * dt,
-            velocity[i].y + output_force[i].y * dt,
-            velocity[i].z + output_force[i].z * dt};
-        /* r += v * dt */
-        position_arr[i] = {position_arr[i].x + velocity[i].x * dt,
-            position_arr[i].y + velocity[i].y * dt,
-            position_arr[i].z + velocity[i].z * dt};
+        /* v += f * dt / 2 */
+        velocity[i] = {velocity[i].x + output_force[i].x * kick,
+            velocity[i].y + output_force[i].y * kick,
+            velocity[i].z + output_force[i].z * kick};
+        if (slow){
+            velocity[i] = {velocity[i].x + slow_force[i].x * slow,
+                velocity[i].y + slow_force[i].y * slow,
+                velocity[i].z + slow_force[i].z * slow};
+        }
+        kinetic_energy += (velocity[i].x * velocity[i].x + velocity[i].y * velocity[i].y + velocity[i].z * velocity[i].z) / 2;
     }
+    velocity_is_half_step = false;
+    slow_kick = 0;
+    return kinetic_energy;
 }
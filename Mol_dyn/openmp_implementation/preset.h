@@ -0,0 +1,25 @@
+/**
+ * @file preset.h
+ * @brief compile time constants of preset <N>parameters.h for kernels specialised for N particles
+ * @details there is no include guard, it is included once after each preset header. The values of the preset
+ * are stored as preset<particles_count> and all its macros are undefined, so the next preset can be included.
+ */
+
+template <> struct preset<particles_count> {
+    static constexpr double box() { return box_size; }
+    static constexpr double half() { return half_box; }
+    static constexpr double cutoff() { return rc; }
+    static constexpr double step() { return dt; }
+};
+
+#undef rc
+#undef box_size
+#undef half_box
+#undef particles_count
+#undef total_it
+#undef dt
+#undef Temperature
+#undef initial_dist_by_one_axis
+#undef initial_dist_to_edge
+#undef SIGMA
+#undef DERIVATIVE_ERF
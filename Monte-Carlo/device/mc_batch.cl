@@ -0,0 +1,110 @@
+/**
+ * @file mc_batch.cl
+ * @brief OpenCL kernels which calculate energy of several independent MC chains in one launch
+ * @details second NDRange dimension is chain, configuration of chain c is
+ * particles[c * particles_count .. (c + 1) * particles_count - 1], so small systems fill the device
+ * and launch overhead is shared by all chains.
+ */
+
+#include "parameters.h"
+/**
+ * @brief OpenCL kernel for LJ
+ * @param particles Position arrays of all chains
+ * @param out_energy Energy which describe how one particles iteract which all others of its chain
+ * @return void
+ */
+__kernel void mc_lj_batch(__global const float3 *restrict particles,
+                          __global float *restrict out_energy) {
+    int index = get_global_id(0);
+    int chain = get_global_id(1);
+    __global const float3 *restrict chain_particles = particles + chain * particles_count;
+    float3 position = chain_particles[index];
+    float energy = 0;
+    #pragma unroll 8
+    for (int i = 0; i < particles_count; i++) {
+        float x = chain_particles[i].x - position.x;
+        float y = chain_particles[i].y - position.y;
+        float z = chain_particles[i].z - position.z;
+        /* second part of implementation periodic boundary conditions */
+        if (x > half_box)
+            x -= box_size;
+        else {
+            if (x < -half_box)
+                x += box_size;
+        }
+        if (y > half_box)
+            y -= box_size;
+        else {
+            if (y < -half_box)
+                y += box_size;
+        }
+        if (z > half_box)
+            z -= box_size;
+        else {
+            if (z < -half_box)
+                z += box_size;
+        }
+        float sq_dist = x * x + y * y + z * z;
+        if ((sq_dist < rc * rc) && (i != index)) {
+            float r6 = sq_dist * sq_dist * sq_dist;
+            float r12 = r6 * r6;
+            energy += 4 * (1 / r12 - 1 / r6);
+        }
+    }
+    out_energy[chain * particles_count + index] = energy;
+}
+
+/**
+ * @brief OpenCL kernel for coulomb potential
+ * @param particles Position arrays of all chains
+ * @param charge Charge array, it is the same for all chains
+ * @param out_energy Energy which describe how one particles iteract which all others of its chain
+ * @return void
+ */
+__kernel void mc_coulomb_batch(__global const float3 *restrict particles,
+                               __global const int *restrict charge,
+                               __global float *restrict out_energy) {
+    int index = get_global_id(0);
+    int chain = get_global_id(1);
+    __global const float3 *restrict chain_particles = particles + chain * particles_count;
+    float3 position = chain_particles[index];
+    float energy = 0;
+    #pragma unroll 4
+    for (int i = 0; i < particles_count; i++) {
+        float x = chain_particles[i].x - position.x;
+        float y = chain_particles[i].y - position.y;
+        float z = chain_particles[i].z - position.z;
+        if (x > half_box)
+            x -= box_size;
+        else {
+            if (x < -half_box)
+                x += box_size;
+        }
+        if (y > half_box)
+            y -= box_size;
+        else {
+            if (y < -half_box)
+                y += box_size;
+        }
+        if (z > half_box)
+            z -= box_size;
+        else {
+            if (z < -half_box)
+                z += box_size;
+        }
+        if (i != index) {
+            float3 r = (float3)(x, y, z);
+            float dist = fast_length(r);
+            float inv_dist = native_divide(1, dist);
+            if ((charge[index] == -1) || (charge[i] == -1)){
+                float erf_arg = native_divide(dist, SIGMA);
+                float multiplier = erf(erf_arg);
+                energy += charge[i] * charge[index] * multiplier * inv_dist;
+            }
+            else{
+                energy += charge[i] * charge[index] * inv_dist;
+            }
+        }
+    }
+    out_energy[chain * particles_count + index] = energy;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file mc_coulomb_tiled.cl
+ * @brief OpenCL kernel which calculate energy with many work-groups
+ */
+
+#include "parameters.h"
+/**
+ * @brief OpenCL kernel for coulomb potential
+ * @details particles are processed in tiles of WORK_GROUP_SIZE which are loaded to local memory,
+ * WORK_GROUP_SIZE is set with -D build option and buffers are padded to multiple of it
+ * @param particles Position array, padded
+ * @param charge Charge array, padded
+ * @param out_energy Energy which describe how one particles iteract which all others
+ * @return void
+ */
+__attribute__((reqd_work_group_size(WORK_GROUP_SIZE, 1, 1)))
+__kernel void mc(__global const float3 *restrict particles,
+                 __global const int *restrict charge,
+                 __global float *restrict out_energy) {
+
+    int index = get_global_id(0);
+    int local_index = get_local_id(0);
+    __local float3 tile[WORK_GROUP_SIZE];
+    __local int charge_tile[WORK_GROUP_SIZE];
+    float3 position = particles[index];
+    int own_charge = charge[index];
+    float energy = 0;
+    for (int start = 0; start < particles_count; start += WORK_GROUP_SIZE) {
+        tile[local_index] = particles[start + local_index];
+        charge_tile[local_index] = charge[start + local_index];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int tile_count = min(WORK_GROUP_SIZE, particles_count - start);
+        #pragma unroll 4
+        for (int k = 0; k < tile_count; k++) {
+            float x = tile[k].x - position.x;
+            float y = tile[k].y - position.y;
+            float z = tile[k].z - position.z;
+            /* second part of implementation periodic boundary conditions */
+            if (x > half_box)
+                x -= box_size;
+            else {
+                if (x < -half_box)
+                    x += box_size;
+            }
+            if (y > half_box)
+                y -= box_size;
+            else {
+                if (y < -half_box)
+                    y += box_size;
+            }
+            if (z > half_box)
+                z -= box_size;
+            else {
+                if (z < -half_box)
+                    z += box_size;
+            }
+            if (start + k != index) {
+                float3 r = (float3)(x, y, z);
+                float dist = fast_length(r);
+                float inv_dist = native_divide(1, dist);
+                if ((own_charge == -1) || (charge_tile[k] == -1)){
+                    float erf_arg = native_divide(dist, SIGMA);
+                    float multiplier = erf(erf_arg);
+                    energy += charge_tile[k] * own_charge * multiplier * inv_dist;
+                }
+                else{
+                    energy += charge_tile[k] * own_charge * inv_dist;
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    /** work-items of padding only help to load tiles */
+    if (index < particles_count) {
+        out_energy[index] = energy;
+    }
+}
@@ -0,0 +1,65 @@
+/**
+ * @file mc_lj_tiled.cl
+ * @brief OpenCL kernel which calculate energy with many work-groups
+ */
+
+#include "parameters.h"
+/**
+ * @brief OpenCL kernel for LJ
+ * @details particles are processed in tiles of WORK_GROUP_SIZE which are loaded to local memory,
+ * WORK_GROUP_SIZE is set with -D build option and buffers are padded to multiple of it
+ * @param particles Position array, padded
+ * @param out_energy Energy which describe how one particles iteract which all others
+ * @return void
+ */
+__attribute__((reqd_work_group_size(WORK_GROUP_SIZE, 1, 1)))
+__kernel void mc(__global const float3 *restrict particles,
+                 __global float *restrict out_energy) {
+
+    int index = get_global_id(0);
+    int local_index = get_local_id(0);
+    __local float3 tile[WORK_GROUP_SIZE];
+    float3 position = particles[index];
+    float energy = 0;
+    for (int start = 0; start < particles_count; start += WORK_GROUP_SIZE) {
+        tile[local_index] = particles[start + local_index];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int tile_count = min(WORK_GROUP_SIZE, particles_count - start);
+        #pragma unroll 4
+        for (int k = 0; k < tile_count; k++) {
+            float x = tile[k].x - position.x;
+            float y = tile[k].y - position.y;
+            float z = tile[k].z - position.z;
+            /* second part of implementation periodic boundary conditions */
+            if (x > half_box)
+                x -= box_size;
+            else {
+                if (x < -half_box)
+                    x += box_size;
+            }
+            if (y > half_box)
+                y -= box_size;
+            else {
+                if (y < -half_box)
+                    y += box_size;
+            }
+            if (z > half_box)
+                z -= box_size;
+            else {
+                if (z < -half_box)
+                    z += box_size;
+            }
+            float sq_dist = x * x + y * y + z * z;
+            if ((sq_dist < rc * rc) && (start + k != index)) {
+                float r6 = sq_dist * sq_dist * sq_dist;
+                float r12 = r6 * r6;
+                energy += 4 * (1 / r12 - 1 / r6);
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    /** work-items of padding only help to load tiles */
+    if (index < particles_count) {
+        out_energy[index] = energy;
+    }
+}
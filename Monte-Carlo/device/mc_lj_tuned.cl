@@ -0,0 +1,164 @@
+/**
+ * @file mc_lj_tuned.cl
+ * @brief OpenCL kernels which calculate energy with parameters chosen by autotuner
+ * @details WORK_GROUP_SIZE and UNROLL are set with -D build options, inner loop over tile has constant
+ * trip count UNROLL, so it is unrolled by compiler. mc processes one particle j per iteration,
+ * mc_vec4 and mc_vec8 process 4 and 8 particles j as vectors. WORK_GROUP_SIZE must be multiple of
+ * vector width * UNROLL, buffers are padded to multiple of WORK_GROUP_SIZE.
+ */
+
+#include "parameters.h"
+/**
+ * @brief OpenCL kernel for LJ, scalar variant
+ * @param particles Position array, padded
+ * @param out_energy Energy which describe how one particles iteract which all others
+ * @return void
+ */
+__attribute__((reqd_work_group_size(WORK_GROUP_SIZE, 1, 1)))
+__kernel void mc(__global const float3 *restrict particles,
+                 __global float *restrict out_energy) {
+
+    int index = get_global_id(0);
+    int local_index = get_local_id(0);
+    __local float3 tile[WORK_GROUP_SIZE];
+    float3 position = particles[index];
+    float energy = 0;
+    for (int start = 0; start < particles_count; start += WORK_GROUP_SIZE) {
+        tile[local_index] = particles[start + local_index];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int k = 0; k < WORK_GROUP_SIZE; k += UNROLL) {
+            for (int u = 0; u < UNROLL; u++) {
+                int j = start + k + u;
+                float x = tile[k + u].x - position.x;
+                float y = tile[k + u].y - position.y;
+                float z = tile[k + u].z - position.z;
+                /* second part of implementation periodic boundary conditions */
+                x = (x > half_box) ? x - box_size : ((x < -half_box) ? x + box_size : x);
+                y = (y > half_box) ? y - box_size : ((y < -half_box) ? y + box_size : y);
+                z = (z > half_box) ? z - box_size : ((z < -half_box) ? z + box_size : z);
+                float sq_dist = x * x + y * y + z * z;
+                /** padding of the last tile is skipped */
+                if ((sq_dist < (rc * rc)) && (j != index) && (j < particles_count)) {
+                    float r6 = sq_dist * sq_dist * sq_dist;
+                    float r12 = r6 * r6;
+                    energy += 4 * (1 / r12 - 1 / r6);
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (index < particles_count) {
+        out_energy[index] = energy;
+    }
+}
+
+/**
+ * @brief OpenCL kernel for LJ, 4 particles j per iteration
+ * @details tile is stored as separate x, y, z arrays, so 4 coordinates are loaded with vload4
+ * @param particles Position array, padded
+ * @param out_energy Energy which describe how one particles iteract which all others
+ * @return void
+ */
+__attribute__((reqd_work_group_size(WORK_GROUP_SIZE, 1, 1)))
+__kernel void mc_vec4(__global const float3 *restrict particles,
+                      __global float *restrict out_energy) {
+
+    int index = get_global_id(0);
+    int local_index = get_local_id(0);
+    __local float tile_x[WORK_GROUP_SIZE];
+    __local float tile_y[WORK_GROUP_SIZE];
+    __local float tile_z[WORK_GROUP_SIZE];
+    float3 position = particles[index];
+    float4 energy = (float4)(0);
+    for (int start = 0; start < particles_count; start += WORK_GROUP_SIZE) {
+        float3 own = particles[start + local_index];
+        tile_x[local_index] = own.x;
+        tile_y[local_index] = own.y;
+        tile_z[local_index] = own.z;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int k = 0; k < WORK_GROUP_SIZE; k += 4 * UNROLL) {
+            for (int u = 0; u < UNROLL; u++) {
+                int first = k + 4 * u;
+                int4 j = (int4)(start + first) + (int4)(0, 1, 2, 3);
+                /** padding and particle itself give zero difference and are masked */
+                int4 in_range = (j < particles_count) && (j != index);
+                float4 x = select((float4)(0), vload4(0, tile_x + first) - position.x, in_range);
+                float4 y = select((float4)(0), vload4(0, tile_y + first) - position.y, in_range);
+                float4 z = select((float4)(0), vload4(0, tile_z + first) - position.z, in_range);
+                /* second part of implementation periodic boundary conditions */
+                x = select(x, x - box_size, x > half_box);
+                x = select(x, x + box_size, x < -half_box);
+                y = select(y, y - box_size, y > half_box);
+                y = select(y, y + box_size, y < -half_box);
+                z = select(z, z - box_size, z > half_box);
+                z = select(z, z + box_size, z < -half_box);
+                float4 sq_dist = x * x + y * y + z * z;
+                int4 valid = in_range && (sq_dist < (rc * rc));
+                sq_dist = select((float4)(1), sq_dist, valid);
+                float4 r6 = sq_dist * sq_dist * sq_dist;
+                float4 r12 = r6 * r6;
+                energy += select((float4)(0), 4 * (1 / r12 - 1 / r6), valid);
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (index < particles_count) {
+        out_energy[index] = energy.s0 + energy.s1 + energy.s2 + energy.s3;
+    }
+}
+
+/**
+ * @brief OpenCL kernel for LJ, 8 particles j per iteration
+ * @details tile is stored as separate x, y, z arrays, so 8 coordinates are loaded with vload8
+ * @param particles Position array, padded
+ * @param out_energy Energy which describe how one particles iteract which all others
+ * @return void
+ */
+__attribute__((reqd_work_group_size(WORK_GROUP_SIZE, 1, 1)))
+__kernel void mc_vec8(__global const float3 *restrict particles,
+                      __global float *restrict out_energy) {
+
+    int index = get_global_id(0);
+    int local_index = get_local_id(0);
+    __local float tile_x[WORK_GROUP_SIZE];
+    __local float tile_y[WORK_GROUP_SIZE];
+    __local float tile_z[WORK_GROUP_SIZE];
+    float3 position = particles[index];
+    float8 energy = (float8)(0);
+    for (int start = 0; start < particles_count; start += WORK_GROUP_SIZE) {
+        float3 own = particles[start + local_index];
+        tile_x[local_index] = own.x;
+        tile_y[local_index] = own.y;
+        tile_z[local_index] = own.z;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int k = 0; k < WORK_GROUP_SIZE; k += 8 * UNROLL) {
+            for (int u = 0; u < UNROLL; u++) {
+                int first = k + 8 * u;
+                int8 j = (int8)(start + first) + (int8)(0, 1, 2, 3, 4, 5, 6, 7);
+                /** padding and particle itself give zero difference and are masked */
+                int8 in_range = (j < particles_count) && (j != index);
+                float8 x = select((float8)(0), vload8(0, tile_x + first) - position.x, in_range);
+                float8 y = select((float8)(0), vload8(0, tile_y + first) - position.y, in_range);
+                float8 z = select((float8)(0), vload8(0, tile_z + first) - position.z, in_range);
+                /* second part of implementation periodic boundary conditions */
+                x = select(x, x - box_size, x > half_box);
+                x = select(x, x + box_size, x < -half_box);
+                y = select(y, y - box_size, y > half_box);
+                y = select(y, y + box_size, y < -half_box);
+                z = select(z, z - box_size, z > half_box);
+                z = select(z, z + box_size, z < -half_box);
+                float8 sq_dist = x * x + y * y + z * z;
+                int8 valid = in_range && (sq_dist < (rc * rc));
+                sq_dist = select((float8)(1), sq_dist, valid);
+                float8 r6 = sq_dist * sq_dist * sq_dist;
+                float8 r12 = r6 * r6;
+                energy += select((float8)(0), 4 * (1 / r12 - 1 / r6), valid);
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (index < particles_count) {
+        float4 e = energy.lo + energy.hi;
+        out_energy[index] = e.s0 + e.s1 + e.s2 + e.s3;
+    }
+}
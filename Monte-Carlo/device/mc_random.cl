@@ -0,0 +1,51 @@
+/**
+ * @file mc_random.cl
+ * @brief OpenCL kernel which generates Philox4x32-10 random numbers for MC trial moves
+ * @details generator is the same as in common/inc/philox.h, counter is (index, stream, step) and key is seed,
+ * so numbers are bit-identical to ones generated on host.
+ */
+
+/**
+ * @brief Philox4x32-10 block
+ * @param counter counter
+ * @param key key
+ * @return random block
+ */
+uint4 philox4x32(uint4 counter, uint2 key) {
+    for (int round = 0; round < 10; round++) {
+        uint hi0 = mul_hi(0xD2511F53u, counter.x);
+        uint lo0 = 0xD2511F53u * counter.x;
+        uint hi1 = mul_hi(0xCD9E8D57u, counter.z);
+        uint lo1 = 0xCD9E8D57u * counter.z;
+        counter = (uint4)(hi1 ^ counter.y ^ key.x, lo1, hi0 ^ counter.w ^ key.y, lo0);
+        key += (uint2)(0x9E3779B9u, 0xBB67AE85u);
+    }
+    return counter;
+}
+
+/**
+ * @brief OpenCL kernel for uniform numbers, one block of 4 numbers per index
+ * @param out Numbers in [0, 1), out[index] are 4 words of counter (index, stream, step)
+ * @param seed_lo Low word of seed
+ * @param seed_hi High word of seed
+ * @param step_lo Low word of MC step
+ * @param step_hi High word of MC step
+ * @param stream Stream of step
+ * @param count Number of indices
+ * @return void
+ */
+__kernel void random_uniform(__global float4 *restrict out,
+                             const uint seed_lo,
+                             const uint seed_hi,
+                             const uint step_lo,
+                             const uint step_hi,
+                             const uint stream,
+                             const int count) {
+
+    int index = get_global_id(0);
+    if (index >= count)
+        return;
+    uint4 block = philox4x32((uint4)(index, stream, step_lo, step_hi), (uint2)(seed_lo, seed_hi));
+    /** 24 high bits are converted exactly, as in philox_uniform */
+    out[index] = convert_float4(block >> 8) * (1.0f / 16777216.0f);
+}
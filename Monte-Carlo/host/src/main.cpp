@@ -7,6 +7,13 @@
  * Includes
  */
 #include "headers.h"
+#include "program_cache.h"
+#include "reduce.h"
+#include "trace.h"
+#include "autotune.h"
+#include "philox.h"
+#include "tempering.h"
+#include "convergence.h"
  /** add MС algorithm implementation */
 #include "mc.cpp"
 
@@ -49,8 +56,11 @@ cl_float3 position_arr[particles_count] = {};
 cl_float3 nearest[particles_count] = {};
 cl_float energy_arr[particles_count] = {};
 cl_int charge[particles_count] = {};
+/** trial configuration and random numbers of trial moves, they are preallocated instead of being on stack */
+cl_float3 trial_arr[particles_count] = {};
+cl_float move_arr[4 * particles_count] = {};
 
-extern float max_deviation;
+extern double max_deviation;
 double kernel_total_time = 0.;
 int kernel_calls = 0;
 cl_float final_energy = 0.;
@@ -58,41 +68,223 @@ float good_iters_percent = 0;
 
 bool (*init_opencl)() = init_opencl_lj;
 void (*run)() = run_lj;
+const char *lj_kernel_name = "mc_lj";
+const char *coulomb_kernel_name = "mc_coulomb";
+
+/*
+ * Tiled kernels run with many work-groups of work_group_size, buffers are padded to padded_count,
+ * original kernels run with one work-group of particles_count
+ */
+bool tiled = false;
+int work_group_size = particles_count;
+int padded_count = particles_count;
+char build_options[64] = "";
+
+/*
+ * Tuned LJ kernel is used if tuning result for device and particles_count is in tuning cache,
+ * autotune forces new tuning
+ */
+bool autotune = false;
+char lj_function_name[64] = "mc";
+
+/*
+ * One particle is moved per trial and only its interactions are recalculated on host
+ */
+bool single_particle = false;
+
+/*
+ * Trial moves use counter-based random numbers of seed, they are generated on device if device_random is set
+ */
+uint64_t seed = 0;
+bool seed_is_set = false;
+bool device_random = false;
+cl_program random_program = NULL;
+cl_kernel random_kernel = NULL;
+cl_mem random_buf = NULL;
+
+/*
+ * Several chains are advanced together and energies of all of them are calculated in one launch of batch kernel,
+ * chains form temperature ladder from Temperature to t_max with replica exchange if t_max is set
+ */
+int chains = 1;
+double t_max = 0;
+int exchange_interval = 100;
+cl_program batch_program = NULL;
+cl_kernel batch_kernel = NULL;
+cl_mem batch_nearest_buf = NULL;
+cl_mem batch_energy_buf = NULL;
+
+/*
+ * Run stops when error of mean energy per particle is below error_target, trial step is adapted to
+ * acceptance_target during the first equilibration trials, 0 disables them
+ */
+double error_target = 0;
+double acceptance_target = 0;
+int equilibration = 0;
+
+/*
+ * Energy is summed on device and one value is read instead of energy array, float or compensated sum
+ */
+bool device_reduce = false;
+bool compensated_reduce = false;
+cl_program reduce_program = NULL;
+energy_reduction reduction = {};
+double reduced_energy = 0.;
+
+/*
+ * Timeline of OpenCL commands and host phases is written to trace_file, NULL means no trace
+ */
+const char *trace_file = NULL;
 
 /** @brief main.cpp entrypoint
  *
  * @details This is entrypoint for MC simulation
- * @param argv[1] --coulomb or --help or None
+ * @param argv --coulomb, --tiled work_group_size, --reduce float|compensated, --trace file, --autotune, --single,
+ * --seed n, --device_random, --chains k, --t_max temperature, --exchange steps, --deviation step, --error target,
+ * --acceptance target, --equilibration trials, --help or None
  * @return return 0 or -1
  */
 int main(int argc, char *argv[]) {
     time_t t;
-    srand((unsigned)time(&t));
     struct timeb start_total_time;
     ftime(&start_total_time);
-    if (argc > 1){
-        if (!strcmp(argv[1], "--coulomb")){
+    for (int arg = 1; arg < argc; arg++){
+        if (!strcmp(argv[arg], "--coulomb")){
             init_opencl = init_opencl_coulomb;
             run = run_coulomb;
         }
+        else if (!strcmp(argv[arg], "--tiled") && (arg + 1 < argc) && (atoi(argv[arg + 1]) > 0)){
+            tiled = true;
+            work_group_size = atoi(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--reduce") && (arg + 1 < argc) &&
+                (!strcmp(argv[arg + 1], "float") || !strcmp(argv[arg + 1], "compensated"))){
+            device_reduce = true;
+            compensated_reduce = !strcmp(argv[++arg], "compensated");
+        }
+        else if (!strcmp(argv[arg], "--trace") && (arg + 1 < argc)){
+            trace_file = argv[++arg];
+        }
+        else if (!strcmp(argv[arg], "--autotune")){
+            autotune = true;
+        }
+        else if (!strcmp(argv[arg], "--single")){
+            single_particle = true;
+        }
+        else if (!strcmp(argv[arg], "--seed") && (arg + 1 < argc)){
+            seed = strtoull(argv[++arg], NULL, 0);
+            seed_is_set = true;
+        }
+        else if (!strcmp(argv[arg], "--device_random")){
+            device_random = true;
+        }
+        else if (!strcmp(argv[arg], "--chains") && (arg + 1 < argc) && (atoi(argv[arg + 1]) > 0)){
+            chains = atoi(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--t_max") && (arg + 1 < argc) && (atof(argv[arg + 1]) > 0)){
+            t_max = atof(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--exchange") && (arg + 1 < argc) && (atoi(argv[arg + 1]) > 0)){
+            exchange_interval = atoi(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--deviation") && (arg + 1 < argc) && (atof(argv[arg + 1]) > 0)){
+            max_deviation = atof(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--error") && (arg + 1 < argc) && (atof(argv[arg + 1]) > 0)){
+            error_target = atof(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--acceptance") && (arg + 1 < argc) &&
+                (atof(argv[arg + 1]) > 0) && (atof(argv[arg + 1]) < 1)){
+            acceptance_target = atof(argv[++arg]);
+        }
+        else if (!strcmp(argv[arg], "--equilibration") && (arg + 1 < argc) && (atoi(argv[arg + 1]) > 0)){
+            equilibration = atoi(argv[++arg]);
+        }
         else{
-            if (!strcmp(argv[1], "--help")){
-                printf("Usage: %s [--help][--coulomb]", argv[0]);
+            if (!strcmp(argv[arg], "--help")){
+                printf("Usage: %s [--help][--coulomb][--tiled work_group_size][--reduce float|compensated][--trace file][--autotune][--single][--seed n][--device_random]"
+                    "[--chains k][--t_max temperature][--exchange steps]"
+                    "[--deviation step][--error target][--acceptance target][--equilibration trials]", argv[0]);
             }
             else{
                 printf("invalid argument\n");
-                printf("Usage: %s [--help][--coulomb]", argv[0]);
+                printf("Usage: %s [--help][--coulomb][--tiled work_group_size][--reduce float|compensated][--trace file][--autotune][--single][--seed n][--device_random]"
+                    "[--chains k][--t_max temperature][--exchange steps]"
+                    "[--deviation step][--error target][--acceptance target][--equilibration trials]", argv[0]);
+                return -1;
             }
         }
     }
+    if ((chains > 1) && (single_particle || tiled || device_reduce || (error_target > 0) || (acceptance_target > 0) ||
+            equilibration)){
+        printf("chains move all particles with batch kernel and run total_it steps, "
+            "--single, --tiled, --reduce, --error, --acceptance and --equilibration are not used\n");
+        single_particle = false;
+        tiled = false;
+        device_reduce = false;
+        error_target = 0;
+        acceptance_target = 0;
+        equilibration = 0;
+    }
+    if (device_random && ((chains > 1) || single_particle)){
+        printf("random numbers are generated on device only for moves of all particles, --device_random is not used\n");
+        device_random = false;
+    }
+    if ((acceptance_target > 0) && !equilibration){
+        printf("trial step is adapted only during equilibration, --acceptance is not used without --equilibration\n");
+    }
+    if (tiled){
+        lj_kernel_name = "mc_lj_tiled";
+        coulomb_kernel_name = "mc_coulomb_tiled";
+        padded_count = (particles_count + work_group_size - 1) / work_group_size * work_group_size;
+        snprintf(build_options, sizeof(build_options), "-D WORK_GROUP_SIZE=%d", work_group_size);
+        printf("%d work-groups of %d work-items\n", padded_count / work_group_size, work_group_size);
+    }
+    if (trace_file){
+        trace.enabled = true;
+        trace_name_track(TRACE_HOST, "host");
+        trace_name_track(TRACE_QUEUE, "queue");
+    }
     if(!init_opencl()) {
       return -1;
     }
+    if (device_reduce){
+        reduce_program = create_program(REDUCTION_PROGRAM, "");
+        if (!reduction_init(&reduction, context, device, reduce_program, compensated_reduce)){
+            return -1;
+        }
+        printf("energy is summed on device, %s sum\n", compensated_reduce ? "compensated" : "float");
+    }
+
+    if (!seed_is_set){
+        seed = (uint64_t)time(&t);
+    }
+    /** run is reproduced with the same seed */
+    printf("seed is %llu\n", (unsigned long long)seed);
+    if (device_random && !init_random()){
+        return -1;
+    }
 
     init_problem(position_arr, charge);
-    mc(position_arr, energy_arr, nearest, charge);
+    /** charges are uploaded once, so batch is created after they are set */
+    if ((chains > 1) && !init_batch()){
+        return -1;
+    }
+    if (chains > 1){
+        mc_chains(position_arr, charge);
+    }
+    else if (single_particle){
+        mc_single_particle(position_arr, energy_arr, nearest, charge);
+    }
+    else{
+        mc(position_arr, energy_arr, nearest, charge);
+    }
     /** Free the resources allocated */
     cleanup();
+    if (trace_file){
+        trace_write(trace_file);
+        trace_free();
+    }
     struct timeb end_total_time;
     ftime(&end_total_time);
     printf("energy is %f\n", final_energy);
@@ -156,82 +348,53 @@ bool init_opencl_lj() {
     queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create command queue");
 
-    #ifdef ALTERA
-        std::string binary_file = getBoardBinaryFile("mc_lj", device);
-        printf("Using AOCX: %s\n", binary_file.c_str());
-        program = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
-    #else
-        int MAX_SOURCE_SIZE  = 65536;
-        FILE *fp;
-        FILE *fp2;
-        const char fileName[] = "./device/mc_lj.cl";
-        const char header[] = "./include/parameters.h";
-        size_t source_size;
-        char *source_str;
-        int count = 0;
-        try {
-            fp = fopen(fileName, "r");
-            if (!fp) {
-                fprintf(stderr, "Failed to load kernel.\n");
-                exit(1);
-            }
-            fp2 = fopen(header, "r");
-            if (!fp2) {
-                fprintf(stderr, "Failed to load kernel header.\n");
-                exit(1);
-            }
-            source_str = (char *)malloc(MAX_SOURCE_SIZE);
-            char ch = getc(fp2);
-            while (ch != EOF){
-                source_str[count] = ch;
-                count++;
-                ch = getc(fp2);
-            }
-            ch = getc(fp);
-            source_str[count++] = '\n';
-            int skip_flag = 0;
-            while(ch != EOF){
-                if (ch == '#'){/** due to bug with NVIDIA OpenCL I cannot use "#include" inside kernel code with NVIDIA OpenCL */
-                    skip_flag = 1;
-                }
-                if (ch == '\n'){
-                    skip_flag = 0;
-                }
-                if (!skip_flag){
-                    source_str[count] = ch;
-                    count++;
-                }
-                ch = getc(fp);
-            }
-            fclose(fp);
-            fclose(fp2);
-        }
-        catch (int a) {
-            printf("%f", a);
-        }
-        program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &status);
-    #endif
-
-    status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
-    checkError(status, "Failed to build program");
+    /** tuning changes kernel and padding, so it is done before program and buffers are created */
+    apply_tuning();
+    program = create_program(lj_kernel_name, build_options);
 
-    const char *kernel_name = "mc";
-    kernel = clCreateKernel(program, kernel_name, &status);
+    kernel = clCreateKernel(program, lj_function_name, &status);
     checkError(status, "Failed to create kernel");
 
     /** Input buffer */
     nearest_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        particles_count * sizeof(cl_float3), NULL, &status);
+        padded_count * sizeof(cl_float3), NULL, &status);
     checkError(status, "Failed to create buffer for nearest");
 
     /* energy_arr buffer */
     energy_arr_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        particles_count * sizeof(float), NULL, &status);
+        padded_count * sizeof(float), NULL, &status);
     checkError(status, "Failed to create buffer for energy_arr");
 
     return true;
 }
 
+/**
+ * @brief create program from AOCX binary for Altera or from kernel source for other platforms,
+ * parameters.h is passed as build options and binaries are cached on disk
+ * @param name kernel file name without extension
+ * @param options build options, for Altera they must be given to offline compiler
+ * @return built program
+ */
+cl_program create_program(const char *name, const char *options) {
+    cl_program result;
+    #ifdef ALTERA
+        cl_int status;
+        std::string binary_file = getBoardBinaryFile(name, device);
+        printf("Using AOCX: %s\n", binary_file.c_str());
+        result = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
+        status = clBuildProgram(result, 0, NULL, options, NULL, NULL);
+        checkError(status, "Failed to build program");
+    #else
+        char fileName[256];
+        snprintf(fileName, sizeof(fileName), "./device/%s.cl", name);
+        result = program_build_cached(context, device, fileName, "./include/parameters.h", options);
+        if (!result) {
+            exit(1);
+        }
+    #endif
+    return result;
+}
+
 /**
  * @brief initialize OpenCL variables for coulomb potentional
  * @return True if initialized successfully, False if error occured
@@ -280,64 +443,7 @@ bool init_opencl_coulomb() {
     queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create command queue");
 
-    #ifdef ALTERA
-        std::string binary_file = getBoardBinaryFile("mc_coulomb", device);
-        printf("Using AOCX: %s\n", binary_file.c_str());
-        program = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
-    #else
-         int MAX_SOURCE_SIZE  = 65536;
-        FILE *fp;
-        FILE *fp2;
-        const char fileName[] = "./device/mc_coulomb.cl";
-        const char header[] = "./include/parameters.h";
-        size_t source_size;
-        char *source_str;
-        int count = 0;
-        try {
-            fp = fopen(fileName, "r");
-            if (!fp) {
-                fprintf(stderr, "Failed to load kernel.\n");
-                exit(1);
-            }
-            fp2 = fopen(header, "r");
-            if (!fp2) {
-                fprintf(stderr, "Failed to load kernel header.\n");
-                exit(1);
-            }
-            source_str = (char *)malloc(MAX_SOURCE_SIZE);
-            char ch = getc(fp2);
-            while (ch != EOF){
-                source_str[count] = ch;
-                count++;
-                ch = getc(fp2);
-            }
-            ch = getc(fp);
-            source_str[count++] = '\n';
-            int skip_flag = 0;
-            while(ch != EOF){
-                if (ch == '#'){/** due to bug with NVIDIA OpenCL I cannot use "#include" inside kernel code with NVIDIA OpenCL */
-                    skip_flag = 1;
-                }
-                if (ch == '\n'){
-                    skip_flag = 0;
-                }
-                if (!skip_flag){
-                    source_str[count] = ch;
-                    count++;
-                }
-                ch = getc(fp);
-            }
-            fclose(fp);
-            fclose(fp2);
-        }
-        catch (int a) {
-            printf("%f", a);
-        }
-        program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &status);
-    #endif
-
-    status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
-    checkError(status, "Failed to build program");
+    program = create_program(coulomb_kernel_name, build_options);
 
     const char *kernel_name = "mc";
     kernel = clCreateKernel(program, kernel_name, &status);
@@ -345,17 +451,17 @@ bool init_opencl_coulomb() {
 
     /** Input buffer */
     nearest_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        particles_count * sizeof(cl_float3), NULL, &status);
+        padded_count * sizeof(cl_float3), NULL, &status);
     checkError(status, "Failed to create buffer for nearest");
 
     /** charge buffer */
     charge_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        particles_count * sizeof(cl_int), NULL, &status);
+        padded_count * sizeof(cl_int), NULL, &status);
     checkError(status, "Failed to create buffer for charge");
 
     /** energy_arr buffer */
     energy_arr_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        particles_count * sizeof(float), NULL, &status);
+        padded_count * sizeof(float), NULL, &status);
     checkError(status, "Failed to create buffer for energy_arr");
 
     return true;
@@ -379,8 +485,8 @@ void run_lj() {
 
     unsigned argi = 0;
 
-    size_t global_work_size[1] = {particles_count};
-    size_t local_work_size[1] = {particles_count};
+    size_t global_work_size[1] = {(size_t)padded_count};
+    size_t local_work_size[1] = {(size_t)work_group_size};
 
     status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &nearest_buf);
     checkError(status, "Failed to set argument nearest");
@@ -392,13 +498,25 @@ void run_lj() {
         global_work_size, local_work_size, 1, &write_event, &kernel_event);
     checkError(status, "Failed to launch kernel");
 
-    status = clEnqueueReadBuffer(queue, energy_arr_buf, CL_FALSE,
-        0, particles_count * sizeof(float), energy_arr, 1, &kernel_event, &finish_event);
-
-    clReleaseEvent(write_event);
+    /** sum is read instead of energy array, reduction reads it with blocking call */
+    if (device_reduce){
+        status = reduction_sum(&reduction, queue, energy_arr_buf, particles_count, 1, &kernel_event, TRACE_QUEUE, &reduced_energy);
+        checkError(status, "Failed to reduce energy_arr");
+    }
+    else{
+        status = clEnqueueReadBuffer(queue, energy_arr_buf, CL_FALSE,
+            0, particles_count * sizeof(float), energy_arr, 1, &kernel_event, &finish_event);
+    }
 
     /** Wait for all devices to finish */
-    clWaitForEvents(1, &finish_event);
+    if (!device_reduce){
+        clWaitForEvents(1, &finish_event);
+        trace_cl_event(finish_event, "read energy", TRACE_QUEUE);
+        clReleaseEvent(finish_event);
+    }
+    trace_cl_event(write_event, "write nearest", TRACE_QUEUE);
+    trace_cl_event(kernel_event, "lj kernel", TRACE_QUEUE);
+    clReleaseEvent(write_event);
 
     /** measure kernel time */
     clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
@@ -406,6 +524,142 @@ void run_lj() {
     total_time = time_end - time_start;
     kernel_total_time += total_time;
 
+    clReleaseEvent(kernel_event);
+}
+
+/**
+ * @brief create kernel and buffer for random numbers on device
+ * @return True if initialized successfully, False if error occured
+ */
+bool init_random() {
+    cl_int status;
+    random_program = create_program("mc_random", "");
+    random_kernel = clCreateKernel(random_program, "random_uniform", &status);
+    checkError(status, "Failed to create random kernel");
+
+    random_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+        padded_count * sizeof(cl_float4), NULL, &status);
+    checkError(status, "Failed to create buffer for random numbers");
+    printf("random numbers are generated on device\n");
+    return true;
+}
+
+/**
+ * @brief 4 uniform numbers per particle for trial moves of step, they are the same on host and device
+ * @param step MC step
+ * @param uniforms 4 * particles_count numbers, output
+ * @return void
+ */
+void generate_moves(uint64_t step, cl_float *uniforms) {
+    if (!device_random){
+        philox_uniform_batch(seed, step, PHILOX_STREAM_MOVE, 0, particles_count, uniforms);
+        return;
+    }
+    cl_int status;
+    cl_event kernel_event;
+    cl_event read_event;
+    cl_uint words[5] = {(cl_uint)seed, (cl_uint)(seed >> 32), (cl_uint)step, (cl_uint)(step >> 32), PHILOX_STREAM_MOVE};
+    cl_int count = particles_count;
+    size_t global_work_size[1] = {(size_t)padded_count};
+
+    unsigned argi = 0;
+    status = clSetKernelArg(random_kernel, argi++, sizeof(cl_mem), &random_buf);
+    checkError(status, "Failed to set argument random numbers");
+    for (int i = 0; i < 5; i++){
+        status = clSetKernelArg(random_kernel, argi++, sizeof(cl_uint), &words[i]);
+        checkError(status, "Failed to set argument of random kernel");
+    }
+    status = clSetKernelArg(random_kernel, argi++, sizeof(cl_int), &count);
+    checkError(status, "Failed to set argument count");
+
+    status = clEnqueueNDRangeKernel(queue, random_kernel, 1, NULL,
+        global_work_size, NULL, 0, NULL, &kernel_event);
+    checkError(status, "Failed to launch random kernel");
+
+    status = clEnqueueReadBuffer(queue, random_buf, CL_FALSE,
+        0, particles_count * sizeof(cl_float4), uniforms, 1, &kernel_event, &read_event);
+    checkError(status, "Failed to read random numbers");
+    clWaitForEvents(1, &read_event);
+    trace_cl_event(kernel_event, "random kernel", TRACE_QUEUE);
+    trace_cl_event(read_event, "read random numbers", TRACE_QUEUE);
+    clReleaseEvent(kernel_event);
+    clReleaseEvent(read_event);
+}
+
+/**
+ * @brief create batch kernel and buffers for all chains, set kernel arguments and upload charges once
+ * @return True if initialized successfully, False if error occured
+ */
+bool init_batch() {
+    cl_int status;
+    batch_program = create_program("mc_batch", "");
+    batch_kernel = clCreateKernel(batch_program, (run == run_coulomb) ? "mc_coulomb_batch" : "mc_lj_batch", &status);
+    checkError(status, "Failed to create batch kernel");
+
+    batch_nearest_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+        chains * particles_count * sizeof(cl_float3), NULL, &status);
+    checkError(status, "Failed to create buffer for nearest of chains");
+
+    batch_energy_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+        chains * particles_count * sizeof(float), NULL, &status);
+    checkError(status, "Failed to create buffer for energy of chains");
+
+    /** arguments and charges are the same for all launches, only nearest is written per step */
+    unsigned argi = 0;
+    status = clSetKernelArg(batch_kernel, argi++, sizeof(cl_mem), &batch_nearest_buf);
+    checkError(status, "Failed to set argument nearest");
+    if (run == run_coulomb){
+        status = clEnqueueWriteBuffer(queue, charge_buf, CL_TRUE,
+            0, particles_count * sizeof(cl_int), charge, 0, NULL, NULL);
+        checkError(status, "Failed to transfer charge");
+        status = clSetKernelArg(batch_kernel, argi++, sizeof(cl_mem), &charge_buf);
+        checkError(status, "Failed to set argument charge");
+    }
+    status = clSetKernelArg(batch_kernel, argi++, sizeof(cl_mem), &batch_energy_buf);
+    checkError(status, "Failed to set argument energy_arr");
+    printf("%d chains in one launch\n", chains);
+    return true;
+}
+
+/**
+ * @brief run batch kernel for all chains
+ * @param nearests nearest arrays of chains one after another
+ * @param energies energy arrays of chains, output
+ * @return void
+ */
+void run_batch(cl_float3 *nearests, cl_float *energies) {
+    cl_int status;
+    cl_event write_event;
+    cl_event kernel_event;
+    cl_event finish_event;
+    cl_ulong time_start, time_end;
+
+    status = clEnqueueWriteBuffer(queue, batch_nearest_buf, CL_FALSE,
+        0, chains * particles_count * sizeof(cl_float3), nearests, 0, NULL, &write_event);
+    checkError(status, "Failed to transfer nearest of chains");
+
+    /** particles of chain in the first dimension, chain in the second one */
+    size_t global_work_size[2] = {particles_count, (size_t)chains};
+    status = clEnqueueNDRangeKernel(queue, batch_kernel, 2, NULL,
+        global_work_size, NULL, 1, &write_event, &kernel_event);
+    checkError(status, "Failed to launch batch kernel");
+
+    status = clEnqueueReadBuffer(queue, batch_energy_buf, CL_FALSE,
+        0, chains * particles_count * sizeof(float), energies, 1, &kernel_event, &finish_event);
+    checkError(status, "Failed to read energy of chains");
+    clWaitForEvents(1, &finish_event);
+
+    trace_cl_event(write_event, "write nearest", TRACE_QUEUE);
+    trace_cl_event(kernel_event, "batch kernel", TRACE_QUEUE);
+    trace_cl_event(finish_event, "read energy", TRACE_QUEUE);
+    clReleaseEvent(write_event);
+
+    /** measure kernel time */
+    clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+    clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+    kernel_total_time += time_end - time_start;
+    kernel_calls++;
+
     clReleaseEvent(kernel_event);
     clReleaseEvent(finish_event);
 }
@@ -432,8 +686,8 @@ void run_coulomb() {
 
     unsigned argi = 0;
 
-    size_t global_work_size[1] = {particles_count};
-    size_t local_work_size[1] = {particles_count};
+    size_t global_work_size[1] = {(size_t)padded_count};
+    size_t local_work_size[1] = {(size_t)work_group_size};
 
     status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &nearest_buf);
     checkError(status, "Failed to set argument nearest");
@@ -448,15 +702,28 @@ void run_coulomb() {
         global_work_size, local_work_size, 1, write_event, &kernel_event);
     checkError(status, "Failed to launch kernel");
 
-    status = clEnqueueReadBuffer(queue, energy_arr_buf, CL_FALSE,
-        0, particles_count * sizeof(float), energy_arr, 1, &kernel_event, &finish_event);
+    /** sum is read instead of energy array, reduction reads it with blocking call */
+    if (device_reduce){
+        status = reduction_sum(&reduction, queue, energy_arr_buf, particles_count, 1, &kernel_event, TRACE_QUEUE, &reduced_energy);
+        checkError(status, "Failed to reduce energy_arr");
+    }
+    else{
+        status = clEnqueueReadBuffer(queue, energy_arr_buf, CL_FALSE,
+            0, particles_count * sizeof(float), energy_arr, 1, &kernel_event, &finish_event);
+    }
 
+    /** Wait for device to finish */
+    if (!device_reduce){
+        clWaitForEvents(1, &finish_event);
+        trace_cl_event(finish_event, "read energy", TRACE_QUEUE);
+        clReleaseEvent(finish_event);
+    }
+    trace_cl_event(write_event[0], "write nearest", TRACE_QUEUE);
+    trace_cl_event(write_event[1], "write charge", TRACE_QUEUE);
+    trace_cl_event(kernel_event, "coulomb kernel", TRACE_QUEUE);
     clReleaseEvent(write_event[0]);
     clReleaseEvent(write_event[1]);
 
-    /** Wait for device to finish */
-    clWaitForEvents(1, &finish_event);
-
     /* measure kernel time */
     clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
     clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
@@ -464,7 +731,70 @@ void run_coulomb() {
     kernel_total_time += total_time;
 
     clReleaseEvent(kernel_event);
-    clReleaseEvent(finish_event);
+}
+
+/**
+ * @brief use tuned LJ kernel with configuration from tuning cache, or tune it if autotune is set,
+ * explicit --tiled keeps its kernel
+ * @return True if tuned kernel is used, False otherwise
+ */
+bool apply_tuning() {
+    #ifdef ALTERA
+        /** AOCX is built offline, so variants cannot be built at run time */
+        return false;
+    #else
+        if (tiled || (init_opencl != init_opencl_lj)){
+            if (autotune){
+                printf("autotune is supported for LJ kernel without --tiled\n");
+            }
+            return false;
+        }
+        tuning_config config;
+        if (autotune || !tuning_load("mc_lj_tuned", device, particles_count, &config)){
+            if (!autotune || !tune_lj(&config)){
+                return false;
+            }
+            tuning_store("mc_lj_tuned", device, particles_count, &config);
+        }
+        tiled = true;
+        work_group_size = config.work_group_size;
+        padded_count = (particles_count + work_group_size - 1) / work_group_size * work_group_size;
+        snprintf(build_options, sizeof(build_options), "-D WORK_GROUP_SIZE=%d -D UNROLL=%d", work_group_size, config.unroll);
+        lj_kernel_name = "mc_lj_tuned";
+        tuning_kernel_name("mc", config.vector_width, lj_function_name, sizeof(lj_function_name));
+        printf("tuned kernel %s: work-group %d, vector %d, unroll %d\n", lj_function_name,
+            config.work_group_size, config.vector_width, config.unroll);
+        return true;
+    #endif
+}
+
+/**
+ * @brief time variants of tuned LJ kernel on initial positions
+ * @param config the fastest variant
+ * @return True if at least one variant runs, False otherwise
+ */
+bool tune_lj(tuning_config *config) {
+    cl_int status;
+    int count = (particles_count + TUNING_MAX_WORK_GROUP - 1) / TUNING_MAX_WORK_GROUP * TUNING_MAX_WORK_GROUP;
+    cl_mem args[2];
+    size_t sizes[2] = {sizeof(cl_float3), sizeof(cl_float)};
+    for (int i = 0; i < 2; i++){
+        args[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, count * sizes[i], NULL, &status);
+        checkError(status, "Failed to create buffer for tuning");
+    }
+    /** initial lattice is already inside the box */
+    init_problem(position_arr, charge);
+    status = clEnqueueWriteBuffer(queue, args[0], CL_TRUE,
+        0, particles_count * sizeof(cl_float3), position_arr, 0, NULL, NULL);
+    checkError(status, "Failed to transfer positions for tuning");
+
+    printf("Tuning LJ kernel\n");
+    bool result = tuning_run(context, device, queue, "./device/mc_lj_tuned.cl", "./include/parameters.h",
+        "mc", particles_count, args, 2, config);
+    for (int i = 0; i < 2; i++){
+        clReleaseMemObject(args[i]);
+    }
+    return result;
 }
 
 /**
@@ -487,9 +817,34 @@ void cleanup() {
     if (charge_buf) {
         clReleaseMemObject(charge_buf);
     }
+    reduction_free(&reduction);
+    if (random_kernel) {
+      clReleaseKernel(random_kernel);
+    }
+    if (random_buf) {
+      clReleaseMemObject(random_buf);
+    }
+    if (random_program) {
+    clReleaseProgram(random_program);
+    }
+    if (batch_kernel) {
+      clReleaseKernel(batch_kernel);
+    }
+    if (batch_nearest_buf) {
+      clReleaseMemObject(batch_nearest_buf);
+    }
+    if (batch_energy_buf) {
+      clReleaseMemObject(batch_energy_buf);
+    }
+    if (batch_program) {
+    clReleaseProgram(batch_program);
+    }
     if (program) {
     clReleaseProgram(program);
     }
+    if (reduce_program) {
+    clReleaseProgram(reduce_program);
+    }
     if (context) {
     clReleaseContext(context);
     }
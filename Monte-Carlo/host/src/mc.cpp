@@ -13,7 +13,18 @@ extern int kernel_calls;
 extern cl_float final_energy;
 extern float good_iters_percent;
 extern void (*run)();
-float max_deviation = 0.007;
+extern bool device_reduce;
+extern double reduced_energy;
+extern uint64_t seed;
+extern int chains;
+extern double t_max;
+extern int exchange_interval;
+extern double error_target;
+extern double acceptance_target;
+extern int equilibration;
+extern cl_float3 trial_arr[];
+extern cl_float move_arr[];
+double max_deviation = 0.007;
 
 /**
  * @brief set initial coordinates and charges for all particles
@@ -47,7 +58,8 @@ void init_problem(cl_float3 *position_arr, cl_int *charge) {
 }
 
 /**
- * @brief perform MC iterations
+ * @brief perform MC iterations, trial configuration is built in trial_arr and accepted one is swapped with it,
+ * so steps do not copy configurations
  * @param position_arr Position array
  * @param energy_arr energy array
  * @param nearest nearest array
@@ -58,43 +70,300 @@ void mc(cl_float3 *position_arr, cl_float *energy_arr, cl_float3 *nearest, cl_in
     int i = 0;
     int good_iter = 0;
     int good_iter_hung = 0;
-    float energy_ar[nmax] = {};
+    energy_stats stats = {};
+    deviation_controller controller = controller_init(acceptance_target);
+    bool converged = false;
     float u1 = calculate_energy(position_arr, energy_arr, nearest, charge);
+    cl_float *uniforms = move_arr;
+    cl_float3 *current = position_arr;
+    cl_float3 *trial = trial_arr;
     while (1) {
-        if ((good_iter == nmax) || (i == total_it)) {
-            final_energy = energy_ar[good_iter-1]/particles_count;
-            good_iters_percent = (float)good_iter/(float)total_it;
+        if ((good_iter == nmax) || (i == total_it) || converged) {
+            final_energy = u1/particles_count;
+            good_iters_percent = (float)good_iter/(float)i;
             kernel_calls = i;
+            report_energy(&stats);
             break;
         }
-        cl_float3 tmp[particles_count];
-        memcpy(tmp, position_arr, sizeof(cl_float3)*particles_count);
+        uint64_t motion_start = trace_now();
+        generate_moves(i, uniforms);
         for (int particle = 0; particle < particles_count; particle++) {
             /** offset between -max_deviation/2 and max_deviation/2 */
-            double ex = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            double ey = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            double ez = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            position_arr[particle].x = position_arr[particle].x + ex;
-            position_arr[particle].y = position_arr[particle].y + ex;
-            position_arr[particle].z = position_arr[particle].z + ex;
-        }
-        double u2 = calculate_energy(position_arr, energy_arr, nearest, charge);
+            double ex = uniforms[4 * particle] * max_deviation - max_deviation / 2;
+            double ey = uniforms[4 * particle + 1] * max_deviation - max_deviation / 2;
+            double ez = uniforms[4 * particle + 2] * max_deviation - max_deviation / 2;
+            trial[particle].x = current[particle].x + ex;
+            trial[particle].y = current[particle].y + ey;
+            trial[particle].z = current[particle].z + ez;
+        }
+        trace_host("motion", motion_start);
+        double u2 = calculate_energy(trial, energy_arr, nearest, charge);
         double deltaU_div_T = (u1 - u2) / Temperature;
         double probability = exp(deltaU_div_T);
-        double rand_0_1 = (double)rand() / (double)RAND_MAX;
-        if ((u2 < u1) || (probability <= rand_0_1)) {
+        double rand_0_1 = philox_uniform(philox_draw(seed, i, 0, PHILOX_STREAM_ACCEPT).v[0]);
+        /** Metropolis probability min(1, exp(-dU/T)) */
+        bool accepted = (u2 < u1) || (rand_0_1 < probability);
+        if (accepted) {
             u1 = u2;
-            energy_ar[good_iter] = u2;
+            /** rejected trial is overwritten by the next one */
+            cl_float3 *swap = current;
+            current = trial;
+            trial = swap;
             good_iter++;
             good_iter_hung++;
         }
-        else {
-            memcpy(position_arr, tmp, sizeof(cl_float3) * particles_count);
+        converged = sample_energy(&stats, &controller, i, accepted, u1);
+        i++;
+    }
+    /** result is returned in position_arr, it is copied once if the last accepted configuration is in trial_arr */
+    if (current != position_arr) {
+        memcpy(position_arr, current, sizeof(cl_float3) * particles_count);
+    }
+}
+
+/**
+ * @brief perform MC iterations, each trial moves one random particle, so energy change is
+ * calculated on host from interactions of this particle only in O(N) instead of O(N^2) kernel run,
+ * device calculates initial total energy only
+ * @param position_arr Position array
+ * @param energy_arr energy array
+ * @param nearest nearest array
+ * @param charge array Charge array
+ * @return void
+ */
+void mc_single_particle(cl_float3 *position_arr, cl_float *energy_arr, cl_float3 *nearest, cl_int *charge) {
+    int i = 0;
+    int good_iter = 0;
+    energy_stats stats = {};
+    deviation_controller controller = controller_init(acceptance_target);
+    bool converged = false;
+    /** full energy is calculated once, it also fills nearest */
+    double u1 = calculate_energy(position_arr, energy_arr, nearest, charge);
+    while (1) {
+        if ((good_iter == nmax) || (i == total_it) || converged) {
+            final_energy = u1/particles_count;
+            good_iters_percent = (float)good_iter/(float)i;
+            kernel_calls = 1;
+            report_energy(&stats);
+            break;
+        }
+        /** accept stream gives acceptance number and moved particle, move stream gives its offset */
+        philox_block accept = philox_draw(seed, i, 0, PHILOX_STREAM_ACCEPT);
+        int particle = philox_below(accept.v[1], particles_count);
+        philox_block move = philox_draw(seed, i, particle, PHILOX_STREAM_MOVE);
+        /** offset between -max_deviation/2 and max_deviation/2 */
+        cl_float3 moved = position_arr[particle];
+        moved.x += philox_uniform(move.v[0]) * max_deviation - max_deviation / 2;
+        moved.y += philox_uniform(move.v[1]) * max_deviation - max_deviation / 2;
+        moved.z += philox_uniform(move.v[2]) * max_deviation - max_deviation / 2;
+        cl_float3 image = { wrap_coordinate(moved.x), wrap_coordinate(moved.y), wrap_coordinate(moved.z) };
+        double u2 = u1 + particle_energy(nearest, charge, particle, image) -
+            particle_energy(nearest, charge, particle, nearest[particle]);
+        /** Metropolis probability min(1, exp(-dU/T)) */
+        bool accepted = (u2 < u1) || (philox_uniform(accept.v[0]) < exp((u1 - u2) / Temperature));
+        if (accepted) {
+            /** only moved particle is committed, rejected trial changes nothing */
+            u1 = u2;
+            position_arr[particle] = moved;
+            nearest[particle] = image;
+            good_iter++;
         }
+        converged = sample_energy(&stats, &controller, i, accepted, u1);
         i++;
     }
 }
 
+/**
+ * @brief account trial, during equilibration trial step is adapted to acceptance_target,
+ * after it energy is sampled after each trial, accepted or not
+ * @param stats energy statistics
+ * @param controller controller of trial step
+ * @param trial number of trial
+ * @param accepted True if trial is accepted
+ * @param energy total energy after trial
+ * @return True if error of mean energy per particle is below error_target, False otherwise
+ */
+bool sample_energy(energy_stats *stats, deviation_controller *controller, int trial, bool accepted, double energy) {
+    if (trial < equilibration) {
+        if ((acceptance_target > 0) && controller_update(controller, accepted, &max_deviation, half_box)) {
+            /** the last value of step is used after equilibration */
+            if (trial + CONVERGENCE_CONTROLLER_WINDOW >= equilibration) {
+                printf("max_deviation is %f after equilibration\n", max_deviation);
+            }
+        }
+        return false;
+    }
+    stats_add(stats, energy / particles_count);
+    return (error_target > 0) && (stats_error(stats) < error_target);
+}
+
+/**
+ * @brief print mean energy per particle with its error
+ * @param stats energy statistics
+ * @return void
+ */
+void report_energy(const energy_stats *stats) {
+    if (stats->levels[0].count < CONVERGENCE_MIN_BLOCKS) {
+        return;
+    }
+    printf("mean energy is %f +- %f, %lld samples, statistical inefficiency %f\n", stats_mean(stats),
+        stats_error(stats), stats->samples, stats_inefficiency(stats));
+}
+
+/**
+ * @brief perform MC iterations of several chains, all chains make a trial move of all particles in each step
+ * and their energies are calculated in one batch kernel launch. Chains are independent at Temperature,
+ * or form temperature ladder up to t_max and exchange configurations every exchange_interval steps
+ * @param position_arr Position array, configuration of chain at Temperature is returned in it
+ * @param charge array Charge array
+ * @return void
+ */
+void mc_chains(cl_float3 *position_arr, cl_int *charge) {
+    const int count = chains;
+    cl_float3 *positions = (cl_float3*)malloc(sizeof(cl_float3) * particles_count * count);
+    cl_float3 *trials = (cl_float3*)malloc(sizeof(cl_float3) * particles_count * count);
+    /** configuration and trial of each chain, they are swapped if trial is accepted */
+    cl_float3 **current = (cl_float3**)malloc(sizeof(cl_float3*) * count);
+    cl_float3 **trial_of = (cl_float3**)malloc(sizeof(cl_float3*) * count);
+    cl_float3 *nearests = (cl_float3*)malloc(sizeof(cl_float3) * particles_count * count);
+    cl_float *energies = (cl_float*)malloc(sizeof(cl_float) * particles_count * count);
+    double *energy = (double*)malloc(sizeof(double) * count);
+    cl_float *uniforms = move_arr;
+    bool tempering = (t_max > 0);
+    tempering_ladder ladder = {};
+    if (!positions || !trials || !current || !trial_of || !nearests || !energies || !energy ||
+            !tempering_init(&ladder, count, Temperature, tempering ? t_max : Temperature)) {
+        fprintf(stderr, "Failed to allocate chains\n");
+        exit(1);
+    }
+    /** all chains start from initial configuration */
+    for (int chain = 0; chain < count; chain++) {
+        current[chain] = positions + chain * particles_count;
+        trial_of[chain] = trials + chain * particles_count;
+        memcpy(current[chain], position_arr, sizeof(cl_float3) * particles_count);
+        nearest_image(current[chain], nearests + chain * particles_count);
+    }
+    run_batch(nearests, energies);
+    for (int chain = 0; chain < count; chain++) {
+        energy[chain] = 0;
+        for (int i = 0; i < particles_count; i++) {
+            energy[chain] += energies[chain * particles_count + i];
+        }
+        energy[chain] /= 2;
+    }
+    if (tempering) {
+        printf("temperatures from %f to %f, exchange every %d steps\n", ladder.temperature[0],
+            ladder.temperature[count - 1], exchange_interval);
+    }
+    for (int i = 0; i < total_it; i++) {
+        uint64_t motion_start = trace_now();
+        for (int chain = 0; chain < count; chain++) {
+            uint32_t stream = PHILOX_REPLICA_STREAMS * (chain + 1);
+            cl_float3 *trial = trial_of[chain];
+            cl_float3 *position = current[chain];
+            philox_uniform_batch(seed, i, stream + PHILOX_STREAM_MOVE, 0, particles_count, uniforms);
+            for (int particle = 0; particle < particles_count; particle++) {
+                /** offset between -max_deviation/2 and max_deviation/2 */
+                trial[particle].x = position[particle].x + uniforms[4 * particle] * max_deviation - max_deviation / 2;
+                trial[particle].y = position[particle].y + uniforms[4 * particle + 1] * max_deviation - max_deviation / 2;
+                trial[particle].z = position[particle].z + uniforms[4 * particle + 2] * max_deviation - max_deviation / 2;
+            }
+            nearest_image(trial, nearests + chain * particles_count);
+        }
+        trace_host("motion and nearest_image", motion_start);
+        run_batch(nearests, energies);
+        for (int chain = 0; chain < count; chain++) {
+            int slot = ladder.slot_of[chain];
+            double u2 = 0;
+            for (int particle = 0; particle < particles_count; particle++) {
+                u2 += energies[chain * particles_count + particle];
+            }
+            u2 /= 2;
+            double rand_0_1 = philox_uniform(philox_draw(seed, i, 0,
+                PHILOX_REPLICA_STREAMS * (chain + 1) + PHILOX_STREAM_ACCEPT).v[0]);
+            ladder.trials[slot]++;
+            if ((u2 < energy[chain]) || (rand_0_1 < exp((energy[chain] - u2) / ladder.temperature[slot]))) {
+                energy[chain] = u2;
+                cl_float3 *swap = current[chain];
+                current[chain] = trial_of[chain];
+                trial_of[chain] = swap;
+                ladder.accepted[slot]++;
+            }
+        }
+        if (tempering && ((i + 1) % exchange_interval == 0)) {
+            tempering_exchange(&ladder, energy, seed, i / exchange_interval);
+        }
+    }
+    tempering_report(&ladder, energy, particles_count);
+    int coldest = ladder.config_at[0];
+    final_energy = energy[coldest] / particles_count;
+    good_iters_percent = (float)ladder.accepted[0] / (float)ladder.trials[0];
+    memcpy(position_arr, current[coldest], sizeof(cl_float3) * particles_count);
+    tempering_free(&ladder);
+    free(positions);
+    free(trials);
+    free(current);
+    free(trial_of);
+    free(nearests);
+    free(energies);
+    free(energy);
+}
+
+/**
+ * @brief energy of interaction of one particle with all others, the same as in kernels
+ * @param nearest nearest array
+ * @param charge array Charge array
+ * @param particle index of particle, its own entry of nearest is skipped
+ * @param image nearest image of particle
+ * @return energy
+ */
+double particle_energy(cl_float3 *nearest, cl_int *charge, int particle, cl_float3 image) {
+    double energy = 0;
+    for (int j = 0; j < particles_count; j++) {
+        if (j == particle) {
+            continue;
+        }
+        float x = nearest[j].x - image.x;
+        float y = nearest[j].y - image.y;
+        float z = nearest[j].z - image.z;
+        /* second part of implementation of periodic boundary conditions */
+        if (x > half_box)
+            x -= box_size;
+        else {
+            if (x < -half_box)
+                x += box_size;
+        }
+        if (y > half_box)
+            y -= box_size;
+        else {
+            if (y < -half_box)
+                y += box_size;
+        }
+        if (z > half_box)
+            z -= box_size;
+        else {
+            if (z < -half_box)
+                z += box_size;
+        }
+        float sq_dist = x * x + y * y + z * z;
+        if (run == run_coulomb) {
+            float dist = sqrt(sq_dist);
+            if ((charge[particle] == -1) || (charge[j] == -1)){
+                energy += charge[particle] * charge[j] * erf(dist / SIGMA) / dist;
+            }
+            else{
+                energy += charge[particle] * charge[j] / dist;
+            }
+        }
+        else if (sq_dist < rc * rc) {
+            float r6 = sq_dist * sq_dist * sq_dist;
+            float r12 = r6 * r6;
+            energy += 4 * (1 / r12 - 1 / r6);
+        }
+    }
+    return energy;
+}
+
 /**
  * @brief calculate energy on device
  * @param position_arr Position array
@@ -104,12 +373,21 @@ void mc(cl_float3 *position_arr, cl_float *energy_arr, cl_float3 *nearest, cl_in
  * @return void
  */
 cl_float calculate_energy(cl_float3 *position_arr, cl_float *energy_arr, cl_float3 *nearest, cl_int *charge) {
+    uint64_t nearest_start = trace_now();
     nearest_image(position_arr, nearest);
+    trace_host("nearest_image", nearest_start);
     memset(energy_arr, 0, sizeof(energy_arr));
     run();
     float total_energy = 0;
-    for (unsigned i = 0; i < particles_count; i++)
-        total_energy+=energy_arr[i];
+    if (device_reduce){
+        total_energy = reduced_energy;
+    }
+    else{
+        uint64_t sum_start = trace_now();
+        for (unsigned i = 0; i < particles_count; i++)
+            total_energy+=energy_arr[i];
+        trace_host("energy sum", sum_start);
+    }
     total_energy/=2;
     return total_energy;
 }
@@ -122,25 +400,19 @@ cl_float calculate_energy(cl_float3 *position_arr, cl_float *energy_arr, cl_floa
  */
 void nearest_image(cl_float3 *position_arr, cl_float3 *nearest){
     for (int i = 0; i < particles_count; i++){
-        float x,y,z;
-        if (position_arr[i].x  > 0){
-            x = fmod(position_arr[i].x + half_box, box_size) - half_box;
-        }
-        else{
-            x = fmod(position_arr[i].x - half_box, box_size) + half_box;
-        }
-        if (position_arr[i].y  > 0){
-            y = fmod(position_arr[i].y + half_box, box_size) - half_box;
-        }
-        else{
-            y = fmod(position_arr[i].y - half_box, box_size) + half_box;
-        }
-        if (position_arr[i].z  > 0){
-            z = fmod(position_arr[i].z + half_box, box_size) - half_box;
-        }
-        else{
-            z = fmod(position_arr[i].z - half_box, box_size) + half_box;
-        }
-        nearest[i] = (cl_float3){ x, y, z};
+        nearest[i] = (cl_float3){ wrap_coordinate(position_arr[i].x), wrap_coordinate(position_arr[i].y),
+            wrap_coordinate(position_arr[i].z)};
+    }
+}
+
+/**
+ * @brief move coordinate into box
+ * @param coordinate coordinate
+ * @return coordinate between -half_box and half_box
+ */
+float wrap_coordinate(double coordinate){
+    if (coordinate > 0){
+        return fmod(coordinate + half_box, box_size) - half_box;
     }
+    return fmod(coordinate - half_box, box_size) + half_box;
 }
\ No newline at end of file
@@ -0,0 +1,11 @@
+#define rc 3
+#define box_size 12
+#define half_box 6
+#define particles_count 128
+#define nmax 8000
+#define total_it 16000
+#define Temperature 1.3
+#define initial_dist_by_one_axis 1.2
+#define initial_dist_to_edge 2
+#define SIGMA 0.221f
+#define DERIVATIVE_ERF 2.556f
\ No newline at end of file
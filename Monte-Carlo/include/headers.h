@@ -16,6 +16,8 @@
 #include <string.h>
 
 #define MAX_PLATFORMS_COUNT 2
+/** trace track of queue, host is track 0 */
+#define TRACE_QUEUE 1
 
 /**
  * Prototypes
@@ -25,7 +27,23 @@ bool init_opencl_coulomb();
 void run_lj();
 void run_coulomb();
 void cleanup();
+cl_program create_program(const char *name, const char *options);
+bool apply_tuning();
+bool init_random();
+void generate_moves(uint64_t step, cl_float *uniforms);
+bool init_batch();
+void run_batch(cl_float3 *nearests, cl_float *energies);
+void mc_chains(cl_float3 *position_arr, cl_int *charge);
+struct energy_stats;
+struct deviation_controller;
+bool sample_energy(energy_stats *stats, deviation_controller *controller, int trial, bool accepted, double energy);
+void report_energy(const energy_stats *stats);
+struct tuning_config;
+bool tune_lj(tuning_config *config);
 void init_problem(cl_float3 *input, cl_int *charge);
 void mc(cl_float3 *position_arr, cl_float *energy_arr, cl_float3 *nearest, cl_int *charge);
 void nearest_image(cl_float3 *position_arr, cl_float3 *nearest);
+float wrap_coordinate(double coordinate);
+void mc_single_particle(cl_float3 *position_arr, cl_float *energy_arr, cl_float3 *nearest, cl_int *charge);
+double particle_energy(cl_float3 *nearest, cl_int *charge, int particle, cl_float3 image);
 cl_float calculate_energy(cl_float3 *position_arr, cl_float *energy_arr, cl_float3 *nearest, cl_int *charge);
\ No newline at end of file
@@ -14,9 +14,66 @@
 #include <time.h>
 #include <omp.h>
 #include <string.h>
+/*
+ * Kernels specialised for N particles use box, cutoff of include/<N>parameters.h as compile time constants
+ */
+template <int N> struct preset;
+#include "16parameters.h"
+#include "preset.h"
+#include "32parameters.h"
+#include "preset.h"
+#include "64parameters.h"
+#include "preset.h"
+#include "128parameters.h"
+#include "preset.h"
+#include "256parameters.h"
+#include "preset.h"
+#include "512parameters.h"
+#include "preset.h"
+#include "1024parameters.h"
+#include "preset.h"
 #include "parameters.h"
+#include "simd.h"
+#include "philox.h"
+#include "tempering.h"
+#include "convergence.h"
+
+/*
+ * Values from parameters.h are defaults, they can be changed from command line or config file
+ */
+const int default_particles_count = particles_count;
+const double default_box_size = box_size;
+const int default_total_it = total_it;
+const int default_nmax = nmax;
+const double default_rc = rc;
+const double default_initial_dist_by_one_axis = initial_dist_by_one_axis;
+#undef particles_count
+#undef box_size
+#undef half_box
+#undef total_it
+#undef nmax
+#undef rc
+#undef initial_dist_by_one_axis
+int particles_count = default_particles_count;
+double box_size = default_box_size;
+double half_box = default_box_size / 2;
+int total_it = default_total_it;
+int nmax = default_nmax;
+double rc = default_rc;
+double initial_dist_by_one_axis = default_initial_dist_by_one_axis;
+/** generic kernels for N = 0 use runtime values */
+template <int N> struct preset {
+    static double box() { return ::box_size; }
+    static double half() { return ::half_box; }
+    static double cutoff() { return ::rc; }
+};
+/** initial lattice is recalculated if size of system was changed without spacing */
+bool size_is_set = false;
+bool spacing_is_set = false;
 
 #define NUM_THREADS 8
+/** particles whose trial moves are generated by one thread */
+#define MOVES_CHUNK 256
 
 /**
  * Structs
@@ -28,57 +85,264 @@ struct dim {
 };
 typedef struct dim dim;
 
+/**
+ * Structure of arrays for SIMD kernels, arrays are aligned and padded to SIMD_WIDTH
+ */
+struct soa {
+    float *x;
+    float *y;
+    float *z;
+    float *charge;
+};
+typedef struct soa soa;
+
+/**
+ * Cells of checkerboard decomposition, edge of cell is not less than rc and number of cells by axis is even,
+ * so cells of the same colour of 2x2x2 checkerboard do not interact. Particles do not leave their cells
+ * during sweep, grid is shifted randomly before each sweep.
+ */
+struct checkerboard {
+    int cells_per_axis;
+    int cells_count;
+    double edge;
+    double shift[3];
+    /** particles sorted by cell, particles of cell c are particles[start[c]] .. particles[start[c + 1] - 1] */
+    int *start;
+    int *particles;
+    /** cell of each particle and next free place of each cell, they are used by sort */
+    int *cell_of;
+    int *next;
+    /** unique neighbour cells of each cell including itself, 27 at most */
+    int *neighbours;
+    int *neighbour_count;
+    /** cells sorted by colour, cells of colour k are colour_cells[colour_start[k]] .. */
+    int *colour_cells;
+    int colour_start[9];
+};
+typedef struct checkerboard checkerboard;
+
+/**
+ * Cell list of LJ particles, edge of cell is not less than rc, so particle interacts only with particles of
+ * its cell and neighbour cells. Particles of cell are linked list which is updated when particle moves
+ * to other cell, so list is not rebuilt after accepted single-particle move.
+ */
+struct cell_list {
+    int cells_per_axis;
+    int cells_count;
+    double edge;
+    /** first particle of each cell, -1 if cell is empty */
+    int *head;
+    /** next and previous particles of the same cell, -1 at ends of list */
+    int *next;
+    int *prev;
+    int *cell_of;
+    /** unique neighbour cells of each cell including itself, 27 at most */
+    int *neighbours;
+    int *neighbour_count;
+};
+typedef struct cell_list cell_list;
+
+/**
+ * Energy kernels, each of them has compile time specialisations for preset sizes
+ */
+enum kernel_type {
+    KERNEL_LJ,
+    KERNEL_COULOMB,
+    KERNEL_LJ_SIMD,
+    KERNEL_COULOMB_SIMD
+};
+typedef double (*energy_kernel)(dim*, dim*, int*);
+
 /**
  * Prototypes
  */
-void nearest_image(dim *position_arr, dim *nearest);
+template <int N> void nearest_image(dim *position_arr, dim *nearest);
 void init_problem(dim *position_arr, int *charge);
 void mc_method(dim *position_arr, dim *nearest, int *charge);
-double calculate_energy_lj(dim *position_arr, dim *nearest, int *charge);
-double calculate_energy_coulomb(dim *position_arr, dim *nearest, int *charge);
+void mc_single_particle(dim *position_arr, dim *nearest, int *charge);
+bool single_particle_trial(dim *position_arr, dim *nearest, int *charge, double *energy, double temperature,
+    uint64_t step, uint32_t stream, cell_list *list);
+void mc_tempering(dim *position_arr, int *charge);
+bool sample_energy(energy_stats *stats, deviation_controller *controller, int trial, bool accepted, double energy);
+bool sample_trials(energy_stats *stats, deviation_controller *controller, long long first_trial, int trials, int accepted,
+    double energy);
+void report_energy(const energy_stats *stats);
+bool checkerboard_init(checkerboard *board);
+int checkerboard_cell(const checkerboard *board, dim image);
+void checkerboard_sort(checkerboard *board, dim *nearest);
+double cell_particle_energy(const checkerboard *board, dim *nearest, int particle, dim image, int cell);
+void checkerboard_free(checkerboard *board);
+void mc_checkerboard(dim *position_arr, dim *nearest, int *charge);
+void cell_neighbours(int cells_per_axis, int *neighbours, int *neighbour_count);
+bool cell_list_init(cell_list *list);
+int cell_list_cell(const cell_list *list, dim image);
+void cell_list_build(cell_list *list, dim *nearest);
+void cell_list_move(cell_list *list, int particle, int cell);
+double cell_list_energy(const cell_list *list, dim *nearest, int particle, dim image, int cell);
+void cell_list_free(cell_list *list);
+double calculate_energy_lj_cells(dim *position_arr, dim *nearest, int *charge);
+template <int N> float wrap_coordinate(double coordinate);
+double particle_energy(dim *nearest, int *charge, int particle, dim image);
+template <int N> double calculate_energy_lj(dim *position_arr, dim *nearest, int *charge);
+template <int N> double calculate_energy_coulomb(dim *position_arr, dim *nearest, int *charge);
+template <int N> double calculate_energy_lj_simd(dim *position_arr, dim *nearest, int *charge);
+template <int N> double calculate_energy_coulomb_simd(dim *position_arr, dim *nearest, int *charge);
+void init_soa();
+void pack_soa(dim *nearest, int *charge);
+void free_soa();
+template <int N> energy_kernel select_kernel(kernel_type kernel);
+template <int N> bool preset_matches();
+energy_kernel dispatch_kernel(kernel_type kernel);
+bool set_parameter(const char *name, const char *value);
+bool read_config(const char *file_name);
 
 double max_deviation = 0.007;
-double (*calculate_energy)(dim*, dim*, int*);
+/** trial moves use counter-based random numbers of seed, so run is reproduced with the same seed */
+uint64_t seed = 0;
+/** replica exchange runs if there are several replicas, temperatures are from Temperature to t_max */
+int replicas = 1;
+double t_max = 2 * Temperature;
+int exchange_interval = 100;
+/*
+ * Run stops when error of mean energy per particle is below error_target, trial step is adapted to
+ * acceptance_target during the first equilibration trials, 0 disables them
+ */
+double error_target = 0;
+double acceptance_target = 0;
+int equilibration = 0;
+energy_kernel calculate_energy;
 double final_energy = 0;
+bool coulomb = false;
+/** LJ energies are calculated over neighbour cells of cell list, single-particle moves update it */
+bool use_cells = false;
+cell_list cells = {};
+
+/*
+ * Nearest images and charges in float SoA layout for SIMD kernels
+ */
+soa particles_soa = {};
 
 /** @brief mс_cpu.cpp entrypoint
  *
  * @details This is entrypoint for МС simulation
- * @param argv[1] --coulomb or --help or None
+ * @param argv --coulomb, --simd, --single, --checkerboard, --cells, --seed n, --help, parameters or None
  * @return return 0 or -1
  */
 int main(int argc, char *argv[])
 {
-    calculate_energy = calculate_energy_lj;
-    if (argc > 1){
-        if (!strcmp(argv[1], "--coulomb")){
-            calculate_energy = calculate_energy_coulomb;
+    const char usage[] = "Usage: %s [--help][--coulomb][--simd][--single][--checkerboard][--cells][--seed n]"
+        "[--config file][--particles n][--box size][--iterations n][--nmax n][--rc cutoff][--spacing dist]"
+        "[--replicas n][--t_max temperature][--exchange trials]"
+        "[--deviation step][--error target][--acceptance target][--equilibration trials]";
+    bool use_simd = false;
+    /** one particle is moved per trial and only its interactions are recalculated */
+    bool single_particle = false;
+    /** single-particle moves in cells of the same colour run in parallel, LJ only */
+    bool use_checkerboard = false;
+    bool seed_is_set = false;
+    for (int arg = 1; arg < argc; arg++){
+        if (!strcmp(argv[arg], "--coulomb")){
+            coulomb = true;
+        }
+        else if (!strcmp(argv[arg], "--simd")){
+            use_simd = true;
+        }
+        else if (!strcmp(argv[arg], "--single")){
+            single_particle = true;
+        }
+        else if (!strcmp(argv[arg], "--checkerboard")){
+            use_checkerboard = true;
+        }
+        else if (!strcmp(argv[arg], "--cells")){
+            use_cells = true;
+        }
+        else if (!strcmp(argv[arg], "--seed") && (arg + 1 < argc)){
+            seed = strtoull(argv[++arg], NULL, 0);
+            seed_is_set = true;
+        }
+        else if (!strcmp(argv[arg], "--config") && (arg + 1 < argc)){
+            if (!read_config(argv[++arg])){
+                return -1;
+            }
+        }
+        else if (!strncmp(argv[arg], "--", 2) && (arg + 1 < argc) && set_parameter(argv[arg] + 2, argv[arg + 1])){
+            arg++;
         }
         else{
-            if (!strcmp(argv[1], "--help")){
-                printf("Usage: %s [--help][--coulomb]", argv[0]);
+            if (!strcmp(argv[arg], "--help")){
+                printf(usage, argv[0]);
             }
             else{
                 printf("invalid argument\n");
-                printf("Usage: %s [--help][--coulomb]", argv[0]);
+                printf(usage, argv[0]);
                 return -1;
             }
         }
     }
+    if (size_is_set && !spacing_is_set){
+        /** initial lattice must hold all particles */
+        initial_dist_by_one_axis = (box_size - initial_dist_to_edge) / ceil(cbrt((double)particles_count));
+    }
+    if ((acceptance_target > 0) && !equilibration){
+        printf("trial step is adapted only during equilibration, acceptance is not used without equilibration\n");
+    }
+    if (use_checkerboard && coulomb){
+        printf("checkerboard decomposition needs cutoff, it is not used for coulomb\n");
+        use_checkerboard = false;
+    }
+    if (use_cells && coulomb){
+        printf("cell list needs cutoff, it is not used for coulomb\n");
+        use_cells = false;
+    }
+    if ((replicas > 1) && (use_checkerboard || single_particle)){
+        printf("replicas always use single-particle moves, --checkerboard and --single are not used\n");
+        use_checkerboard = false;
+    }
+    kernel_type kernel = coulomb ? KERNEL_COULOMB : KERNEL_LJ;
+    /** float SoA copy of particles is processed SIMD_WIDTH particles at once */
+    if (use_simd){
+        printf("%s SIMD kernels are used\n", SIMD_NAME);
+        init_soa();
+        kernel = coulomb ? KERNEL_COULOMB_SIMD : KERNEL_LJ_SIMD;
+    }
+    calculate_energy = dispatch_kernel(kernel);
+    if (use_cells){
+        if (!cell_list_init(&cells)){
+            return -1;
+        }
+        printf("cell list of %d cells by axis, edge %f\n", cells.cells_per_axis, cells.edge);
+        calculate_energy = calculate_energy_lj_cells;
+    }
     struct timeb start_total_time;
     ftime(&start_total_time);
     time_t t;
-    srand((unsigned)time(&t));
+    if (!seed_is_set){
+        seed = (uint64_t)time(&t);
+    }
+    printf("seed is %llu\n", (unsigned long long)seed);
     dim *position_arr = (dim*)malloc(sizeof(dim) * particles_count);
     dim *nearest = (dim*)malloc(sizeof(dim) * particles_count);
     int *charge = (int*)malloc(sizeof(int) * particles_count);
 
     init_problem(position_arr, charge);
-    mc_method(position_arr, nearest, charge);
+    if (replicas > 1){
+        mc_tempering(position_arr, charge);
+    }
+    else if (use_checkerboard){
+        mc_checkerboard(position_arr, nearest, charge);
+    }
+    else if (single_particle){
+        mc_single_particle(position_arr, nearest, charge);
+    }
+    else{
+        mc_method(position_arr, nearest, charge);
+    }
 
     free(position_arr);
     free(nearest);
     free(charge);
+    free_soa();
+    cell_list_free(&cells);
     struct timeb end_total_time;
     ftime(&end_total_time);
     printf("Total execution time in ms =  %d", (int)((end_total_time.time - start_total_time.time) * 1000 + end_total_time.millitm - start_total_time.millitm));
@@ -89,6 +353,141 @@ int main(int argc, char *argv[])
  * helper functions
  */
 
+/**
+ * @brief set simulation parameter
+ * @param name particles, box, iterations, nmax, rc, spacing, replicas, t_max, exchange, deviation, error,
+ * acceptance or equilibration, parameters.h names are accepted too
+ * @param value value of parameter
+ * @return True if parameter is known and value is valid, False otherwise
+ */
+bool set_parameter(const char *name, const char *value){
+    char *end;
+    double number = strtod(value, &end);
+    if ((end == value) || (*end != '\0') || (number <= 0)){
+        return false;
+    }
+    if (!strcmp(name, "particles") || !strcmp(name, "particles_count")){
+        particles_count = (int)number;
+        size_is_set = true;
+    }
+    else if (!strcmp(name, "box") || !strcmp(name, "box_size")){
+        box_size = number;
+        half_box = number / 2;
+        size_is_set = true;
+    }
+    else if (!strcmp(name, "iterations") || !strcmp(name, "total_it")){
+        total_it = (int)number;
+    }
+    else if (!strcmp(name, "nmax")){
+        nmax = (int)number;
+    }
+    else if (!strcmp(name, "rc")){
+        rc = number;
+    }
+    else if (!strcmp(name, "deviation") || !strcmp(name, "max_deviation")){
+        max_deviation = number;
+    }
+    else if (!strcmp(name, "error")){
+        error_target = number;
+    }
+    else if (!strcmp(name, "acceptance") && (number < 1)){
+        acceptance_target = number;
+    }
+    else if (!strcmp(name, "equilibration")){
+        equilibration = (int)number;
+    }
+    else if (!strcmp(name, "replicas")){
+        replicas = (int)number;
+    }
+    else if (!strcmp(name, "t_max")){
+        t_max = number;
+    }
+    else if (!strcmp(name, "exchange")){
+        exchange_interval = (int)number;
+    }
+    else if (!strcmp(name, "spacing") || !strcmp(name, "initial_dist_by_one_axis")){
+        initial_dist_by_one_axis = number;
+        spacing_is_set = true;
+    }
+    else{
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief read simulation parameters from file, each line is "name value" or "#define name value",
+ * so presets from include directory can be used as config files
+ * @param file_name config file
+ * @return True if file is read, False if error occured
+ */
+bool read_config(const char *file_name){
+    FILE *fp = fopen(file_name, "r");
+    if (!fp){
+        fprintf(stderr, "Failed to open config %s\n", file_name);
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp)){
+        char name[128];
+        char value[128];
+        const char *start = strncmp(line, "#define", 7) ? line : line + 7;
+        if (sscanf(start, "%127s %127s", name, value) != 2){
+            continue;
+        }
+        /** half_box is derived from box_size, constants like Temperature stay compiled in */
+        set_parameter(name, value);
+    }
+    fclose(fp);
+    return true;
+}
+
+/**
+ * @brief choose energy kernel for compile time particles count N, N = 0 is generic runtime size
+ * @param kernel kernel type
+ * @return energy kernel
+ */
+template <int N>
+energy_kernel select_kernel(kernel_type kernel){
+    switch (kernel){
+        case KERNEL_COULOMB: return calculate_energy_coulomb<N>;
+        case KERNEL_LJ_SIMD: return calculate_energy_lj_simd<N>;
+        case KERNEL_COULOMB_SIMD: return calculate_energy_coulomb_simd<N>;
+        default: return calculate_energy_lj<N>;
+    }
+}
+
+/**
+ * @brief specialisation for N particles can be used if box and cutoff were not changed
+ * @return True if runtime values are values of the preset, False otherwise
+ */
+template <int N>
+bool preset_matches(){
+    return (box_size == preset<N>::box()) && (rc == preset<N>::cutoff());
+}
+
+/**
+ * @brief use specialisation for preset particles count if there is one and its constants match, generic kernel otherwise
+ * @param kernel kernel type
+ * @return energy kernel
+ */
+energy_kernel dispatch_kernel(kernel_type kernel){
+    switch (particles_count){
+        case 16: if (preset_matches<16>()) return select_kernel<16>(kernel); break;
+        case 32: if (preset_matches<32>()) return select_kernel<32>(kernel); break;
+        case 64: if (preset_matches<64>()) return select_kernel<64>(kernel); break;
+        case 128: if (preset_matches<128>()) return select_kernel<128>(kernel); break;
+        case 256: if (preset_matches<256>()) return select_kernel<256>(kernel); break;
+        case 512: if (preset_matches<512>()) return select_kernel<512>(kernel); break;
+        case 1024: if (preset_matches<1024>()) return select_kernel<1024>(kernel); break;
+        default:
+            printf("there is no specialisation for %d particles, generic kernel is used\n", particles_count);
+            return select_kernel<0>(kernel);
+    }
+    printf("box or rc differ from preset for %d particles, generic kernel is used\n", particles_count);
+    return select_kernel<0>(kernel);
+}
+
 /**
  * @brief set initial coordinates and charges for all particles
  * @param position_arr Position array
@@ -104,7 +503,7 @@ void init_problem(dim *position_arr, int *charge) {
                     return;
                 }
                 position_arr[count] = { i,j,l };
-                if (calculate_energy == calculate_energy_coulomb){
+                if (coulomb){
                     if (count & 1)
                         charge[count] = 1;
                     else
@@ -126,29 +525,28 @@ void init_problem(dim *position_arr, int *charge) {
  * @param nearest nearest array
  * @return void
  */
+template <int N>
 void nearest_image(dim *position_arr, dim *nearest){
+    const int particles_count = N ? N : ::particles_count;
     for (int i = 0; i < particles_count; i++){
-        float x,y,z;
-        if (position_arr[i].x  > 0){
-            x = fmod(position_arr[i].x + half_box, box_size) - half_box;
-        }
-        else{
-            x = fmod(position_arr[i].x - half_box, box_size) + half_box;
-        }
-        if (position_arr[i].y  > 0){
-            y = fmod(position_arr[i].y + half_box, box_size) - half_box;
-        }
-        else{
-            y = fmod(position_arr[i].y - half_box, box_size) + half_box;
-        }
-        if (position_arr[i].z  > 0){
-            z = fmod(position_arr[i].z + half_box, box_size) - half_box;
-        }
-        else{
-            z = fmod(position_arr[i].z - half_box, box_size) + half_box;
-        }
-        nearest[i] = (dim){ x, y, z};
+        nearest[i] = (dim){ wrap_coordinate<N>(position_arr[i].x), wrap_coordinate<N>(position_arr[i].y),
+            wrap_coordinate<N>(position_arr[i].z)};
+    }
+}
+
+/**
+ * @brief move coordinate into box
+ * @param coordinate coordinate
+ * @return coordinate between -half_box and half_box
+ */
+template <int N>
+float wrap_coordinate(double coordinate){
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    if (coordinate > 0){
+        return fmod(coordinate + half_box, box_size) - half_box;
     }
+    return fmod(coordinate - half_box, box_size) + half_box;
 }
 
 /**
@@ -158,8 +556,13 @@ void nearest_image(dim *position_arr, dim *nearest){
  * @param charge array Charge array
  * @return void
  */
+template <int N>
 double calculate_energy_lj(dim *position_arr, dim *nearest, int *charge){
-    nearest_image(position_arr, nearest);
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    const double rc = preset<N>::cutoff();
+    nearest_image<N>(position_arr, nearest);
     double energy = 0;
     #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
     for (int i = 0; i < particles_count; i++) {
@@ -205,8 +608,12 @@ double calculate_energy_lj(dim *position_arr, dim *nearest, int *charge){
  * @param charge array Charge array
  * @return energy
  */
+template <int N>
 double calculate_energy_coulomb(dim *position_arr, dim *nearest, int *charge){
-    nearest_image(position_arr, nearest);
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    nearest_image<N>(position_arr, nearest);
     double energy = 0;
     #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
     for (int i = 0; i < particles_count; i++) {
@@ -252,47 +659,936 @@ double calculate_energy_coulomb(dim *position_arr, dim *nearest, int *charge){
 }
 
 /**
- * @brief perform MC iterations
+ * @brief allocate SoA arrays
+ * @return void
+ */
+void init_soa(){
+    particles_soa.x = simd_alloc(particles_count);
+    particles_soa.y = simd_alloc(particles_count);
+    particles_soa.z = simd_alloc(particles_count);
+    particles_soa.charge = simd_alloc(particles_count);
+    /** padding is masked in kernels, but it should not contain NaN */
+    int padded = ((particles_count + SIMD_WIDTH - 1) / SIMD_WIDTH) * SIMD_WIDTH;
+    for (int i = particles_count; i < padded; i++){
+        particles_soa.x[i] = 0;
+        particles_soa.y[i] = 0;
+        particles_soa.z[i] = 0;
+        particles_soa.charge[i] = 0;
+    }
+}
+
+/**
+ * @brief free SoA arrays
+ * @return void
+ */
+void free_soa(){
+    free(particles_soa.x);
+    free(particles_soa.y);
+    free(particles_soa.z);
+    free(particles_soa.charge);
+    particles_soa = (soa){};
+}
+
+/**
+ * @brief copy nearest images and charges to SoA arrays
+ * @param nearest nearest array
+ * @param charge Charge array
+ * @return void
+ */
+void pack_soa(dim *nearest, int *charge){
+    for (int i = 0; i < particles_count; i++){
+        particles_soa.x[i] = nearest[i].x;
+        particles_soa.y[i] = nearest[i].y;
+        particles_soa.z[i] = nearest[i].z;
+        particles_soa.charge[i] = coulomb ? charge[i] : 0;
+    }
+}
+
+/**
+ * @brief calculate energy for LJ, SIMD_WIDTH particles j are processed at once
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param charge array Charge array
+ * @return energy
+ */
+template <int N>
+double calculate_energy_lj_simd(dim *position_arr, dim *nearest, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    const double rc = preset<N>::cutoff();
+    nearest_image<N>(position_arr, nearest);
+    pack_soa(nearest, charge);
+    const float *px = particles_soa.x;
+    const float *py = particles_soa.y;
+    const float *pz = particles_soa.z;
+    const vfloat half = v_set(half_box);
+    const vfloat box = v_set(box_size);
+    const vfloat sq_rc = v_set(rc * rc);
+    const vfloat zero = v_set(0);
+    const vfloat one = v_set(1);
+    double energy = 0;
+    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
+    for (int i = 0; i < particles_count; i++) {
+        vfloat xi = v_set(px[i]);
+        vfloat yi = v_set(py[i]);
+        vfloat zi = v_set(pz[i]);
+        vfloat energy_i = zero;
+        for (int j = 0; j < particles_count; j += SIMD_WIDTH) {
+            vfloat x = v_minimum_image(v_sub(v_load(px + j), xi), half, box);
+            vfloat y = v_minimum_image(v_sub(v_load(py + j), yi), half, box);
+            vfloat z = v_minimum_image(v_sub(v_load(pz + j), zi), half, box);
+            vfloat sq_dist = v_fmadd(x, x, v_fmadd(y, y, v_mul(z, z)));
+            vmask mask = v_and(v_valid(j, i, particles_count), v_lt(sq_dist, sq_rc));
+            if (!v_any(mask)) {
+                continue;
+            }
+            vfloat inv_r2 = v_div(one, v_select(mask, sq_dist, one));
+            vfloat inv_r6 = v_mul(v_mul(inv_r2, inv_r2), inv_r2);
+            /** 4 * (1 / r12 - 1 / r6) */
+            energy_i = v_add(energy_i, v_select(mask, v_mul(v_mul(v_set(4), inv_r6), v_sub(inv_r6, one)), zero));
+        }
+        energy += v_reduce_add(energy_i);
+    }
+    /** we consider each interaction twice, so we need to divide by 2 */
+    return energy / 2;
+}
+
+/**
+ * @brief calculate energy for coulomb, SIMD_WIDTH particles j are processed at once
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param charge array Charge array
+ * @return energy
+ */
+template <int N>
+double calculate_energy_coulomb_simd(dim *position_arr, dim *nearest, int *charge){
+    const int particles_count = N ? N : ::particles_count;
+    const double box_size = preset<N>::box();
+    const double half_box = preset<N>::half();
+    nearest_image<N>(position_arr, nearest);
+    pack_soa(nearest, charge);
+    const float *px = particles_soa.x;
+    const float *py = particles_soa.y;
+    const float *pz = particles_soa.z;
+    const float *pq = particles_soa.charge;
+    const vfloat half = v_set(half_box);
+    const vfloat box = v_set(box_size);
+    const vfloat zero = v_set(0);
+    const vfloat one = v_set(1);
+    double energy = 0;
+    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
+    for (int i = 0; i < particles_count; i++) {
+        vfloat xi = v_set(px[i]);
+        vfloat yi = v_set(py[i]);
+        vfloat zi = v_set(pz[i]);
+        vfloat qi = v_set(pq[i]);
+        vfloat energy_i = zero;
+        for (int j = 0; j < particles_count; j += SIMD_WIDTH) {
+            vfloat x = v_minimum_image(v_sub(v_load(px + j), xi), half, box);
+            vfloat y = v_minimum_image(v_sub(v_load(py + j), yi), half, box);
+            vfloat z = v_minimum_image(v_sub(v_load(pz + j), zi), half, box);
+            vfloat qj = v_load(pq + j);
+            vmask mask = v_valid(j, i, particles_count);
+            vfloat dist = v_sqrt(v_select(mask, v_fmadd(x, x, v_fmadd(y, y, v_mul(z, z))), one));
+            vfloat qq = v_select(mask, v_mul(qi, qj), zero);
+            /** erf screening is used if at least one of the charges is negative */
+            vmask screened = v_lt(v_min(qi, qj), zero);
+            vfloat erf_arg = v_mul(dist, v_set(1.0f / SIGMA));
+            vfloat multiplier = v_erf(erf_arg, v_exp(v_sub(zero, v_mul(erf_arg, erf_arg))));
+            energy_i = v_fmadd(v_div(qq, dist), v_select(screened, multiplier, one), energy_i);
+        }
+        energy += v_reduce_add(energy_i);
+    }
+    /** we consider each interaction twice, so we need to divide by 2 */
+    return energy/2;
+}
+
+/**
+ * @brief perform MC iterations, trial configuration is built in preallocated buffer and accepted one
+ * is swapped with it, so steps do not allocate or copy configurations
  * @param position_arr Position array
  * @param nearest nearest array
  * @param charge array Charge array
  * @return void
  */
 void mc_method(dim *position_arr, dim *nearest, int *charge) {
-    double *energy_ar = (double*)malloc(sizeof(double) * nmax);
+    energy_stats stats = {};
+    deviation_controller controller = controller_init(acceptance_target);
     register int i = 0;
     register int good_iter = 0;
     int good_iter_hung = 0;
+    bool converged = false;
     double u1 = calculate_energy(position_arr, nearest, charge);
+    float *uniforms = (float*)malloc(sizeof(float) * 4 * particles_count);
+    dim *current = position_arr;
+    dim *trial = (dim*)malloc(sizeof(dim) * particles_count);
     while (1) {
-        if ((good_iter == nmax) || (i == total_it)) {
-            final_energy = energy_ar[good_iter-1] / particles_count;
-            printf("energy is %f \ngood iters percent %f \n", energy_ar[good_iter-1]/particles_count, (float)good_iter/(float)i);
+        if ((good_iter == nmax) || (i == total_it) || converged) {
+            final_energy = u1 / particles_count;
+            printf("energy is %f \ngood iters percent %f \n", u1/particles_count, (float)good_iter/(float)i);
+            report_energy(&stats);
             break;
         }
-        dim *tmp = (dim*)malloc(sizeof(dim)*particles_count);
-        memcpy(tmp, position_arr, sizeof(dim)*particles_count);
+        /** numbers depend on (seed, step, particle) only, so chunks are independent of number of threads */
+        #pragma omp parallel for num_threads(NUM_THREADS) if (particles_count > MOVES_CHUNK)
+        for (int first = 0; first < particles_count; first += MOVES_CHUNK) {
+            int count = (particles_count - first < MOVES_CHUNK) ? particles_count - first : MOVES_CHUNK;
+            philox_uniform_batch(seed, i, PHILOX_STREAM_MOVE, first, count, uniforms + 4 * first);
+        }
         for (int particle = 0; particle < particles_count; particle++) {
             /** ofsset between -max_deviation/2 and max_deviation/2 */
-            double ex = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            double ey = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            double ez = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            tmp[particle].x = tmp[particle].x + ex;
-            tmp[particle].y = tmp[particle].y + ex;
-            tmp[particle].z = tmp[particle].z + ex;
-        }
-        double u2 = calculate_energy(tmp, nearest, charge);
+            double ex = uniforms[4 * particle] * max_deviation - max_deviation / 2;
+            double ey = uniforms[4 * particle + 1] * max_deviation - max_deviation / 2;
+            double ez = uniforms[4 * particle + 2] * max_deviation - max_deviation / 2;
+            trial[particle].x = current[particle].x + ex;
+            trial[particle].y = current[particle].y + ey;
+            trial[particle].z = current[particle].z + ez;
+        }
+        double u2 = calculate_energy(trial, nearest, charge);
         double deltaU_div_T = (u1 - u2) / Temperature;
         double probability = exp(deltaU_div_T);
-        double rand_0_1 = (double)rand() / (double)RAND_MAX;
-        if ((u2 < u1) || (probability <= rand_0_1)) {
+        double rand_0_1 = philox_uniform(philox_draw(seed, i, 0, PHILOX_STREAM_ACCEPT).v[0]);
+        /** Metropolis probability min(1, exp(-dU/T)) */
+        bool accepted = (u2 < u1) || (rand_0_1 < probability);
+        if (accepted) {
             u1 = u2;
-            memcpy(position_arr, tmp, sizeof(dim)*particles_count);
-            energy_ar[good_iter] = u2;
+            /** rejected trial is overwritten by the next one */
+            dim *swap = current;
+            current = trial;
+            trial = swap;
             good_iter++;
             good_iter_hung++;
         }
+        converged = sample_energy(&stats, &controller, i, accepted, u1);
         i++;
-        free(tmp);
     }
+    /** result is returned in position_arr, it is copied once if the last accepted configuration is in the other buffer */
+    if (current != position_arr) {
+        memcpy(position_arr, current, sizeof(dim) * particles_count);
+        trial = current;
+    }
+    free(trial);
+    free(uniforms);
+}
+
+/**
+ * @brief energy of interaction of one particle with all others, LJ or coulomb
+ * @param nearest nearest array
+ * @param charge array Charge array
+ * @param particle index of particle, its own entry of nearest is skipped
+ * @param image nearest image of particle
+ * @return energy
+ */
+double particle_energy(dim *nearest, int *charge, int particle, dim image){
+    double energy = 0;
+    for (int j = 0; j < particles_count; j++) {
+        if (j == particle) {
+            continue;
+        }
+        float x = nearest[j].x - image.x;
+        float y = nearest[j].y - image.y;
+        float z = nearest[j].z - image.z;
+        /* second part of implementation of periodic boundary conditions */
+        if (x > half_box)
+            x -= box_size;
+        else {
+            if (x < -half_box)
+                x += box_size;
+        }
+        if (y > half_box)
+            y -= box_size;
+        else {
+            if (y < -half_box)
+                y += box_size;
+        }
+        if (z > half_box)
+            z -= box_size;
+        else {
+            if (z < -half_box)
+                z += box_size;
+        }
+        if (coulomb) {
+            double dist = sqrt((double)x * x + (double)y * y + (double)z * z);
+            if ((charge[particle] == -1) || (charge[j] == -1)){
+                energy += charge[particle] * charge[j] * erf(dist / SIGMA) / dist;
+            }
+            else{
+                energy += charge[particle] * charge[j] / dist;
+            }
+        }
+        else {
+            float sq_dist = x * x + y * y + z * z;
+            if (sq_dist < rc * rc) {
+                double r6 = sq_dist * sq_dist * sq_dist;
+                double r12 = r6 * r6;
+                energy += 4 * (1 / r12 - 1 / r6);
+            }
+        }
+    }
+    return energy;
+}
+
+/**
+ * @brief perform MC iterations, each trial moves one random particle, so energy change is
+ * calculated from interactions of this particle only in O(N) instead of O(N^2) total energy
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param charge array Charge array
+ * @return void
+ */
+void mc_single_particle(dim *position_arr, dim *nearest, int *charge) {
+    energy_stats stats = {};
+    deviation_controller controller = controller_init(acceptance_target);
+    int i = 0;
+    int good_iter = 0;
+    bool converged = false;
+    /** full energy is calculated once, it also fills nearest */
+    double u1 = calculate_energy(position_arr, nearest, charge);
+    while (1) {
+        if ((good_iter == nmax) || (i == total_it) || converged) {
+            final_energy = u1 / particles_count;
+            printf("energy is %f \ngood iters percent %f \n", u1/particles_count, (float)good_iter/(float)i);
+            report_energy(&stats);
+            break;
+        }
+        bool accepted = single_particle_trial(position_arr, nearest, charge, &u1, Temperature, i, 0,
+            use_cells ? &cells : NULL);
+        good_iter += accepted;
+        converged = sample_energy(&stats, &controller, i, accepted, u1);
+        i++;
+    }
+}
+
+/**
+ * @brief account trial, during equilibration trial step is adapted to acceptance_target,
+ * after it energy is sampled after each trial, accepted or not
+ * @param stats energy statistics
+ * @param controller controller of trial step
+ * @param trial number of trial
+ * @param accepted True if trial is accepted
+ * @param energy total energy after trial
+ * @return True if error of mean energy per particle is below error_target, False otherwise
+ */
+bool sample_energy(energy_stats *stats, deviation_controller *controller, int trial, bool accepted, double energy){
+    return sample_trials(stats, controller, trial, 1, accepted, energy);
+}
+
+/**
+ * @brief account several trials which end with one energy, e.g. sweep, they are equilibration trials
+ * if the first of them is, see sample_energy
+ * @param stats energy statistics
+ * @param controller controller of trial step
+ * @param first_trial number of the first trial
+ * @param trials number of trials
+ * @param accepted number of accepted trials
+ * @param energy total energy after trials
+ * @return True if error of mean energy per particle is below error_target, False otherwise
+ */
+bool sample_trials(energy_stats *stats, deviation_controller *controller, long long first_trial, int trials, int accepted,
+        double energy){
+    if (first_trial < equilibration){
+        if ((acceptance_target > 0) && controller_update_count(controller, trials, accepted, &max_deviation, half_box)){
+            /** the last value of step is used after equilibration, next update would be after the window is full again */
+            if (first_trial + trials * ((CONVERGENCE_CONTROLLER_WINDOW + trials - 1) / trials) >= equilibration){
+                printf("max_deviation is %f after equilibration\n", max_deviation);
+            }
+        }
+        return false;
+    }
+    stats_add(stats, energy / particles_count);
+    return (error_target > 0) && (stats_error(stats) < error_target);
+}
+
+/**
+ * @brief print mean energy per particle with its error
+ * @param stats energy statistics
+ * @return void
+ */
+void report_energy(const energy_stats *stats){
+    if (stats->levels[0].count < CONVERGENCE_MIN_BLOCKS){
+        return;
+    }
+    printf("mean energy is %f +- %f, %lld samples, statistical inefficiency %f\n", stats_mean(stats),
+        stats_error(stats), stats->samples, stats_inefficiency(stats));
+}
+
+/**
+ * @brief move one random particle and accept move with Metropolis probability min(1, exp(-dU/T))
+ * @param position_arr Position array
+ * @param nearest nearest array, it must correspond to position_arr
+ * @param charge array Charge array
+ * @param energy total energy, it is updated if move is accepted
+ * @param temperature temperature
+ * @param step number of trial
+ * @param stream shift of random streams, 0 for single chain
+ * @param list cell list of nearest, it is updated if move is accepted, NULL if all particles are visited
+ * @return True if move is accepted, False otherwise
+ */
+bool single_particle_trial(dim *position_arr, dim *nearest, int *charge, double *energy, double temperature,
+        uint64_t step, uint32_t stream, cell_list *list) {
+    /** accept stream gives acceptance number and moved particle, move stream gives its offset */
+    philox_block accept = philox_draw(seed, step, 0, stream + PHILOX_STREAM_ACCEPT);
+    int particle = philox_below(accept.v[1], particles_count);
+    philox_block move = philox_draw(seed, step, particle, stream + PHILOX_STREAM_MOVE);
+    /** offset between -max_deviation/2 and max_deviation/2 */
+    dim moved = position_arr[particle];
+    moved.x += philox_uniform(move.v[0]) * max_deviation - max_deviation / 2;
+    moved.y += philox_uniform(move.v[1]) * max_deviation - max_deviation / 2;
+    moved.z += philox_uniform(move.v[2]) * max_deviation - max_deviation / 2;
+    dim image = { wrap_coordinate<0>(moved.x), wrap_coordinate<0>(moved.y), wrap_coordinate<0>(moved.z) };
+    int cell = 0;
+    double delta;
+    if (list) {
+        cell = cell_list_cell(list, image);
+        delta = cell_list_energy(list, nearest, particle, image, cell) -
+            cell_list_energy(list, nearest, particle, nearest[particle], list->cell_of[particle]);
+    }
+    else {
+        delta = particle_energy(nearest, charge, particle, image) -
+            particle_energy(nearest, charge, particle, nearest[particle]);
+    }
+    double rand_0_1 = philox_uniform(accept.v[0]);
+    if ((delta > 0) && (rand_0_1 >= exp(-delta / temperature))) {
+        return false;
+    }
+    /** only moved particle is committed, rejected trial changes nothing */
+    *energy += delta;
+    position_arr[particle] = moved;
+    nearest[particle] = image;
+    if (list) {
+        cell_list_move(list, particle, cell);
+    }
+    return true;
+}
+
+/**
+ * @brief perform replica exchange MC, replicas run single-particle trials at temperatures of their slots
+ * in parallel and exchange configurations every exchange_interval trials, total_it trials are done by each replica
+ * @param position_arr Position array, configuration of the lowest temperature is returned in it
+ * @param charge array Charge array
+ * @return void
+ */
+void mc_tempering(dim *position_arr, int *charge) {
+    const int count = replicas;
+    dim *positions = (dim*)malloc(sizeof(dim) * particles_count * count);
+    dim *nearests = (dim*)malloc(sizeof(dim) * particles_count * count);
+    double *energy = (double*)malloc(sizeof(double) * count);
+    /** each replica has its own cell list */
+    cell_list *lists = use_cells ? (cell_list*)calloc(count, sizeof(cell_list)) : NULL;
+    tempering_ladder ladder = {};
+    if (!positions || !nearests || !energy || (use_cells && !lists) ||
+            !tempering_init(&ladder, count, Temperature, t_max)) {
+        fprintf(stderr, "Failed to allocate replicas\n");
+        exit(1);
+    }
+    /** all replicas start from initial configuration */
+    double u = calculate_energy(position_arr, nearests, charge);
+    for (int replica = 0; replica < count; replica++) {
+        memcpy(positions + replica * particles_count, position_arr, sizeof(dim) * particles_count);
+        /** nearest of the first replica is filled by calculate_energy */
+        if (replica > 0) {
+            memcpy(nearests + replica * particles_count, nearests, sizeof(dim) * particles_count);
+        }
+        energy[replica] = u;
+        if (lists) {
+            if (!cell_list_init(&lists[replica])) {
+                exit(1);
+            }
+            cell_list_build(&lists[replica], nearests + replica * particles_count);
+        }
+    }
+    printf("%d replicas, temperatures from %f to %f, exchange every %d trials\n", count, ladder.temperature[0],
+        ladder.temperature[count - 1], exchange_interval);
+    int rounds = (total_it + exchange_interval - 1) / exchange_interval;
+    for (int round = 0; round < rounds; round++) {
+        /** the last round is shorter if total_it is not multiple of exchange_interval */
+        int round_trials = (total_it - round * exchange_interval < exchange_interval) ?
+            total_it - round * exchange_interval : exchange_interval;
+        /** random streams belong to replica, so result does not depend on threads */
+        #pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic)
+        for (int replica = 0; replica < count; replica++) {
+            int slot = ladder.slot_of[replica];
+            int accepted = 0;
+            for (int trial = 0; trial < round_trials; trial++) {
+                accepted += single_particle_trial(positions + replica * particles_count, nearests + replica * particles_count,
+                    charge, &energy[replica], ladder.temperature[slot], (uint64_t)round * exchange_interval + trial,
+                    PHILOX_REPLICA_STREAMS * (replica + 1), lists ? &lists[replica] : NULL);
+            }
+            ladder.trials[slot] += round_trials;
+            ladder.accepted[slot] += accepted;
+        }
+        tempering_exchange(&ladder, energy, seed, round);
+    }
+    tempering_report(&ladder, energy, particles_count);
+    int coldest = ladder.config_at[0];
+    final_energy = energy[coldest] / particles_count;
+    printf("energy is %f \ngood iters percent %f \n", final_energy, (float)ladder.accepted[0] / (float)ladder.trials[0]);
+    memcpy(position_arr, positions + coldest * particles_count, sizeof(dim) * particles_count);
+    tempering_free(&ladder);
+    for (int replica = 0; lists && (replica < count); replica++) {
+        cell_list_free(&lists[replica]);
+    }
+    free(lists);
+    free(positions);
+    free(nearests);
+    free(energy);
+}
+
+/**
+ * @brief create cells of checkerboard decomposition
+ * @param board checkerboard, output
+ * @return True if box holds at least 2 cells of edge rc by axis, False otherwise
+ */
+bool checkerboard_init(checkerboard *board){
+    int cells_per_axis = (int)(box_size / rc);
+    /** colours alternate through periodic boundary only if number of cells is even */
+    cells_per_axis -= cells_per_axis & 1;
+    if (cells_per_axis < 2){
+        return false;
+    }
+    board->cells_per_axis = cells_per_axis;
+    board->cells_count = cells_per_axis * cells_per_axis * cells_per_axis;
+    board->edge = box_size / cells_per_axis;
+    board->start = (int*)malloc(sizeof(int) * (board->cells_count + 1));
+    board->particles = (int*)malloc(sizeof(int) * particles_count);
+    board->cell_of = (int*)malloc(sizeof(int) * particles_count);
+    board->next = (int*)malloc(sizeof(int) * board->cells_count);
+    board->neighbours = (int*)malloc(sizeof(int) * 27 * board->cells_count);
+    board->neighbour_count = (int*)malloc(sizeof(int) * board->cells_count);
+    board->colour_cells = (int*)malloc(sizeof(int) * board->cells_count);
+    cell_neighbours(cells_per_axis, board->neighbours, board->neighbour_count);
+    int colour_count[8] = {};
+    for (int cell = 0; cell < board->cells_count; cell++){
+        int cx = cell / (cells_per_axis * cells_per_axis);
+        int cy = cell / cells_per_axis % cells_per_axis;
+        int cz = cell % cells_per_axis;
+        colour_count[(cx & 1) * 4 + (cy & 1) * 2 + (cz & 1)]++;
+    }
+    board->colour_start[0] = 0;
+    for (int colour = 0; colour < 8; colour++){
+        board->colour_start[colour + 1] = board->colour_start[colour] + colour_count[colour];
+        colour_count[colour] = board->colour_start[colour];
+    }
+    for (int cell = 0; cell < board->cells_count; cell++){
+        int cx = cell / (cells_per_axis * cells_per_axis);
+        int cy = cell / cells_per_axis % cells_per_axis;
+        int cz = cell % cells_per_axis;
+        board->colour_cells[colour_count[(cx & 1) * 4 + (cy & 1) * 2 + (cz & 1)]++] = cell;
+    }
+    return true;
+}
+
+/**
+ * @brief cell of position in shifted grid
+ * @param board checkerboard
+ * @param image nearest image
+ * @return cell
+ */
+int checkerboard_cell(const checkerboard *board, dim image){
+    const double coordinates[3] = {image.x, image.y, image.z};
+    int cell = 0;
+    for (int axis = 0; axis < 3; axis++){
+        double shifted = coordinates[axis] + half_box - board->shift[axis];
+        if (shifted < 0){
+            shifted += box_size;
+        }
+        else if (shifted >= box_size){
+            shifted -= box_size;
+        }
+        int c = (int)(shifted / board->edge);
+        cell = cell * board->cells_per_axis + ((c < board->cells_per_axis) ? c : board->cells_per_axis - 1);
+    }
+    return cell;
+}
+
+/**
+ * @brief sort particles by cells with counting sort
+ * @param board checkerboard
+ * @param nearest nearest array
+ * @return void
+ */
+void checkerboard_sort(checkerboard *board, dim *nearest){
+    int *cell_of = board->cell_of;
+    memset(board->start, 0, sizeof(int) * (board->cells_count + 1));
+    for (int i = 0; i < particles_count; i++){
+        cell_of[i] = checkerboard_cell(board, nearest[i]);
+        board->start[cell_of[i] + 1]++;
+    }
+    for (int cell = 0; cell < board->cells_count; cell++){
+        board->start[cell + 1] += board->start[cell];
+    }
+    int *next = board->next;
+    memcpy(next, board->start, sizeof(int) * board->cells_count);
+    for (int i = 0; i < particles_count; i++){
+        board->particles[next[cell_of[i]]++] = i;
+    }
+}
+
+/**
+ * @brief LJ energy of interaction of one particle with particles of neighbour cells, others are beyond rc
+ * @param board checkerboard
+ * @param nearest nearest array
+ * @param particle index of particle, its own entry of nearest is skipped
+ * @param image nearest image of particle
+ * @param cell cell of particle
+ * @return energy
+ */
+double cell_particle_energy(const checkerboard *board, dim *nearest, int particle, dim image, int cell){
+    double energy = 0;
+    const int *neighbours = board->neighbours + 27 * cell;
+    for (int n = 0; n < board->neighbour_count[cell]; n++){
+        for (int k = board->start[neighbours[n]]; k < board->start[neighbours[n] + 1]; k++){
+            int j = board->particles[k];
+            if (j == particle){
+                continue;
+            }
+            float x = nearest[j].x - image.x;
+            float y = nearest[j].y - image.y;
+            float z = nearest[j].z - image.z;
+            /* second part of implementation of periodic boundary conditions */
+            if (x > half_box)
+                x -= box_size;
+            else {
+                if (x < -half_box)
+                    x += box_size;
+            }
+            if (y > half_box)
+                y -= box_size;
+            else {
+                if (y < -half_box)
+                    y += box_size;
+            }
+            if (z > half_box)
+                z -= box_size;
+            else {
+                if (z < -half_box)
+                    z += box_size;
+            }
+            float sq_dist = x * x + y * y + z * z;
+            if (sq_dist < rc * rc) {
+                double r6 = sq_dist * sq_dist * sq_dist;
+                double r12 = r6 * r6;
+                energy += 4 * (1 / r12 - 1 / r6);
+            }
+        }
+    }
+    return energy;
+}
+
+/**
+ * @brief release cells
+ * @param board checkerboard
+ * @return void
+ */
+void checkerboard_free(checkerboard *board){
+    free(board->start);
+    free(board->particles);
+    free(board->cell_of);
+    free(board->next);
+    free(board->neighbours);
+    free(board->neighbour_count);
+    free(board->colour_cells);
+    *board = (checkerboard){};
+}
+
+/**
+ * @brief perform MC sweeps with checkerboard decomposition. Each sweep shifts grid randomly, then colours
+ * are visited in random order and cells of one colour are processed by OpenMP threads in parallel,
+ * each cell makes as many single-particle trials as it holds particles. Move which leaves cell is rejected,
+ * so proposal stays symmetric and cells of the same colour never interact. Sweeps are done until total_it trials
+ * or nmax accepted moves, energy is sampled and trial step is adapted once per sweep.
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param charge array Charge array
+ * @return void
+ */
+void mc_checkerboard(dim *position_arr, dim *nearest, int *charge) {
+    checkerboard board = {};
+    if (!checkerboard_init(&board)){
+        printf("box is too small for checkerboard of cells of edge rc, single-particle moves are used\n");
+        mc_single_particle(position_arr, nearest, charge);
+        return;
+    }
+    printf("checkerboard of %d cells by axis, edge %f\n", board.cells_per_axis, board.edge);
+    /** full energy is calculated once, it also fills nearest */
+    double energy = calculate_energy(position_arr, nearest, charge);
+    energy_stats stats = {};
+    deviation_controller controller = controller_init(acceptance_target);
+    bool converged = false;
+    long long trials = 0;
+    long long accepted = 0;
+    for (int sweep = 0; (trials < total_it) && (accepted < nmax) && !converged; sweep++) {
+        /** accept stream of sweep gives shift of grid and order of colours */
+        philox_block shift = philox_draw(seed, sweep, 0, PHILOX_STREAM_ACCEPT);
+        philox_block order = philox_draw(seed, sweep, 1, PHILOX_STREAM_ACCEPT);
+        for (int axis = 0; axis < 3; axis++){
+            board.shift[axis] = philox_uniform(shift.v[axis]) * board.edge;
+        }
+        int colours[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+        for (int k = 7; k > 0; k--){
+            int other = philox_below(order.v[k & 3] ^ (0x9E3779B9u * k), k + 1);
+            int swap = colours[k];
+            colours[k] = colours[other];
+            colours[other] = swap;
+        }
+        checkerboard_sort(&board, nearest);
+        long long sweep_accepted = 0;
+        for (int c = 0; c < 8; c++){
+            int colour = colours[c];
+            double delta_sum = 0;
+            long long accepted_sum = 0;
+            /** particles of other colours do not move, so cells of this colour are independent */
+            #pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic) reduction(+:delta_sum, accepted_sum)
+            for (int k = board.colour_start[colour]; k < board.colour_start[colour + 1]; k++){
+                int cell = board.colour_cells[k];
+                int count = board.start[cell + 1] - board.start[cell];
+                for (int trial = 0; trial < count; trial++){
+                    uint64_t step = (uint64_t)sweep * particles_count + trial;
+                    philox_block accept = philox_draw(seed, step, cell, PHILOX_STREAM_CELL);
+                    philox_block move = philox_draw(seed, step, cell, PHILOX_STREAM_MOVE);
+                    int particle = board.particles[board.start[cell] + philox_below(accept.v[1], count)];
+                    /** offset between -max_deviation/2 and max_deviation/2 */
+                    dim moved = position_arr[particle];
+                    moved.x += philox_uniform(move.v[0]) * max_deviation - max_deviation / 2;
+                    moved.y += philox_uniform(move.v[1]) * max_deviation - max_deviation / 2;
+                    moved.z += philox_uniform(move.v[2]) * max_deviation - max_deviation / 2;
+                    dim image = { wrap_coordinate<0>(moved.x), wrap_coordinate<0>(moved.y), wrap_coordinate<0>(moved.z) };
+                    if (checkerboard_cell(&board, image) != cell){
+                        continue;
+                    }
+                    double delta = cell_particle_energy(&board, nearest, particle, image, cell) -
+                        cell_particle_energy(&board, nearest, particle, nearest[particle], cell);
+                    if ((delta > 0) && (philox_uniform(accept.v[0]) >= exp(-delta / Temperature))){
+                        continue;
+                    }
+                    position_arr[particle] = moved;
+                    nearest[particle] = image;
+                    delta_sum += delta;
+                    accepted_sum++;
+                }
+            }
+            energy += delta_sum;
+            sweep_accepted += accepted_sum;
+        }
+        converged = sample_trials(&stats, &controller, trials, particles_count, sweep_accepted, energy);
+        trials += particles_count;
+        accepted += sweep_accepted;
+    }
+    final_energy = energy / particles_count;
+    printf("energy is %f \ngood iters percent %f \n", final_energy, (float)accepted / (float)trials);
+    report_energy(&stats);
+    checkerboard_free(&board);
+}
+
+/**
+ * @brief unique neighbour cells of each cell of periodic grid, including cell itself
+ * @param cells_per_axis number of cells by axis
+ * @param neighbours 27 entries per cell, output
+ * @param neighbour_count number of neighbours of each cell, output
+ * @return void
+ */
+void cell_neighbours(int cells_per_axis, int *neighbours, int *neighbour_count){
+    for (int cx = 0; cx < cells_per_axis; cx++){
+        for (int cy = 0; cy < cells_per_axis; cy++){
+            for (int cz = 0; cz < cells_per_axis; cz++){
+                int cell = (cx * cells_per_axis + cy) * cells_per_axis + cz;
+                int *cell_neighbours = neighbours + 27 * cell;
+                int count = 0;
+                for (int d = 0; d < 27; d++){
+                    int nx = (cx + d / 9 - 1 + cells_per_axis) % cells_per_axis;
+                    int ny = (cy + d / 3 % 3 - 1 + cells_per_axis) % cells_per_axis;
+                    int nz = (cz + d % 3 - 1 + cells_per_axis) % cells_per_axis;
+                    int neighbour = (nx * cells_per_axis + ny) * cells_per_axis + nz;
+                    /** with less than 3 cells by axis left and right neighbours are the same cell */
+                    bool known = false;
+                    for (int k = 0; k < count; k++){
+                        known = known || (cell_neighbours[k] == neighbour);
+                    }
+                    if (!known){
+                        cell_neighbours[count++] = neighbour;
+                    }
+                }
+                neighbour_count[cell] = count;
+            }
+        }
+    }
+}
+
+/**
+ * @brief create empty cell list of cells of edge rc or more
+ * @param list cell list, output
+ * @return True if allocated, False otherwise
+ */
+bool cell_list_init(cell_list *list){
+    int cells_per_axis = (int)(box_size / rc);
+    list->cells_per_axis = (cells_per_axis > 0) ? cells_per_axis : 1;
+    list->cells_count = list->cells_per_axis * list->cells_per_axis * list->cells_per_axis;
+    list->edge = box_size / list->cells_per_axis;
+    list->head = (int*)malloc(sizeof(int) * list->cells_count);
+    list->next = (int*)malloc(sizeof(int) * particles_count);
+    list->prev = (int*)malloc(sizeof(int) * particles_count);
+    list->cell_of = (int*)malloc(sizeof(int) * particles_count);
+    list->neighbours = (int*)malloc(sizeof(int) * 27 * list->cells_count);
+    list->neighbour_count = (int*)malloc(sizeof(int) * list->cells_count);
+    if (!list->head || !list->next || !list->prev || !list->cell_of || !list->neighbours || !list->neighbour_count){
+        fprintf(stderr, "Failed to allocate cell list\n");
+        return false;
+    }
+    cell_neighbours(list->cells_per_axis, list->neighbours, list->neighbour_count);
+    return true;
+}
+
+/**
+ * @brief cell of position
+ * @param list cell list
+ * @param image nearest image
+ * @return cell
+ */
+int cell_list_cell(const cell_list *list, dim image){
+    const double coordinates[3] = {image.x, image.y, image.z};
+    int cell = 0;
+    for (int axis = 0; axis < 3; axis++){
+        int c = (int)((coordinates[axis] + half_box) / list->edge);
+        /** image on edge of box belongs to the last or the first cell */
+        c = (c < 0) ? 0 : ((c < list->cells_per_axis) ? c : list->cells_per_axis - 1);
+        cell = cell * list->cells_per_axis + c;
+    }
+    return cell;
+}
+
+/**
+ * @brief put all particles into their cells
+ * @param list cell list
+ * @param nearest nearest array
+ * @return void
+ */
+void cell_list_build(cell_list *list, dim *nearest){
+    for (int cell = 0; cell < list->cells_count; cell++){
+        list->head[cell] = -1;
+    }
+    for (int i = 0; i < particles_count; i++){
+        int cell = cell_list_cell(list, nearest[i]);
+        list->cell_of[i] = cell;
+        list->prev[i] = -1;
+        list->next[i] = list->head[cell];
+        if (list->head[cell] >= 0){
+            list->prev[list->head[cell]] = i;
+        }
+        list->head[cell] = i;
+    }
+}
+
+/**
+ * @brief move particle to cell in O(1), nothing is done if it is its cell already
+ * @param list cell list
+ * @param particle index of particle
+ * @param cell new cell of particle
+ * @return void
+ */
+void cell_list_move(cell_list *list, int particle, int cell){
+    int old = list->cell_of[particle];
+    if (old == cell){
+        return;
+    }
+    if (list->prev[particle] >= 0){
+        list->next[list->prev[particle]] = list->next[particle];
+    }
+    else{
+        list->head[old] = list->next[particle];
+    }
+    if (list->next[particle] >= 0){
+        list->prev[list->next[particle]] = list->prev[particle];
+    }
+    list->cell_of[particle] = cell;
+    list->prev[particle] = -1;
+    list->next[particle] = list->head[cell];
+    if (list->head[cell] >= 0){
+        list->prev[list->head[cell]] = particle;
+    }
+    list->head[cell] = particle;
+}
+
+/**
+ * @brief LJ energy of interaction of one particle with particles of neighbour cells, others are beyond rc
+ * @param list cell list
+ * @param nearest nearest array
+ * @param particle index of particle, its own entry of nearest is skipped
+ * @param image nearest image of particle
+ * @param cell cell of image
+ * @return energy
+ */
+double cell_list_energy(const cell_list *list, dim *nearest, int particle, dim image, int cell){
+    double energy = 0;
+    const int *neighbours = list->neighbours + 27 * cell;
+    for (int n = 0; n < list->neighbour_count[cell]; n++){
+        for (int j = list->head[neighbours[n]]; j >= 0; j = list->next[j]){
+            if (j == particle){
+                continue;
+            }
+            float x = nearest[j].x - image.x;
+            float y = nearest[j].y - image.y;
+            float z = nearest[j].z - image.z;
+            /* second part of implementation of periodic boundary conditions */
+            if (x > half_box)
+                x -= box_size;
+            else {
+                if (x < -half_box)
+                    x += box_size;
+            }
+            if (y > half_box)
+                y -= box_size;
+            else {
+                if (y < -half_box)
+                    y += box_size;
+            }
+            if (z > half_box)
+                z -= box_size;
+            else {
+                if (z < -half_box)
+                    z += box_size;
+            }
+            float sq_dist = x * x + y * y + z * z;
+            if (sq_dist < rc * rc) {
+                double r6 = sq_dist * sq_dist * sq_dist;
+                double r12 = r6 * r6;
+                energy += 4 * (1 / r12 - 1 / r6);
+            }
+        }
+    }
+    return energy;
+}
+
+/**
+ * @brief release cell list
+ * @param list cell list
+ * @return void
+ */
+void cell_list_free(cell_list *list){
+    free(list->head);
+    free(list->next);
+    free(list->prev);
+    free(list->cell_of);
+    free(list->neighbours);
+    free(list->neighbour_count);
+    *list = (cell_list){};
+}
+
+/**
+ * @brief calculate energy for LJ over neighbour cells in O(N), cell list is rebuilt from configuration
+ * @param position_arr Position array
+ * @param nearest nearest array
+ * @param charge array Charge array
+ * @return energy
+ */
+double calculate_energy_lj_cells(dim *position_arr, dim *nearest, int *charge){
+    nearest_image<0>(position_arr, nearest);
+    cell_list_build(&cells, nearest);
+    double energy = 0;
+    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
+    for (int i = 0; i < particles_count; i++) {
+        energy += cell_list_energy(&cells, nearest, i, nearest[i], cells.cell_of[i]);
+    }
+    /** we consider each interaction twice, so we need to divide by 2 */
+    return energy/2;
 }
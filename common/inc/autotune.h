@@ -0,0 +1,187 @@
+/**
+ * @file autotune.h
+ * @brief choice of work-group size, vector width and unroll factor of tuned kernels by timing on current device
+ * @details tuned kernel file has kernels base_name, base_name_vec4 and base_name_vec8 which take
+ * WORK_GROUP_SIZE and UNROLL build options. Each variant is built (binaries go to program cache), run
+ * TUNING_RUNS times and the fastest one is stored in TUNING_FILE per device, kernel file and particles count.
+ */
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include "program_cache.h"
+
+/** tuning results, one line per device, kernel and particles count, the last line wins */
+#define TUNING_FILE PROGRAM_CACHE_DIR "/tuning.txt"
+/** maximal work-group size of candidates, buffers for tuning are padded to it */
+#define TUNING_MAX_WORK_GROUP 256
+/** timed runs of each variant after warm-up run */
+#define TUNING_RUNS 5
+
+/**
+ * Parameters of tuned kernel
+ */
+struct tuning_config {
+    int work_group_size;
+    int vector_width;
+    int unroll;
+};
+typedef struct tuning_config tuning_config;
+
+/**
+ * @brief name of kernel for vector width
+ * @param base_name kernel name of scalar variant
+ * @param vector_width 1, 4 or 8
+ * @param name result
+ * @param size size of name
+ * @return name
+ */
+static inline const char *tuning_kernel_name(const char *base_name, int vector_width, char *name, size_t size) {
+    if (vector_width > 1) {
+        snprintf(name, size, "%s_vec%d", base_name, vector_width);
+    }
+    else {
+        snprintf(name, size, "%s", base_name);
+    }
+    return name;
+}
+
+/**
+ * @brief find tuning result
+ * @param kernel_file tuned kernel file name without directory and extension
+ * @param device device
+ * @param count particles count
+ * @param config result
+ * @return True if result is found, False otherwise
+ */
+static inline bool tuning_load(const char *kernel_file, cl_device_id device, int count, tuning_config *config) {
+    FILE *fp = fopen(TUNING_FILE, "r");
+    if (!fp) {
+        return false;
+    }
+    unsigned long long key = program_device_hash(14695981039346656037ULL, device);
+    char line[512];
+    bool found = false;
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long line_key;
+        char name[256];
+        int line_count;
+        tuning_config line_config;
+        if ((sscanf(line, "%llx %255s %d %d %d %d", &line_key, name, &line_count, &line_config.work_group_size,
+                &line_config.vector_width, &line_config.unroll) == 6) && (line_key == key) &&
+                !strcmp(name, kernel_file) && (line_count == count)) {
+            *config = line_config;
+            found = true;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/**
+ * @brief append tuning result
+ * @param kernel_file tuned kernel file name without directory and extension
+ * @param device device
+ * @param count particles count
+ * @param config result
+ * @return void
+ */
+static inline void tuning_store(const char *kernel_file, cl_device_id device, int count, const tuning_config *config) {
+    mkdir(PROGRAM_CACHE_DIR, 0755);
+    FILE *fp = fopen(TUNING_FILE, "a");
+    if (!fp) {
+        fprintf(stderr, "Failed to store tuning result in %s\n", TUNING_FILE);
+        return;
+    }
+    fprintf(fp, "%016llx %s %d %d %d %d\n", (unsigned long long)program_device_hash(14695981039346656037ULL, device),
+        kernel_file, count, config->work_group_size, config->vector_width, config->unroll);
+    fclose(fp);
+}
+
+/**
+ * @brief time all variants of tuned kernel, buffers must be padded to TUNING_MAX_WORK_GROUP
+ * @param context OpenCL context
+ * @param device device of context
+ * @param queue command queue with profiling
+ * @param file_name tuned kernel file
+ * @param header_name parameters header
+ * @param base_name kernel name of scalar variant
+ * @param count particles count
+ * @param args buffer arguments of kernel
+ * @param arg_count number of arguments
+ * @param best the fastest variant
+ * @return True if at least one variant runs, False otherwise
+ */
+static inline bool tuning_run(cl_context context, cl_device_id device, cl_command_queue queue, const char *file_name,
+        const char *header_name, const char *base_name, int count, const cl_mem *args, int arg_count, tuning_config *best) {
+    const int work_group_sizes[] = {32, 64, 128, TUNING_MAX_WORK_GROUP};
+    const int vector_widths[] = {1, 4, 8};
+    const int unrolls[] = {1, 2, 4, 8};
+    size_t max_work_group = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group), &max_work_group, NULL);
+    double best_time = DBL_MAX;
+    for (size_t w = 0; w < sizeof(work_group_sizes) / sizeof(int); w++) {
+        for (size_t v = 0; v < sizeof(vector_widths) / sizeof(int); v++) {
+            for (size_t u = 0; u < sizeof(unrolls) / sizeof(int); u++) {
+                tuning_config config = {work_group_sizes[w], vector_widths[v], unrolls[u]};
+                if (((size_t)config.work_group_size > max_work_group) ||
+                        (config.work_group_size % (config.vector_width * config.unroll))) {
+                    continue;
+                }
+                char options[64];
+                snprintf(options, sizeof(options), "-D WORK_GROUP_SIZE=%d -D UNROLL=%d", config.work_group_size, config.unroll);
+                cl_program program = program_build_cached(context, device, file_name, header_name, options);
+                if (!program) {
+                    continue;
+                }
+                char name[64];
+                cl_int status;
+                cl_kernel kernel = clCreateKernel(program, tuning_kernel_name(base_name, config.vector_width, name, sizeof(name)), &status);
+                size_t kernel_work_group = 0;
+                if (status == CL_SUCCESS) {
+                    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_work_group), &kernel_work_group, NULL);
+                }
+                for (int i = 0; (status == CL_SUCCESS) && (i < arg_count); i++) {
+                    status = clSetKernelArg(kernel, i, sizeof(cl_mem), &args[i]);
+                }
+                /** the fastest of runs, the first one is warm-up */
+                double time = DBL_MAX;
+                size_t global_work_size[1] = {(size_t)((count + config.work_group_size - 1) / config.work_group_size * config.work_group_size)};
+                size_t local_work_size[1] = {(size_t)config.work_group_size};
+                for (int run = 0; (status == CL_SUCCESS) && ((size_t)config.work_group_size <= kernel_work_group) && (run <= TUNING_RUNS); run++) {
+                    cl_event event;
+                    status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global_work_size, local_work_size, 0, NULL, &event);
+                    if (status != CL_SUCCESS) {
+                        break;
+                    }
+                    clWaitForEvents(1, &event);
+                    cl_ulong time_start, time_end;
+                    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+                    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+                    clReleaseEvent(event);
+                    if (run && (time_end - time_start < time)) {
+                        time = time_end - time_start;
+                    }
+                }
+                if (time < DBL_MAX) {
+                    printf("work-group %d, vector %d, unroll %d: %0.3f ms\n", config.work_group_size,
+                        config.vector_width, config.unroll, time / 1000000.0);
+                    if (time < best_time) {
+                        best_time = time;
+                        *best = config;
+                    }
+                }
+                if (kernel) {
+                    clReleaseKernel(kernel);
+                }
+                clReleaseProgram(program);
+            }
+        }
+    }
+    return best_time < DBL_MAX;
+}
+
+#endif
@@ -0,0 +1,173 @@
+/**
+ * @file convergence.h
+ * @brief streaming block averaging of MC energy and acceptance-rate controller of trial step
+ * @details samples are correlated, so error of mean is estimated by blocking (Flyvbjerg-Petersen): level k
+ * averages pairs of blocks of level k - 1, only one pending block and sums of block means are kept per level,
+ * so memory does not depend on run length. Error is the largest one of levels with enough blocks,
+ * statistical inefficiency is ratio of it to naive error of uncorrelated samples.
+ */
+
+#ifndef CONVERGENCE_H
+#define CONVERGENCE_H
+
+#include <math.h>
+
+/** number of levels, the last one has blocks of 2^(CONVERGENCE_LEVELS - 1) samples */
+#define CONVERGENCE_LEVELS 40
+/** level is used for error only if it has this number of blocks */
+#define CONVERGENCE_MIN_BLOCKS 32
+/** trials between updates of trial step */
+#define CONVERGENCE_CONTROLLER_WINDOW 100
+
+/**
+ * Blocks of one level
+ */
+struct block_level {
+    double pending;
+    bool has_pending;
+    long long count;
+    double sum;
+    double sum_sq;
+};
+typedef struct block_level block_level;
+
+/**
+ * Running statistics of samples
+ */
+struct energy_stats {
+    long long samples;
+    block_level levels[CONVERGENCE_LEVELS];
+};
+typedef struct energy_stats energy_stats;
+
+/**
+ * @brief add sample, full blocks are moved to next levels
+ * @param stats statistics
+ * @param value sample
+ * @return void
+ */
+static inline void stats_add(energy_stats *stats, double value) {
+    stats->samples++;
+    for (int level = 0; level < CONVERGENCE_LEVELS; level++) {
+        block_level *block = &stats->levels[level];
+        block->count++;
+        block->sum += value;
+        block->sum_sq += value * value;
+        if (!block->has_pending) {
+            block->pending = value;
+            block->has_pending = true;
+            return;
+        }
+        value = (block->pending + value) / 2;
+        block->has_pending = false;
+    }
+}
+
+/**
+ * @brief mean of samples
+ * @param stats statistics
+ * @return mean
+ */
+static inline double stats_mean(const energy_stats *stats) {
+    return stats->levels[0].count ? stats->levels[0].sum / stats->levels[0].count : 0.;
+}
+
+/**
+ * @brief standard error of mean estimated from blocks of level
+ * @param block level
+ * @return error
+ */
+static inline double stats_level_error(const block_level *block) {
+    double mean = block->sum / block->count;
+    double variance = (block->sum_sq / block->count - mean * mean) * block->count / (block->count - 1);
+    return (variance > 0) ? sqrt(variance / block->count) : 0.;
+}
+
+/**
+ * @brief error of mean, the largest error of levels with at least CONVERGENCE_MIN_BLOCKS blocks
+ * @param stats statistics
+ * @return error, or HUGE_VAL if there are too few samples
+ */
+static inline double stats_error(const energy_stats *stats) {
+    double error = HUGE_VAL;
+    for (int level = 0; (level < CONVERGENCE_LEVELS) && (stats->levels[level].count >= CONVERGENCE_MIN_BLOCKS); level++) {
+        double level_error = stats_level_error(&stats->levels[level]);
+        error = (level == 0) || (level_error > error) ? level_error : error;
+    }
+    return error;
+}
+
+/**
+ * @brief statistical inefficiency, number of correlated samples per independent one
+ * @param stats statistics
+ * @return inefficiency, 1 for uncorrelated samples
+ */
+static inline double stats_inefficiency(const energy_stats *stats) {
+    if (stats->levels[0].count < CONVERGENCE_MIN_BLOCKS) {
+        return 1.;
+    }
+    double naive = stats_level_error(&stats->levels[0]);
+    double error = stats_error(stats);
+    return (naive > 0) ? (error / naive) * (error / naive) : 1.;
+}
+
+/**
+ * Controller of trial step, it keeps acceptance ratio near target during equilibration
+ */
+struct deviation_controller {
+    double target;
+    /** trials between updates of step */
+    int window;
+    int trials;
+    int accepted;
+};
+typedef struct deviation_controller deviation_controller;
+
+/**
+ * @brief controller with empty window
+ * @param target target acceptance ratio
+ * @return controller
+ */
+static inline deviation_controller controller_init(double target) {
+    deviation_controller controller = {target, CONVERGENCE_CONTROLLER_WINDOW, 0, 0};
+    return controller;
+}
+
+/**
+ * @brief count trials and scale step by acceptance / target after each window, change is limited
+ * to factor 2 per window
+ * @param controller controller
+ * @param trials number of trials
+ * @param accepted number of accepted trials
+ * @param deviation trial step, it is updated
+ * @param max_value upper bound of step
+ * @return True if step is updated, False otherwise
+ */
+static inline bool controller_update_count(deviation_controller *controller, int trials, int accepted, double *deviation,
+        double max_value) {
+    controller->trials += trials;
+    controller->accepted += accepted;
+    if (controller->trials < controller->window) {
+        return false;
+    }
+    double ratio = (double)controller->accepted / controller->trials / controller->target;
+    ratio = (ratio < 0.5) ? 0.5 : ((ratio > 2.) ? 2. : ratio);
+    *deviation = (*deviation * ratio < max_value) ? *deviation * ratio : max_value;
+    controller->trials = 0;
+    controller->accepted = 0;
+    return true;
+}
+
+/**
+ * @brief count one trial, see controller_update_count
+ * @param controller controller
+ * @param accepted True if trial is accepted
+ * @param deviation trial step, it is updated
+ * @param max_value upper bound of step
+ * @return True if step is updated, False otherwise
+ */
+static inline bool controller_update(deviation_controller *controller, bool accepted, double *deviation, double max_value) {
+    return controller_update_count(controller, 1, accepted, deviation, max_value);
+}
+
+#endif
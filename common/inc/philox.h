@@ -0,0 +1,149 @@
+/**
+ * @file philox.h
+ * @brief Philox4x32-10 counter-based random numbers for MC trial moves
+ * @details each number is a pure function of (seed, step, index, stream), so particles can be moved
+ * in any order, by any number of OpenMP threads or by OpenCL work-items with the same result.
+ * mc_random.cl has the same generator for kernels, uniform floats are exact conversions of 24 high bits,
+ * so host and device streams are bit-identical.
+ */
+
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <stdint.h>
+
+/** Philox4x32 multipliers and Weyl constants of key schedule */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+/** counters of batch which are processed together, loops over them are vectorized by compiler */
+#define PHILOX_BATCH 8
+
+/** streams of one step, index of move stream is particle, index of accept stream is 0 */
+#define PHILOX_STREAM_MOVE 0
+#define PHILOX_STREAM_ACCEPT 1
+/** replica exchange, index is slot of ladder */
+#define PHILOX_STREAM_EXCHANGE 2
+/** trials of checkerboard cells, index is cell */
+#define PHILOX_STREAM_CELL 3
+/** streams of replica r are shifted by PHILOX_REPLICA_STREAMS * (r + 1) */
+#define PHILOX_REPLICA_STREAMS 4
+
+/**
+ * Four random 32-bit words of one counter
+ */
+struct philox_block {
+    uint32_t v[4];
+};
+typedef struct philox_block philox_block;
+
+/**
+ * @brief one Philox round
+ * @param c counter, it is replaced with result
+ * @param k0 first word of key
+ * @param k1 second word of key
+ * @return void
+ */
+static inline void philox_round(uint32_t c[4], uint32_t k0, uint32_t k1) {
+    uint64_t p0 = (uint64_t)PHILOX_M0 * c[0];
+    uint64_t p1 = (uint64_t)PHILOX_M1 * c[2];
+    uint32_t r0 = (uint32_t)(p1 >> 32) ^ c[1] ^ k0;
+    uint32_t r2 = (uint32_t)(p0 >> 32) ^ c[3] ^ k1;
+    c[0] = r0;
+    c[1] = (uint32_t)p1;
+    c[2] = r2;
+    c[3] = (uint32_t)p0;
+}
+
+/**
+ * @brief random block of counter (index, stream, step) with key seed
+ * @param seed seed of run
+ * @param step MC step
+ * @param index particle or other index inside step
+ * @param stream PHILOX_STREAM_MOVE, PHILOX_STREAM_ACCEPT or other stream
+ * @return random block
+ */
+static inline philox_block philox_draw(uint64_t seed, uint64_t step, uint32_t index, uint32_t stream) {
+    philox_block block = {{index, stream, (uint32_t)step, (uint32_t)(step >> 32)}};
+    uint32_t k0 = (uint32_t)seed;
+    uint32_t k1 = (uint32_t)(seed >> 32);
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        philox_round(block.v, k0, k1);
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    return block;
+}
+
+/**
+ * @brief uniform float from random word, 24 high bits are converted exactly
+ * @param x random word
+ * @return number in [0, 1)
+ */
+static inline float philox_uniform(uint32_t x) {
+    return (float)(x >> 8) * (1.0f / 16777216.0f);
+}
+
+/**
+ * @brief uniform integer below n from random word without division
+ * @param x random word
+ * @param n upper bound
+ * @return number in [0, n)
+ */
+static inline uint32_t philox_below(uint32_t x, uint32_t n) {
+    return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+/**
+ * @brief 4 uniform floats for each of indices first .. first + count - 1, PHILOX_BATCH counters
+ * are processed together in SoA layout, so rounds are vectorized
+ * @param seed seed of run
+ * @param step MC step
+ * @param stream stream
+ * @param first first index
+ * @param count number of indices
+ * @param out 4 * count floats, out[4 * i + l] is word l of index first + i
+ * @return void
+ */
+static inline void philox_uniform_batch(uint64_t seed, uint64_t step, uint32_t stream, uint32_t first, int count, float *out) {
+    const uint32_t key0 = (uint32_t)seed;
+    const uint32_t key1 = (uint32_t)(seed >> 32);
+    for (int start = 0; start < count; start += PHILOX_BATCH) {
+        uint32_t c0[PHILOX_BATCH], c1[PHILOX_BATCH], c2[PHILOX_BATCH], c3[PHILOX_BATCH];
+        for (int lane = 0; lane < PHILOX_BATCH; lane++) {
+            c0[lane] = first + start + lane;
+            c1[lane] = stream;
+            c2[lane] = (uint32_t)step;
+            c3[lane] = (uint32_t)(step >> 32);
+        }
+        uint32_t k0 = key0;
+        uint32_t k1 = key1;
+        for (int round = 0; round < PHILOX_ROUNDS; round++) {
+            #pragma omp simd
+            for (int lane = 0; lane < PHILOX_BATCH; lane++) {
+                uint64_t p0 = (uint64_t)PHILOX_M0 * c0[lane];
+                uint64_t p1 = (uint64_t)PHILOX_M1 * c2[lane];
+                uint32_t r0 = (uint32_t)(p1 >> 32) ^ c1[lane] ^ k0;
+                uint32_t r2 = (uint32_t)(p0 >> 32) ^ c3[lane] ^ k1;
+                c0[lane] = r0;
+                c1[lane] = (uint32_t)p1;
+                c2[lane] = r2;
+                c3[lane] = (uint32_t)p0;
+            }
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        int lanes = (count - start < PHILOX_BATCH) ? count - start : PHILOX_BATCH;
+        for (int lane = 0; lane < lanes; lane++) {
+            float *value = out + 4 * (start + lane);
+            value[0] = philox_uniform(c0[lane]);
+            value[1] = philox_uniform(c1[lane]);
+            value[2] = philox_uniform(c2[lane]);
+            value[3] = philox_uniform(c3[lane]);
+        }
+    }
+}
+
+#endif
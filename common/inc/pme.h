@@ -0,0 +1,345 @@
+/**
+ * @file pme.h
+ * @brief reciprocal part of smooth particle-mesh Ewald (PME) for coulomb potential
+ * @details charges are spread to K x K x K grid with cubic B-splines, grid is transformed
+ * with 3D FFT, multiplied by influence function and transformed back, forces are interpolated
+ * back to particles. K must be a power of two. Real space part with cutoff is calculated by
+ * OpenMP implementation or OpenCL kernel, see pme_real_space() for pair term.
+ * Like other kernels of this project, gradient of energy is accumulated as "force".
+ */
+
+#ifndef PME_H
+#define PME_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+/** order of B-splines, 4 is cubic */
+#define PME_ORDER 4
+/** maximal grid size by one axis */
+#define PME_MAX_GRID 1024
+/** erfc(PME_BETA_RC) = 1e-5, real space is cut at rc */
+#define PME_BETA_RC 3.123
+
+/**
+ * PME grid and precalculated tables
+ */
+struct pme_grid {
+    int size;
+    double box;
+    double beta;
+    double *grid;
+    double *influence;
+    double *twiddle;
+};
+typedef struct pme_grid pme_grid;
+
+/**
+ * @brief default grid size, spacing is not more than 1 / (2 * beta)
+ * @param box box edge
+ * @param beta Ewald splitting parameter
+ * @return power of two grid size
+ */
+static inline int pme_default_size(double box, double beta) {
+    int size = 8;
+    while ((size < 2 * beta * box) && (size < PME_MAX_GRID)) {
+        size *= 2;
+    }
+    return size;
+}
+
+/**
+ * @brief cubic B-spline weights and derivatives for PME_ORDER grid points below u
+ * @param u fractional coordinate in grid units
+ * @param theta weights for points floor(u) - j, j = 0..3
+ * @param dtheta derivatives of weights by u
+ * @return void
+ */
+static inline void pme_bspline(double u, double *theta, double *dtheta) {
+    double w = u - floor(u);
+    theta[0] = w * w * w / 6;
+    theta[1] = (((-3 * w + 3) * w + 3) * w + 1) / 6;
+    theta[2] = ((3 * w - 6) * w * w + 4) / 6;
+    theta[3] = (1 - w) * (1 - w) * (1 - w) / 6;
+    dtheta[0] = w * w / 2;
+    dtheta[1] = ((-3 * w + 2) * w + 1) / 2;
+    dtheta[2] = (3 * w - 4) * w / 2;
+    dtheta[3] = -(1 - w) * (1 - w) / 2;
+}
+
+/**
+ * @brief in-place radix-2 FFT of contiguous complex array
+ * @param data interleaved real and imaginary parts, n complex numbers
+ * @param n length, power of two
+ * @param twiddle cos and sin of 2 * pi * k / n, k < n / 2
+ * @param sign 1 for forward, -1 for backward transform, backward is not normalized
+ * @return void
+ */
+static inline void pme_fft_1d(double *data, int n, const double *twiddle, int sign) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            double re = data[2 * i];
+            double im = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < len / 2; k++) {
+                double w_re = twiddle[2 * k * step];
+                double w_im = sign * twiddle[2 * k * step + 1];
+                double *a = data + 2 * (i + k);
+                double *b = data + 2 * (i + k + len / 2);
+                double t_re = b[0] * w_re - b[1] * w_im;
+                double t_im = b[0] * w_im + b[1] * w_re;
+                b[0] = a[0] - t_re;
+                b[1] = a[1] - t_im;
+                a[0] += t_re;
+                a[1] += t_im;
+            }
+        }
+    }
+}
+
+/**
+ * @brief 3D FFT of PME grid, lines of each axis are transformed in parallel
+ * @param pme PME grid
+ * @param sign 1 for forward, -1 for backward transform
+ * @return void
+ */
+static inline void pme_fft_3d(pme_grid *pme, int sign) {
+    const int n = pme->size;
+    /** stride of axis in complex numbers */
+    const int strides[3] = {n * n, n, 1};
+    for (int axis = 0; axis < 3; axis++) {
+        const int stride = strides[axis];
+        const int other_a = strides[(axis + 1) % 3];
+        const int other_b = strides[(axis + 2) % 3];
+        #pragma omp parallel for
+        for (int line = 0; line < n * n; line++) {
+            double buffer[2 * PME_MAX_GRID];
+            double *start = pme->grid + 2 * ((line / n) * other_a + (line % n) * other_b);
+            for (int k = 0; k < n; k++) {
+                buffer[2 * k] = start[2 * k * stride];
+                buffer[2 * k + 1] = start[2 * k * stride + 1];
+            }
+            pme_fft_1d(buffer, n, pme->twiddle, sign);
+            for (int k = 0; k < n; k++) {
+                start[2 * k * stride] = buffer[2 * k];
+                start[2 * k * stride + 1] = buffer[2 * k + 1];
+            }
+        }
+    }
+}
+
+/**
+ * @brief allocate grid and precalculate influence function
+ * @param pme PME grid
+ * @param size grid size by one axis, power of two
+ * @param box box edge
+ * @param beta Ewald splitting parameter
+ * @return True if initialized successfully, False if size is not valid
+ */
+static inline bool pme_init(pme_grid *pme, int size, double box, double beta) {
+    if ((size < PME_ORDER) || (size > PME_MAX_GRID) || (size & (size - 1))) {
+        fprintf(stderr, "PME grid size must be power of two between %d and %d\n", PME_ORDER, PME_MAX_GRID);
+        return false;
+    }
+    pme->size = size;
+    pme->box = box;
+    pme->beta = beta;
+    pme->grid = (double*)malloc(sizeof(double) * 2 * size * size * size);
+    pme->influence = (double*)malloc(sizeof(double) * size * size * size);
+    pme->twiddle = (double*)malloc(sizeof(double) * size);
+    for (int k = 0; k < size / 2; k++) {
+        pme->twiddle[2 * k] = cos(2 * M_PI * k / size);
+        pme->twiddle[2 * k + 1] = sin(2 * M_PI * k / size);
+    }
+    /** squared moduli of B-spline Euler exponential factors */
+    double *bsp_mod = (double*)malloc(sizeof(double) * size);
+    double theta[PME_ORDER];
+    double dtheta[PME_ORDER];
+    pme_bspline(0, theta, dtheta);
+    for (int m = 0; m < size; m++) {
+        double re = 0;
+        double im = 0;
+        for (int k = 0; k < PME_ORDER - 1; k++) {
+            /** M(k + 1) is weight of point u - k - 1 for integer u */
+            double weight = theta[k + 1];
+            re += weight * cos(2 * M_PI * m * k / size);
+            im += weight * sin(2 * M_PI * m * k / size);
+        }
+        bsp_mod[m] = 1 / (re * re + im * im);
+    }
+    double volume = box * box * box;
+    for (int m1 = 0; m1 < size; m1++) {
+        for (int m2 = 0; m2 < size; m2++) {
+            for (int m3 = 0; m3 < size; m3++) {
+                double mx = (m1 <= size / 2 ? m1 : m1 - size) / box;
+                double my = (m2 <= size / 2 ? m2 : m2 - size) / box;
+                double mz = (m3 <= size / 2 ? m3 : m3 - size) / box;
+                double sq_m = mx * mx + my * my + mz * mz;
+                double value = 0;
+                if (sq_m > 0) {
+                    value = exp(-M_PI * M_PI * sq_m / (beta * beta)) / (M_PI * volume * sq_m)
+                        * bsp_mod[m1] * bsp_mod[m2] * bsp_mod[m3];
+                }
+                pme->influence[(m1 * size + m2) * size + m3] = value;
+            }
+        }
+    }
+    free(bsp_mod);
+    return true;
+}
+
+/**
+ * @brief free PME grid
+ * @param pme PME grid
+ * @return void
+ */
+static inline void pme_free(pme_grid *pme) {
+    free(pme->grid);
+    free(pme->influence);
+    free(pme->twiddle);
+    memset(pme, 0, sizeof(pme_grid));
+}
+
+/**
+ * @brief screened pair term of real space part, it is cut at rc
+ * @details pair potential is erf(r / SIGMA) / r if one of charges is negative and 1 / r otherwise,
+ * erf(beta * r) / r of it goes to reciprocal part
+ * @param dist distance
+ * @param screened erf(r / SIGMA) screening is used
+ * @param beta Ewald splitting parameter
+ * @param sigma SIGMA
+ * @param derivative_erf DERIVATIVE_ERF
+ * @param force multiplier of distance vector for "force", output
+ * @return energy for unit charges
+ */
+static inline double pme_real_space(double dist, bool screened, double beta, double sigma, double derivative_erf, double *force) {
+    double sq_dist = dist * dist;
+    double ewald = erf(beta * dist);
+    double ewald_derivative = 2 * beta / sqrt(M_PI) * exp(-beta * beta * sq_dist);
+    double potential = 1;
+    double derivative = 0;
+    if (screened) {
+        double erf_arg = dist / sigma;
+        potential = erf(erf_arg);
+        derivative = derivative_erf * exp(-erf_arg * erf_arg);
+    }
+    *force = -(derivative - ewald_derivative) / sq_dist + (potential - ewald) / (sq_dist * dist);
+    return (potential - ewald) / dist;
+}
+
+/**
+ * @brief reciprocal, self and neutralizing background energies, their gradient is added to force
+ * @param pme PME grid
+ * @param nearest nearest images in [-box / 2, box / 2]
+ * @param charge Charge array
+ * @param count particles count
+ * @param force force array, gradient is added to it
+ * @return energy
+ */
+template <typename vec3>
+static inline double pme_reciprocal(pme_grid *pme, const vec3 *nearest, const int *charge, int count, vec3 *force) {
+    const int n = pme->size;
+    const double scale = n / pme->box;
+    const double half = pme->box / 2;
+    memset(pme->grid, 0, sizeof(double) * 2 * n * n * n);
+    /** spread charges */
+    #pragma omp parallel for
+    for (int i = 0; i < count; i++) {
+        double tx[PME_ORDER], ty[PME_ORDER], tz[PME_ORDER], unused[PME_ORDER];
+        double ux = (nearest[i].x + half) * scale;
+        double uy = (nearest[i].y + half) * scale;
+        double uz = (nearest[i].z + half) * scale;
+        pme_bspline(ux, tx, unused);
+        pme_bspline(uy, ty, unused);
+        pme_bspline(uz, tz, unused);
+        int kx = (int)floor(ux);
+        int ky = (int)floor(uy);
+        int kz = (int)floor(uz);
+        for (int a = 0; a < PME_ORDER; a++) {
+            int gx = ((kx - a) % n + n) % n;
+            for (int b = 0; b < PME_ORDER; b++) {
+                int gy = ((ky - b) % n + n) % n;
+                for (int c = 0; c < PME_ORDER; c++) {
+                    int gz = ((kz - c) % n + n) % n;
+                    double value = charge[i] * tx[a] * ty[b] * tz[c];
+                    #pragma omp atomic
+                    pme->grid[2 * ((gx * n + gy) * n + gz)] += value;
+                }
+            }
+        }
+    }
+    pme_fft_3d(pme, 1);
+    /** convolution with influence function */
+    double energy = 0;
+    #pragma omp parallel for reduction(+:energy)
+    for (int m = 0; m < n * n * n; m++) {
+        double re = pme->grid[2 * m];
+        double im = pme->grid[2 * m + 1];
+        energy += pme->influence[m] * (re * re + im * im);
+        pme->grid[2 * m] = re * pme->influence[m];
+        pme->grid[2 * m + 1] = im * pme->influence[m];
+    }
+    energy /= 2;
+    pme_fft_3d(pme, -1);
+    /** interpolate potential gradient back to particles */
+    #pragma omp parallel for
+    for (int i = 0; i < count; i++) {
+        double tx[PME_ORDER], ty[PME_ORDER], tz[PME_ORDER];
+        double dx[PME_ORDER], dy[PME_ORDER], dz[PME_ORDER];
+        double ux = (nearest[i].x + half) * scale;
+        double uy = (nearest[i].y + half) * scale;
+        double uz = (nearest[i].z + half) * scale;
+        pme_bspline(ux, tx, dx);
+        pme_bspline(uy, ty, dy);
+        pme_bspline(uz, tz, dz);
+        int kx = (int)floor(ux);
+        int ky = (int)floor(uy);
+        int kz = (int)floor(uz);
+        double gradient_x = 0;
+        double gradient_y = 0;
+        double gradient_z = 0;
+        for (int a = 0; a < PME_ORDER; a++) {
+            int gx = ((kx - a) % n + n) % n;
+            for (int b = 0; b < PME_ORDER; b++) {
+                int gy = ((ky - b) % n + n) % n;
+                for (int c = 0; c < PME_ORDER; c++) {
+                    int gz = ((kz - c) % n + n) % n;
+                    double potential = pme->grid[2 * ((gx * n + gy) * n + gz)];
+                    gradient_x += dx[a] * ty[b] * tz[c] * potential;
+                    gradient_y += tx[a] * dy[b] * tz[c] * potential;
+                    gradient_z += tx[a] * ty[b] * dz[c] * potential;
+                }
+            }
+        }
+        force[i].x += charge[i] * scale * gradient_x;
+        force[i].y += charge[i] * scale * gradient_y;
+        force[i].z += charge[i] * scale * gradient_z;
+    }
+    /** self energy and neutralizing background for non-neutral systems */
+    double sq_charge = 0;
+    double total_charge = 0;
+    for (int i = 0; i < count; i++) {
+        sq_charge += charge[i] * charge[i];
+        total_charge += charge[i];
+    }
+    energy -= pme->beta / sqrt(M_PI) * sq_charge;
+    energy -= M_PI * total_charge * total_charge / (2 * pme->beta * pme->beta * pme->box * pme->box * pme->box);
+    return energy;
+}
+
+#endif
@@ -0,0 +1,249 @@
+/**
+ * @file program_cache.h
+ * @brief on-disk cache of OpenCL program binaries for hosts which build kernels from source
+ * @details simulation parameters from parameters.h are passed to compiler as -D options instead of being
+ * glued into the source. Binary is stored in PROGRAM_CACHE_DIR under a name with FNV-1a hash of source,
+ * options and device, so any change of them leads to a new build. Binary which cannot be loaded or built
+ * (e.g. after driver update) is rebuilt from source and overwritten.
+ */
+
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "CL/opencl.h"
+
+/** directory for cached binaries, it is created on first build */
+#define PROGRAM_CACHE_DIR "./cache"
+/** maximal length of build options */
+#define PROGRAM_OPTIONS_SIZE 1024
+
+/**
+ * @brief FNV-1a hash of data, can be chained
+ * @param hash previous hash, 14695981039346656037 for the first call
+ * @param data data
+ * @param size size of data in bytes
+ * @return hash
+ */
+static inline uint64_t program_hash(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief add device to hash, device is identified by name, version and driver version
+ * @param hash previous hash
+ * @param device device
+ * @return hash
+ */
+static inline uint64_t program_device_hash(uint64_t hash, cl_device_id device) {
+    char device_info[3][256] = {};
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_info[0]), device_info[0], NULL);
+    clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(device_info[1]), device_info[1], NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(device_info[2]), device_info[2], NULL);
+    return program_hash(hash, device_info, sizeof(device_info));
+}
+
+/**
+ * @brief read whole file
+ * @param file_name file name
+ * @param size size of file, output
+ * @return zero terminated content which must be released with free, NULL if file cannot be read
+ */
+static inline char *program_read_file(const char *file_name, size_t *size) {
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *content = (char*)malloc(length + 1);
+    if (!content || (fread(content, 1, length, fp) != (size_t)length)) {
+        free(content);
+        fclose(fp);
+        return NULL;
+    }
+    content[length] = '\0';
+    fclose(fp);
+    *size = length;
+    return content;
+}
+
+/**
+ * @brief load kernel source, preprocessor lines are removed because parameters come from build options
+ * and NVIDIA OpenCL cannot use "#include" inside kernel code
+ * @param file_name kernel file name
+ * @return zero terminated source which must be released with free, NULL if file cannot be read
+ */
+static inline char *program_load_source(const char *file_name) {
+    size_t size;
+    char *source = program_read_file(file_name, &size);
+    if (!source) {
+        return NULL;
+    }
+    size_t count = 0;
+    bool skip = false;
+    for (size_t i = 0; i < size; i++) {
+        if (source[i] == '#') {
+            skip = true;
+        }
+        if (source[i] == '\n') {
+            skip = false;
+        }
+        if (!skip) {
+            source[count++] = source[i];
+        }
+    }
+    source[count] = '\0';
+    return source;
+}
+
+/**
+ * @brief convert "#define name value" lines of parameters header to "-D name=value" build options
+ * @param header_name parameters header
+ * @param extra options which are appended after parameters
+ * @param options result, PROGRAM_OPTIONS_SIZE bytes
+ * @return True if header is read, False otherwise
+ */
+static inline bool program_build_options(const char *header_name, const char *extra, char *options) {
+    FILE *fp = fopen(header_name, "r");
+    if (!fp) {
+        return false;
+    }
+    char line[256];
+    size_t length = 0;
+    options[0] = '\0';
+    while (fgets(line, sizeof(line), fp)) {
+        char name[128];
+        char value[128];
+        if (sscanf(line, " #define %127s %127s", name, value) == 2) {
+            length += snprintf(options + length, PROGRAM_OPTIONS_SIZE - length, "-D %s=%s ", name, value);
+            if (length >= PROGRAM_OPTIONS_SIZE) {
+                fclose(fp);
+                return false;
+            }
+        }
+    }
+    fclose(fp);
+    snprintf(options + length, PROGRAM_OPTIONS_SIZE - length, "%s", extra);
+    return true;
+}
+
+/**
+ * @brief print build log of program
+ * @param program program
+ * @param device device
+ * @return void
+ */
+static inline void program_print_log(cl_program program, cl_device_id device) {
+    size_t size = 0;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size);
+    char *log = (char*)malloc(size + 1);
+    if (log && (clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, log, NULL) == CL_SUCCESS)) {
+        log[size] = '\0';
+        fprintf(stderr, "%s\n", log);
+    }
+    free(log);
+}
+
+/**
+ * @brief store program binary in cache
+ * @param program built program for one device
+ * @param path cache file
+ * @return void
+ */
+static inline void program_store_binary(cl_program program, const char *path) {
+    size_t size = 0;
+    if ((clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS) || !size) {
+        return;
+    }
+    unsigned char *binary = (unsigned char*)malloc(size);
+    if (binary && (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) == CL_SUCCESS)) {
+        mkdir(PROGRAM_CACHE_DIR, 0755);
+        FILE *fp = fopen(path, "wb");
+        if (fp) {
+            fwrite(binary, 1, size, fp);
+            fclose(fp);
+        }
+    }
+    free(binary);
+}
+
+/**
+ * @brief create and build program, binary from cache is used if there is one
+ * @param context OpenCL context
+ * @param device device of context
+ * @param file_name kernel source
+ * @param header_name parameters header, its defines are passed as build options
+ * @param extra extra build options
+ * @return built program, NULL if error occured
+ */
+static inline cl_program program_build_cached(cl_context context, cl_device_id device, const char *file_name,
+        const char *header_name, const char *extra) {
+    cl_int status;
+    char options[PROGRAM_OPTIONS_SIZE];
+    if (!program_build_options(header_name, extra, options)) {
+        fprintf(stderr, "Failed to load kernel header %s.\n", header_name);
+        return NULL;
+    }
+    char *source = program_load_source(file_name);
+    if (!source) {
+        fprintf(stderr, "Failed to load kernel %s.\n", file_name);
+        return NULL;
+    }
+
+    uint64_t hash = program_hash(14695981039346656037ULL, source, strlen(source) + 1);
+    hash = program_hash(hash, options, strlen(options) + 1);
+    hash = program_device_hash(hash, device);
+    const char *base_name = strrchr(file_name, '/') ? strrchr(file_name, '/') + 1 : file_name;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s-%016llx.bin", PROGRAM_CACHE_DIR, base_name, (unsigned long long)hash);
+
+    size_t size;
+    unsigned char *binary = (unsigned char*)program_read_file(path, &size);
+    if (binary) {
+        cl_int binary_status;
+        cl_program program = clCreateProgramWithBinary(context, 1, &device, &size,
+            (const unsigned char **)&binary, &binary_status, &status);
+        free(binary);
+        if ((status == CL_SUCCESS) && (binary_status == CL_SUCCESS)) {
+            if (clBuildProgram(program, 1, &device, options, NULL, NULL) == CL_SUCCESS) {
+                printf("Using cached program: %s\n", path);
+                free(source);
+                return program;
+            }
+        }
+        if (program) {
+            clReleaseProgram(program);
+        }
+    }
+
+    const char *sources[1] = {source};
+    cl_program program = clCreateProgramWithSource(context, 1, sources, NULL, &status);
+    free(source);
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "Failed to create program from %s: %d\n", file_name, status);
+        return NULL;
+    }
+    status = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "Failed to build program %s: %d\n", file_name, status);
+        program_print_log(program, device);
+        clReleaseProgram(program);
+        return NULL;
+    }
+    program_store_binary(program, path);
+    return program;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/**
+ * @file reduce.cl
+ * @brief OpenCL kernels which sum energy array on device, float and compensated (Neumaier) variants
+ * @details first pass sums input to one value per work-group, second pass runs with one work-group
+ * and sums partial values, so only one value is read by host. Work-group size must be a power of two.
+ * Kernels are shared by MD and MC hosts, see reduce.h.
+ */
+
+/**
+ * @brief tree reduction of local memory, result is in scratch[0]
+ * @param scratch one value per work-item
+ * @return void
+ */
+void tree_reduce(__local float *scratch) {
+    int local_id = get_local_id(0);
+    for (int stride = get_local_size(0) / 2; stride > 0; stride /= 2) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (local_id < stride)
+            scratch[local_id] += scratch[local_id + stride];
+    }
+}
+
+/**
+ * @brief OpenCL kernel for float sum
+ * @param input Array to sum, energy array for the first pass and partial sums for the second one
+ * @param output Sum of work-group
+ * @param scratch Local memory of work-group size
+ * @param count Length of input
+ * @return void
+ */
+__kernel void reduce(__global const float *restrict input,
+                     __global float *restrict output,
+                     __local float *scratch,
+                     const int count) {
+
+    float sum = 0;
+    for (int i = get_global_id(0); i < count; i += get_global_size(0))
+        sum += input[i];
+    scratch[get_local_id(0)] = sum;
+    tree_reduce(scratch);
+    if (get_local_id(0) == 0)
+        output[get_group_id(0)] = scratch[0];
+}
+
+/**
+ * @brief add value to compensated sum, Neumaier variant of Kahan summation
+ * @param sum sum in x and lost low-order part in y
+ * @param value value
+ * @return new sum
+ */
+float2 add_compensated(float2 sum, float value) {
+    float t = sum.x + value;
+    float lost;
+    if (fabs(sum.x) >= fabs(value))
+        lost = (sum.x - t) + value;
+    else
+        lost = (value - t) + sum.x;
+    return (float2)(t, sum.y + lost);
+}
+
+/**
+ * @brief tree reduction of compensated sums in local memory, result is in scratch[0]
+ * @param scratch one sum per work-item
+ * @return void
+ */
+void tree_reduce_compensated(__local float2 *scratch) {
+    int local_id = get_local_id(0);
+    for (int stride = get_local_size(0) / 2; stride > 0; stride /= 2) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (local_id < stride) {
+            float2 sum = add_compensated(scratch[local_id], scratch[local_id + stride].x);
+            sum.y += scratch[local_id + stride].y;
+            scratch[local_id] = sum;
+        }
+    }
+}
+
+/**
+ * @brief OpenCL kernel for compensated sum, first pass
+ * @param input Array to sum
+ * @param output Compensated sum of work-group
+ * @param scratch Local memory of work-group size
+ * @param count Length of input
+ * @return void
+ */
+__kernel void reduce_compensated(__global const float *restrict input,
+                                 __global float2 *restrict output,
+                                 __local float2 *scratch,
+                                 const int count) {
+
+    float2 sum = (float2)(0, 0);
+    for (int i = get_global_id(0); i < count; i += get_global_size(0))
+        sum = add_compensated(sum, input[i]);
+    scratch[get_local_id(0)] = sum;
+    tree_reduce_compensated(scratch);
+    if (get_local_id(0) == 0)
+        output[get_group_id(0)] = scratch[0];
+}
+
+/**
+ * @brief OpenCL kernel for compensated sum, second pass
+ * @param input Compensated sums of work-groups
+ * @param output Compensated sum, host adds its parts in double
+ * @param scratch Local memory of work-group size
+ * @param count Length of input
+ * @return void
+ */
+__kernel void reduce_compensated_final(__global const float2 *restrict input,
+                                       __global float2 *restrict output,
+                                       __local float2 *scratch,
+                                       const int count) {
+
+    float2 sum = (float2)(0, 0);
+    for (int i = get_global_id(0); i < count; i += get_global_size(0)) {
+        sum = add_compensated(sum, input[i].x);
+        sum.y += input[i].y;
+    }
+    scratch[get_local_id(0)] = sum;
+    tree_reduce_compensated(scratch);
+    if (get_local_id(0) == 0)
+        output[get_group_id(0)] = scratch[0];
+}
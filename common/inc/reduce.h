@@ -0,0 +1,193 @@
+/**
+ * @file reduce.h
+ * @brief sum of energy array on device, host reads one value instead of one value per particle
+ * @details kernels are in reduce.cl next to this header. First pass sums input with REDUCTION_MAX_GROUPS
+ * work-groups at most, second pass sums partial values with one work-group. Compensated variant keeps
+ * lost low-order part of sum, so its error does not grow with number of particles.
+ */
+
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <stdio.h>
+#include "CL/opencl.h"
+#include "trace.h"
+
+/** maximal work-group size of reduction, it is decreased to power of two supported by device */
+#define REDUCTION_MAX_LOCAL 256
+/** maximal number of partial sums, second pass handles them with one work-group */
+#define REDUCTION_MAX_GROUPS 64
+/** reduction kernels file without extension, relative to device directory of host */
+#define REDUCTION_PROGRAM "../../common/inc/reduce"
+
+/**
+ * Reduction kernels and buffers
+ */
+struct energy_reduction {
+    bool compensated;
+    size_t local_size;
+    cl_kernel partial_kernel;
+    cl_kernel final_kernel;
+    cl_mem partial_buf;
+    cl_mem result_buf;
+};
+typedef struct energy_reduction energy_reduction;
+
+/**
+ * @brief create reduction kernels and buffers
+ * @param reduction reduction, output
+ * @param context OpenCL context
+ * @param device device of context
+ * @param program program built from reduction kernels
+ * @param compensated compensated sum if True, float sum otherwise
+ * @return True if initialized successfully, False if error occured
+ */
+static inline bool reduction_init(energy_reduction *reduction, cl_context context, cl_device_id device,
+        cl_program program, bool compensated) {
+    cl_int status;
+    reduction->compensated = compensated;
+    size_t value_size = compensated ? sizeof(cl_float2) : sizeof(cl_float);
+    reduction->partial_kernel = clCreateKernel(program, compensated ? "reduce_compensated" : "reduce", &status);
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "Failed to create reduction kernel: %d\n", status);
+        return false;
+    }
+    reduction->final_kernel = clCreateKernel(program, compensated ? "reduce_compensated_final" : "reduce", &status);
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "Failed to create final reduction kernel: %d\n", status);
+        return false;
+    }
+    /** work-group size is limited by device and by both kernels, kernel limit can be lower than device one */
+    size_t max_local = REDUCTION_MAX_LOCAL;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_local), &max_local, NULL);
+    const cl_kernel kernels[2] = {reduction->partial_kernel, reduction->final_kernel};
+    for (int k = 0; k < 2; k++) {
+        size_t kernel_local = max_local;
+        if (clGetKernelWorkGroupInfo(kernels[k], device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_local),
+                &kernel_local, NULL) == CL_SUCCESS) {
+            max_local = (kernel_local < max_local) ? kernel_local : max_local;
+        }
+    }
+    reduction->local_size = 1;
+    while ((reduction->local_size * 2 <= max_local) && (reduction->local_size * 2 <= REDUCTION_MAX_LOCAL)) {
+        reduction->local_size *= 2;
+    }
+    reduction->partial_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, REDUCTION_MAX_GROUPS * value_size, NULL, &status);
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "Failed to create buffer for partial sums: %d\n", status);
+        return false;
+    }
+    reduction->result_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, value_size, NULL, &status);
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "Failed to create buffer for sum: %d\n", status);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief set arguments and enqueue one pass of reduction
+ * @param reduction reduction
+ * @param queue command queue
+ * @param kernel partial or final kernel
+ * @param input input buffer
+ * @param output output buffer
+ * @param count length of input
+ * @param groups number of work-groups
+ * @param wait_count length of wait_list
+ * @param wait_list events to wait for
+ * @param event event of kernel, output
+ * @return OpenCL status
+ */
+static inline cl_int reduction_pass(energy_reduction *reduction, cl_command_queue queue, cl_kernel kernel, cl_mem input,
+        cl_mem output, cl_int count, size_t groups, cl_uint wait_count, const cl_event *wait_list, cl_event *event) {
+    size_t value_size = reduction->compensated ? sizeof(cl_float2) : sizeof(cl_float);
+    size_t global_work_size[1] = {groups * reduction->local_size};
+    size_t local_work_size[1] = {reduction->local_size};
+    cl_int status = clSetKernelArg(kernel, 0, sizeof(cl_mem), &input);
+    if (status == CL_SUCCESS) {
+        status = clSetKernelArg(kernel, 1, sizeof(cl_mem), &output);
+    }
+    if (status == CL_SUCCESS) {
+        status = clSetKernelArg(kernel, 2, reduction->local_size * value_size, NULL);
+    }
+    if (status == CL_SUCCESS) {
+        status = clSetKernelArg(kernel, 3, sizeof(cl_int), &count);
+    }
+    if (status != CL_SUCCESS) {
+        return status;
+    }
+    return clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global_work_size, local_work_size, wait_count, wait_list, event);
+}
+
+/**
+ * @brief sum array on device and read the sum, queue must be in-order
+ * @param reduction reduction
+ * @param queue command queue
+ * @param input buffer of floats
+ * @param count number of floats to sum
+ * @param wait_count length of wait_list
+ * @param wait_list events to wait for, e.g. kernel which writes input
+ * @param track trace track of queue, both passes and read of sum are recorded in it
+ * @param sum sum, output
+ * @return OpenCL status
+ */
+static inline cl_int reduction_sum(energy_reduction *reduction, cl_command_queue queue, cl_mem input, int count,
+        cl_uint wait_count, const cl_event *wait_list, int track, double *sum) {
+    size_t groups = (count + reduction->local_size - 1) / reduction->local_size;
+    if (groups > REDUCTION_MAX_GROUPS) {
+        groups = REDUCTION_MAX_GROUPS;
+    }
+    cl_event partial_event;
+    cl_event final_event;
+    cl_event read_event;
+    cl_int status = reduction_pass(reduction, queue, reduction->partial_kernel, input, reduction->partial_buf,
+        count, groups, wait_count, wait_list, &partial_event);
+    if (status != CL_SUCCESS) {
+        return status;
+    }
+    status = reduction_pass(reduction, queue, reduction->final_kernel, reduction->partial_buf, reduction->result_buf,
+        (cl_int)groups, 1, 0, NULL, &final_event);
+    if (status != CL_SUCCESS) {
+        clReleaseEvent(partial_event);
+        return status;
+    }
+    cl_float result[2] = {0, 0};
+    status = clEnqueueReadBuffer(queue, reduction->result_buf, CL_TRUE, 0,
+        reduction->compensated ? sizeof(cl_float2) : sizeof(cl_float), result, 0, NULL, &read_event);
+    /** low-order part of compensated sum is added in double */
+    *sum = (double)result[0] + (double)result[1];
+    /** read is blocking, so all commands are complete */
+    trace_cl_event(partial_event, "reduce partial", track);
+    trace_cl_event(final_event, "reduce final", track);
+    clReleaseEvent(partial_event);
+    clReleaseEvent(final_event);
+    if (status == CL_SUCCESS) {
+        trace_cl_event(read_event, "read sum", track);
+        clReleaseEvent(read_event);
+    }
+    return status;
+}
+
+/**
+ * @brief release reduction kernels and buffers
+ * @param reduction reduction
+ * @return void
+ */
+static inline void reduction_free(energy_reduction *reduction) {
+    if (reduction->partial_kernel) {
+        clReleaseKernel(reduction->partial_kernel);
+    }
+    if (reduction->final_kernel) {
+        clReleaseKernel(reduction->final_kernel);
+    }
+    if (reduction->partial_buf) {
+        clReleaseMemObject(reduction->partial_buf);
+    }
+    if (reduction->result_buf) {
+        clReleaseMemObject(reduction->result_buf);
+    }
+    *reduction = (energy_reduction){};
+}
+
+#endif
@@ -0,0 +1,192 @@
+/**
+ * @file simd.h
+ * @brief thin wrappers over AVX-512, AVX2 and scalar floats for OpenMP implementations
+ * @details width of vector is chosen at compile time from -march flags,
+ * SIMD_WIDTH is 16 for AVX-512, 8 for AVX2 and 1 for scalar fallback
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdlib.h>
+#include <math.h>
+#if defined(__AVX512F__) || defined(__AVX2__)
+    #include <immintrin.h>
+#endif
+
+/** alignment of SoA arrays in bytes, one cache line */
+#define SIMD_ALIGNMENT 64
+
+#if defined(__AVX512F__)
+    #define SIMD_WIDTH 16
+    #define SIMD_NAME "AVX-512"
+    typedef __m512 vfloat;
+    typedef __mmask16 vmask;
+
+    static inline vfloat v_set(float a) { return _mm512_set1_ps(a); }
+    static inline vfloat v_load(const float *p) { return _mm512_load_ps(p); }
+    static inline vfloat v_add(vfloat a, vfloat b) { return _mm512_add_ps(a, b); }
+    static inline vfloat v_sub(vfloat a, vfloat b) { return _mm512_sub_ps(a, b); }
+    static inline vfloat v_mul(vfloat a, vfloat b) { return _mm512_mul_ps(a, b); }
+    static inline vfloat v_div(vfloat a, vfloat b) { return _mm512_div_ps(a, b); }
+    static inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return _mm512_fmadd_ps(a, b, c); }
+    static inline vfloat v_sqrt(vfloat a) { return _mm512_sqrt_ps(a); }
+    static inline vfloat v_floor(vfloat a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+    static inline vfloat v_min(vfloat a, vfloat b) { return _mm512_min_ps(a, b); }
+    static inline vfloat v_max(vfloat a, vfloat b) { return _mm512_max_ps(a, b); }
+    static inline vmask v_gt(vfloat a, vfloat b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    static inline vmask v_lt(vfloat a, vfloat b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    static inline vmask v_and(vmask a, vmask b) { return a & b; }
+    /** a where mask is set, b otherwise */
+    static inline vfloat v_select(vmask mask, vfloat a, vfloat b) { return _mm512_mask_blend_ps(mask, b, a); }
+    static inline bool v_any(vmask mask) { return mask != 0; }
+    static inline float v_reduce_add(vfloat a) { return _mm512_reduce_add_ps(a); }
+    /** 2^n for integral n */
+    static inline vfloat v_pow2n(vfloat n) {
+        __m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+        return _mm512_castsi512_ps(e);
+    }
+    /** lanes j, j + 1, ... which are less than n and not equal to i */
+    static inline vmask v_valid(int j, int i, int n) {
+        __m512i index = _mm512_add_epi32(_mm512_set1_epi32(j),
+            _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+        return _mm512_cmplt_epi32_mask(index, _mm512_set1_epi32(n)) & _mm512_cmpneq_epi32_mask(index, _mm512_set1_epi32(i));
+    }
+#elif defined(__AVX2__)
+    #define SIMD_WIDTH 8
+    #define SIMD_NAME "AVX2"
+    typedef __m256 vfloat;
+    typedef __m256 vmask;
+
+    static inline vfloat v_set(float a) { return _mm256_set1_ps(a); }
+    static inline vfloat v_load(const float *p) { return _mm256_load_ps(p); }
+    static inline vfloat v_add(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+    static inline vfloat v_sub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+    static inline vfloat v_mul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+    static inline vfloat v_div(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+    #ifdef __FMA__
+        static inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return _mm256_fmadd_ps(a, b, c); }
+    #else
+        static inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+    #endif
+    static inline vfloat v_sqrt(vfloat a) { return _mm256_sqrt_ps(a); }
+    static inline vfloat v_floor(vfloat a) { return _mm256_floor_ps(a); }
+    static inline vfloat v_min(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+    static inline vfloat v_max(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+    static inline vmask v_gt(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static inline vmask v_lt(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static inline vmask v_and(vmask a, vmask b) { return _mm256_and_ps(a, b); }
+    /** a where mask is set, b otherwise */
+    static inline vfloat v_select(vmask mask, vfloat a, vfloat b) { return _mm256_blendv_ps(b, a, mask); }
+    static inline bool v_any(vmask mask) { return _mm256_movemask_ps(mask) != 0; }
+    static inline float v_reduce_add(vfloat a) {
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+    }
+    /** 2^n for integral n */
+    static inline vfloat v_pow2n(vfloat n) {
+        __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+        return _mm256_castsi256_ps(e);
+    }
+    /** lanes j, j + 1, ... which are less than n and not equal to i */
+    static inline vmask v_valid(int j, int i, int n) {
+        __m256i index = _mm256_add_epi32(_mm256_set1_epi32(j), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+        __m256i less = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), index);
+        __m256i equal = _mm256_cmpeq_epi32(index, _mm256_set1_epi32(i));
+        return _mm256_castsi256_ps(_mm256_andnot_si256(equal, less));
+    }
+#else
+    #define SIMD_WIDTH 1
+    #define SIMD_NAME "scalar"
+    typedef float vfloat;
+    typedef bool vmask;
+
+    static inline vfloat v_set(float a) { return a; }
+    static inline vfloat v_load(const float *p) { return *p; }
+    static inline vfloat v_add(vfloat a, vfloat b) { return a + b; }
+    static inline vfloat v_sub(vfloat a, vfloat b) { return a - b; }
+    static inline vfloat v_mul(vfloat a, vfloat b) { return a * b; }
+    static inline vfloat v_div(vfloat a, vfloat b) { return a / b; }
+    static inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return a * b + c; }
+    static inline vfloat v_sqrt(vfloat a) { return sqrtf(a); }
+    static inline vfloat v_floor(vfloat a) { return floorf(a); }
+    static inline vfloat v_min(vfloat a, vfloat b) { return a < b ? a : b; }
+    static inline vfloat v_max(vfloat a, vfloat b) { return a > b ? a : b; }
+    static inline vmask v_gt(vfloat a, vfloat b) { return a > b; }
+    static inline vmask v_lt(vfloat a, vfloat b) { return a < b; }
+    static inline vmask v_and(vmask a, vmask b) { return a && b; }
+    /** a where mask is set, b otherwise */
+    static inline vfloat v_select(vmask mask, vfloat a, vfloat b) { return mask ? a : b; }
+    static inline bool v_any(vmask mask) { return mask; }
+    static inline float v_reduce_add(vfloat a) { return a; }
+    /** 2^n for integral n */
+    static inline vfloat v_pow2n(vfloat n) { return ldexpf(1.0f, (int)n); }
+    /** lane j which is less than n and not equal to i */
+    static inline vmask v_valid(int j, int i, int n) { return (j < n) && (j != i); }
+#endif
+
+/**
+ * @brief minimum image of difference of coordinates, second part of periodic boundary conditions
+ * @param x difference of coordinates
+ * @param half half of box edge
+ * @param box box edge
+ * @return difference in [-half, half]
+ */
+static inline vfloat v_minimum_image(vfloat x, vfloat half, vfloat box) {
+    x = v_select(v_gt(x, half), v_sub(x, box), x);
+    return v_select(v_lt(x, v_sub(v_set(0), half)), v_add(x, box), x);
+}
+
+/**
+ * @brief exponent, Cephes expf polynomial, relative error is about 2e-7
+ * @param x argument
+ * @return e^x
+ */
+static inline vfloat v_exp(vfloat x) {
+    x = v_min(v_max(x, v_set(-87.3f)), v_set(88.3f));
+    vfloat n = v_floor(v_fmadd(x, v_set(1.44269504088896341f), v_set(0.5f)));
+    x = v_sub(x, v_mul(n, v_set(0.693359375f)));
+    x = v_sub(x, v_mul(n, v_set(-2.12194440e-4f)));
+    vfloat y = v_set(1.9875691500E-4f);
+    y = v_fmadd(y, x, v_set(1.3981999507E-3f));
+    y = v_fmadd(y, x, v_set(8.3334519073E-3f));
+    y = v_fmadd(y, x, v_set(4.1665795894E-2f));
+    y = v_fmadd(y, x, v_set(1.6666665459E-1f));
+    y = v_fmadd(y, x, v_set(5.0000001201E-1f));
+    y = v_fmadd(y, v_mul(x, x), v_add(x, v_set(1)));
+    return v_mul(y, v_pow2n(n));
+}
+
+/**
+ * @brief error function for non-negative argument, Abramowitz and Stegun 7.1.26, absolute error is below 1.5e-7
+ * @param x argument, x >= 0
+ * @param exp_minus_sq e^(-x^2), it is needed for force too so it is passed from outside
+ * @return erf(x)
+ */
+static inline vfloat v_erf(vfloat x, vfloat exp_minus_sq) {
+    vfloat t = v_div(v_set(1), v_fmadd(x, v_set(0.3275911f), v_set(1)));
+    vfloat y = v_set(1.061405429f);
+    y = v_fmadd(y, t, v_set(-1.453152027f));
+    y = v_fmadd(y, t, v_set(1.421413741f));
+    y = v_fmadd(y, t, v_set(-0.284496736f));
+    y = v_fmadd(y, t, v_set(0.254829592f));
+    return v_sub(v_set(1), v_mul(v_mul(y, t), exp_minus_sq));
+}
+
+/**
+ * @brief allocate array for SIMD loads, size is padded to SIMD_WIDTH
+ * @param count number of floats
+ * @return pointer, must be released with free
+ */
+static inline float *simd_alloc(int count) {
+    void *result = NULL;
+    size_t padded = ((count + SIMD_WIDTH - 1) / SIMD_WIDTH) * SIMD_WIDTH;
+    if (posix_memalign(&result, SIMD_ALIGNMENT, sizeof(float) * (padded ? padded : 1))) {
+        return NULL;
+    }
+    return (float*)result;
+}
+
+#endif
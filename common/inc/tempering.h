@@ -0,0 +1,132 @@
+/**
+ * @file tempering.h
+ * @brief temperature ladder and replica exchange (parallel tempering) for MC
+ * @details each replica is a configuration which runs MC at temperature of its slot of ladder,
+ * slots are geometric from the lowest to the highest temperature. Exchange rounds alternate between even
+ * and odd pairs of neighbouring slots and swap configurations with Metropolis probability
+ * min(1, exp((1/T_i - 1/T_j)(U_i - U_j))), so the lowest slot samples its temperature while
+ * configurations travel through hot slots.
+ */
+
+#ifndef TEMPERING_H
+#define TEMPERING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "philox.h"
+
+/**
+ * Ladder of temperatures and statistics of slots
+ */
+struct tempering_ladder {
+    int count;
+    double *temperature;
+    /** configuration at slot and slot of configuration */
+    int *config_at;
+    int *slot_of;
+    /** MC trials and accepted moves at slot */
+    long long *trials;
+    long long *accepted;
+    /** exchange attempts and accepted exchanges between slot and slot + 1 */
+    long long *exchange_attempts;
+    long long *exchange_accepted;
+};
+typedef struct tempering_ladder tempering_ladder;
+
+/**
+ * @brief allocate ladder of geometric temperatures, configuration i starts at slot i
+ * @param ladder ladder, output
+ * @param count number of replicas
+ * @param t_min the lowest temperature
+ * @param t_max the highest temperature
+ * @return True if allocated, False otherwise
+ */
+static inline bool tempering_init(tempering_ladder *ladder, int count, double t_min, double t_max) {
+    ladder->count = count;
+    ladder->temperature = (double*)malloc(sizeof(double) * count);
+    ladder->config_at = (int*)malloc(sizeof(int) * count);
+    ladder->slot_of = (int*)malloc(sizeof(int) * count);
+    ladder->trials = (long long*)calloc(count, sizeof(long long));
+    ladder->accepted = (long long*)calloc(count, sizeof(long long));
+    ladder->exchange_attempts = (long long*)calloc(count, sizeof(long long));
+    ladder->exchange_accepted = (long long*)calloc(count, sizeof(long long));
+    if (!ladder->temperature || !ladder->config_at || !ladder->slot_of || !ladder->trials || !ladder->accepted ||
+            !ladder->exchange_attempts || !ladder->exchange_accepted) {
+        fprintf(stderr, "Failed to allocate temperature ladder\n");
+        return false;
+    }
+    for (int slot = 0; slot < count; slot++) {
+        ladder->temperature[slot] = (count > 1) ? t_min * pow(t_max / t_min, (double)slot / (count - 1)) : t_min;
+        ladder->config_at[slot] = slot;
+        ladder->slot_of[slot] = slot;
+    }
+    return true;
+}
+
+/**
+ * @brief one exchange round, pairs (0, 1), (2, 3), ... in even rounds and (1, 2), (3, 4), ... in odd rounds
+ * @param ladder ladder
+ * @param energy energy of each configuration
+ * @param seed seed of run
+ * @param round number of round
+ * @return number of accepted exchanges
+ */
+static inline int tempering_exchange(tempering_ladder *ladder, const double *energy, uint64_t seed, uint64_t round) {
+    int exchanged = 0;
+    for (int slot = (int)(round & 1); slot + 1 < ladder->count; slot += 2) {
+        int a = ladder->config_at[slot];
+        int b = ladder->config_at[slot + 1];
+        double delta = (1 / ladder->temperature[slot] - 1 / ladder->temperature[slot + 1]) * (energy[a] - energy[b]);
+        double rand_0_1 = philox_uniform(philox_draw(seed, round, slot, PHILOX_STREAM_EXCHANGE).v[0]);
+        ladder->exchange_attempts[slot]++;
+        if ((delta >= 0) || (rand_0_1 < exp(delta))) {
+            ladder->config_at[slot] = b;
+            ladder->config_at[slot + 1] = a;
+            ladder->slot_of[a] = slot + 1;
+            ladder->slot_of[b] = slot;
+            ladder->exchange_accepted[slot]++;
+            exchanged++;
+        }
+    }
+    return exchanged;
+}
+
+/**
+ * @brief print acceptance of MC moves and exchanges of each slot
+ * @param ladder ladder
+ * @param energy energy of each configuration
+ * @param count particles count, energy is printed per particle
+ * @return void
+ */
+static inline void tempering_report(const tempering_ladder *ladder, const double *energy, int count) {
+    printf("slot  temperature  energy      moves accepted  exchanges accepted\n");
+    for (int slot = 0; slot < ladder->count; slot++) {
+        printf("%4d  %11.4f  %10.6f  %14.4f", slot, ladder->temperature[slot],
+            energy[ladder->config_at[slot]] / count,
+            ladder->trials[slot] ? (double)ladder->accepted[slot] / ladder->trials[slot] : 0.);
+        if (slot + 1 < ladder->count) {
+            printf("  %18.4f", ladder->exchange_attempts[slot] ?
+                (double)ladder->exchange_accepted[slot] / ladder->exchange_attempts[slot] : 0.);
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * @brief release ladder
+ * @param ladder ladder
+ * @return void
+ */
+static inline void tempering_free(tempering_ladder *ladder) {
+    free(ladder->temperature);
+    free(ladder->config_at);
+    free(ladder->slot_of);
+    free(ladder->trials);
+    free(ladder->accepted);
+    free(ladder->exchange_attempts);
+    free(ladder->exchange_accepted);
+    *ladder = (tempering_ladder){};
+}
+
+#endif
@@ -0,0 +1,205 @@
+/**
+ * @file trace.h
+ * @brief timeline of OpenCL commands and host phases, written as Chrome trace JSON
+ * @details file can be opened in chrome://tracing or Perfetto UI. Commands are recorded with
+ * queued, submit, start and end profiling counters, so queues must be created with CL_QUEUE_PROFILING_ENABLE.
+ * Device counters use device clock, they are moved to host clock with offset estimated per track as the
+ * smallest difference between host time of recording and end of command, so commands must be recorded
+ * soon after they are complete, e.g. right after clWaitForEvents or in event callback.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <mutex>
+#include "CL/opencl.h"
+
+/** maximal number of tracks, track 0 is host */
+#define TRACE_MAX_TRACKS 16
+#define TRACE_HOST 0
+
+/**
+ * One host phase or device command, device times are in device clock
+ */
+struct trace_record {
+    const char *name;
+    int track;
+    bool device;
+    uint64_t queued;
+    uint64_t submit;
+    uint64_t start;
+    uint64_t end;
+};
+typedef struct trace_record trace_record;
+
+/**
+ * Recorded timeline
+ */
+struct trace_log {
+    bool enabled;
+    trace_record *records;
+    size_t count;
+    size_t capacity;
+    const char *track_names[TRACE_MAX_TRACKS];
+    bool offset_known[TRACE_MAX_TRACKS];
+    int64_t offset[TRACE_MAX_TRACKS];
+    /** commands may be recorded from callbacks of OpenCL runtime */
+    std::mutex lock;
+};
+typedef struct trace_log trace_log;
+
+/** timeline of process, it is recorded only if enabled is set */
+static trace_log trace;
+
+/**
+ * @brief host time
+ * @return monotonic time in ns
+ */
+static inline uint64_t trace_now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+/**
+ * @brief add record, caller holds lock
+ * @param record record
+ * @return void
+ */
+static inline void trace_push(const trace_record *record) {
+    if (trace.count == trace.capacity) {
+        size_t capacity = trace.capacity ? 2 * trace.capacity : 1024;
+        trace_record *records = (trace_record*)realloc(trace.records, capacity * sizeof(trace_record));
+        if (!records) {
+            return;
+        }
+        trace.records = records;
+        trace.capacity = capacity;
+    }
+    trace.records[trace.count++] = *record;
+}
+
+/**
+ * @brief name track, it is shown as thread name
+ * @param track track
+ * @param name name, it must live until trace_write
+ * @return void
+ */
+static inline void trace_name_track(int track, const char *name) {
+    if (track < TRACE_MAX_TRACKS) {
+        trace.track_names[track] = name;
+    }
+}
+
+/**
+ * @brief record host phase which started at start and ends now
+ * @param name phase name, it must live until trace_write
+ * @param start start from trace_now()
+ * @return void
+ */
+static inline void trace_host(const char *name, uint64_t start) {
+    if (!trace.enabled) {
+        return;
+    }
+    uint64_t end = trace_now();
+    trace_record record = {name, TRACE_HOST, false, start, start, start, end};
+    std::lock_guard<std::mutex> guard(trace.lock);
+    trace_push(&record);
+}
+
+/**
+ * @brief record complete OpenCL command
+ * @param event event of command
+ * @param name command name, it must live until trace_write
+ * @param track track of queue, 1 or more
+ * @return void
+ */
+static inline void trace_cl_event(cl_event event, const char *name, int track) {
+    if (!trace.enabled || !event || (track <= TRACE_HOST) || (track >= TRACE_MAX_TRACKS)) {
+        return;
+    }
+    cl_ulong times[4];
+    const cl_profiling_info info[4] = {CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+        CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+    for (int i = 0; i < 4; i++) {
+        if (clGetEventProfilingInfo(event, info[i], sizeof(cl_ulong), &times[i], NULL) != CL_SUCCESS) {
+            return;
+        }
+    }
+    int64_t offset = (int64_t)(trace_now() - times[3]);
+    trace_record record = {name, track, true, times[0], times[1], times[2], times[3]};
+    std::lock_guard<std::mutex> guard(trace.lock);
+    if (!trace.offset_known[track] || (offset < trace.offset[track])) {
+        trace.offset[track] = offset;
+        trace.offset_known[track] = true;
+    }
+    trace_push(&record);
+}
+
+/**
+ * @brief write timeline as Chrome trace JSON, times are in microseconds from the first record
+ * @param file_name output file
+ * @return True if written, False otherwise
+ */
+static inline bool trace_write(const char *file_name) {
+    std::lock_guard<std::mutex> guard(trace.lock);
+    FILE *fp = fopen(file_name, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open trace file %s\n", file_name);
+        return false;
+    }
+    uint64_t origin = UINT64_MAX;
+    for (size_t i = 0; i < trace.count; i++) {
+        const trace_record *record = &trace.records[i];
+        uint64_t start = record->device ? record->queued + trace.offset[record->track] : record->start;
+        if (start < origin) {
+            origin = start;
+        }
+    }
+    fprintf(fp, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (int track = 0; track < TRACE_MAX_TRACKS; track++) {
+        if (trace.track_names[track]) {
+            fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", track, trace.track_names[track]);
+            first = false;
+        }
+    }
+    for (size_t i = 0; i < trace.count; i++) {
+        const trace_record *record = &trace.records[i];
+        int64_t offset = record->device ? trace.offset[record->track] : 0;
+        double start = (double)((int64_t)(record->start + offset) - (int64_t)origin) / 1000.0;
+        double duration = (double)(record->end - record->start) / 1000.0;
+        fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            first ? "" : ",\n", record->name, record->device ? "device" : "host", record->track, start, duration);
+        if (record->device) {
+            /** time in queue before submit to device and before start of execution */
+            fprintf(fp, ",\"args\":{\"queued_us\":%.3f,\"submit_to_start_us\":%.3f}",
+                (double)(record->submit - record->queued) / 1000.0, (double)(record->start - record->submit) / 1000.0);
+        }
+        fprintf(fp, "}");
+        first = false;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    printf("trace of %zu records is written to %s\n", trace.count, file_name);
+    return true;
+}
+
+/**
+ * @brief release records
+ * @return void
+ */
+static inline void trace_free() {
+    std::lock_guard<std::mutex> guard(trace.lock);
+    free(trace.records);
+    trace.records = NULL;
+    trace.count = 0;
+    trace.capacity = 0;
+}
+
+#endif